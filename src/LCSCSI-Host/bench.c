@@ -0,0 +1,663 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tm_stm32_fatfs.h"
+
+// Firmware includes
+#include "hostadapter.h"
+#include "scsi.h"
+#include "filesystem.h"
+#include "debug.h"
+#include "latency.h"
+#include "trace.h"
+
+#include "sim.h"
+
+// Host benchmark driver
+//
+// Formats an SD card image, creates a LUN image on it and then drives the unmodified
+// firmware SCSI emulation with READ(6)/WRITE(6) commands from the virtual initiator.
+
+// Default geometry of the SD card image and the LUN image (in 512 byte sectors)
+#define BENCH_IMAGE_SECTORS		524288		// 256 Mbytes
+#define BENCH_LUN_SECTORS		126720		// 16 heads * 240 cylinders * 33 sectors
+
+// Maximum number of blocks per command
+#define BENCH_MAX_BLOCKS		1024
+
+// Maximum number of scsiProcessEmulation() calls allowed for a single command
+#define BENCH_STATE_LIMIT		1000
+
+// Benchmark workloads
+#define BENCH_SEQUENTIAL_READ	0
+#define BENCH_RANDOM_READ		1
+#define BENCH_SEQUENTIAL_WRITE	2
+#define BENCH_RANDOM_WRITE		3
+#define BENCH_WORKLOAD_COUNT	4
+
+static const char *benchWorkloadNames[BENCH_WORKLOAD_COUNT] =
+{
+	"sequential READ",
+	"random READ",
+	"sequential WRITE",
+	"random WRITE"
+};
+
+// Benchmark options
+struct benchOptionsStruct
+{
+	const char *imagePath;
+	uint32_t commands;
+	uint32_t blocks;
+	uint8_t lunNumber;
+	uint8_t cdbLength;		// 6 = READ(6)/WRITE(6), 10 = READ(10)/WRITE(10)
+	bool disconnect;		// Send IDENTIFY with the disconnect privilege before each command
+	uint8_t queueDepth;		// Tagged commands outstanding at once (0 = untagged commands)
+	bool sync;				// Negotiate synchronous transfers (SDTR) before the workloads
+	bool verify;			// Stamp every block with its LBA and check the data read back
+	bool latency;			// Read the latency histograms (READ LATENCY) after each workload
+	const char *tracePath;	// Save a READ TRACE capture of each workload to <path>-<workload>.bin
+	bool keepImage;
+} benchOptions;
+
+uint8_t benchBuffer[BENCH_MAX_BLOCKS * SECTOR_SIZE];
+uint32_t benchRandomState = 0x2545F491;
+
+// Simple xorshift generator (fixed seed so runs are repeatable)
+static uint32_t benchRandom(void)
+{
+	benchRandomState ^= benchRandomState << 13;
+	benchRandomState ^= benchRandomState >> 17;
+	benchRandomState ^= benchRandomState << 5;
+	return benchRandomState;
+}
+
+static double benchSeconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Format the SD card image and create the LUN image for the benchmark
+static bool benchPrepareImage(void)
+{
+	FATFS fsObject;
+	FIL fileObject;
+	FRESULT fsResult;
+	char fileName[64];
+	uint8_t workBuffer[4096];
+
+	if (!simDiskOpen(benchOptions.imagePath, BENCH_IMAGE_SECTORS))
+	{
+		fprintf(stderr, "bench: could not open image %s\n", benchOptions.imagePath);
+		return false;
+	}
+
+	fsResult = f_mkfs("SD:", FM_ANY, 0, workBuffer, sizeof(workBuffer));
+	if (fsResult != FR_OK)
+	{
+		fprintf(stderr, "bench: f_mkfs failed (%d)\n", fsResult);
+		return false;
+	}
+
+	f_mount(&fsObject, "SD:", 1);
+	f_mkdir("/BeebSCSI0");
+
+	sprintf(fileName, "/BeebSCSI0/scsi%d.dat", benchOptions.lunNumber);
+	fsResult = f_open(&fileObject, fileName, FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
+	if (fsResult == FR_OK) fsResult = f_expand(&fileObject, (FSIZE_t)BENCH_LUN_SECTORS * SECTOR_SIZE, 1);
+	f_close(&fileObject);
+	f_mount(NULL, "SD:", 0);
+
+	if (fsResult != FR_OK)
+	{
+		fprintf(stderr, "bench: could not create LUN image (%d)\n", fsResult);
+		return false;
+	}
+
+	return true;
+}
+
+// Select the target with a command (tag is SIM_UNTAGGED for an untagged command)
+static void benchSelect(uint8_t tag, const uint8_t *cdb, uint8_t cdbLength, uint8_t *dataBuffer, uint32_t dataLength)
+{
+	uint8_t message[3];
+
+	simInitiatorCommand(tag, cdb, cdbLength, dataBuffer, dataLength);
+
+	// IDENTIFY (allowing the target to disconnect) and the queue tag in the message out
+	// phase after selection
+	message[0] = 0xC0 | benchOptions.lunNumber;
+	message[1] = 0x20;  // SIMPLE QUEUE TAG
+	message[2] = tag;
+	if (tag != SIM_UNTAGGED) simInitiatorMessageOut(message, 3);
+	else if (benchOptions.disconnect) simInitiatorMessageOut(message, 1);
+}
+
+// Run the firmware until the command with the tag completes (or, if untilBusFree is set,
+// until the target releases the bus after queueing the command)
+static bool benchRun(uint8_t tag, bool untilBusFree)
+{
+	uint32_t stateCount;
+
+	for (stateCount = 0; stateCount < BENCH_STATE_LIMIT && !simInitiatorComplete(tag); stateCount++)
+	{
+		if (untilBusFree && simInitiatorBusFree()) return true;
+
+		scsiProcessEmulation();
+
+		// Idle write-back (as in the firmware main loop)
+		filesystemFlushIdleWriteCache();
+
+		// Did the host reset? (as in the firmware main loop)
+		if (hostadapterReadResetFlag())
+		{
+			hostadapterReset();
+			filesystemReset();
+			scsiReset();
+			hostadapterWriteResetFlag(false);
+		}
+	}
+
+	if (!simInitiatorComplete(tag))
+	{
+		fprintf(stderr, "bench: command with tag %u did not complete\n", tag);
+		return false;
+	}
+
+	return simInitiatorStatus(tag) == 0x00;
+}
+
+// Fill a block with a pattern unique to its LBA
+static void benchStampBlock(uint8_t *block, uint32_t logicalBlockAddress)
+{
+	uint32_t word;
+	uint32_t value;
+
+	for (word = 0; word < SECTOR_SIZE / 4; word++)
+	{
+		value = logicalBlockAddress * (SECTOR_SIZE / 4) + word;
+		memcpy(block + word * 4, &value, 4);
+	}
+}
+
+// Return the number of blocks that do not hold the pattern for their LBA
+static uint32_t benchCheckBlocks(const uint8_t *data, uint32_t logicalBlockAddress, uint32_t blocks)
+{
+	uint8_t expected[SECTOR_SIZE];
+	uint32_t block;
+	uint32_t mismatches = 0;
+
+	for (block = 0; block < blocks; block++)
+	{
+		benchStampBlock(expected, logicalBlockAddress + block);
+		if (memcmp(data + (size_t)block * SECTOR_SIZE, expected, SECTOR_SIZE) != 0) mismatches++;
+	}
+
+	return mismatches;
+}
+
+// Issue a single command to the target and run the firmware until it completes
+static bool benchCommand(const uint8_t *cdb, uint8_t cdbLength, uint8_t *dataBuffer, uint32_t dataLength)
+{
+	benchSelect(SIM_UNTAGGED, cdb, cdbLength, dataBuffer, dataLength);
+	return benchRun(SIM_UNTAGGED, false);
+}
+
+// Names of the fixed latency histograms (after the opcode and LUN histograms)
+static const char *benchLatencyNames[LATENCY_HISTOGRAMS - LATENCY_HISTOGRAM_COMMAND] =
+{
+	"command", "setup", "data", "status", "SD read", "SD write", "ACK wait"
+};
+
+// Upper bound (in microseconds) of the latency bucket holding the given fraction of the counts
+static double benchLatencyPercentile(const uint8_t *histogram, uint32_t count, double fraction, uint32_t clock)
+{
+	uint32_t counted = 0;
+	uint8_t bucket;
+
+	for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+	{
+		counted += ((uint32_t)histogram[bucket * 4] << 24) | ((uint32_t)histogram[bucket * 4 + 1] << 16) |
+			((uint32_t)histogram[bucket * 4 + 2] << 8) | histogram[bucket * 4 + 3];
+		if (counted >= fraction * count) break;
+	}
+
+	return (double)(2ULL << bucket) * 1e6 / clock;
+}
+
+// Read (and clear) the firmware latency histograms with READ LATENCY; optionally show them
+static void benchReadLatency(bool show)
+{
+	static uint8_t report[LATENCY_REPORT_LENGTH];
+	uint8_t cdb[6] = { 0xD8, 0x01, 0x00, LATENCY_REPORT_LENGTH >> 8, LATENCY_REPORT_LENGTH & 0xFF, 0x00 };
+	const uint8_t *histogram;
+	uint32_t clock;
+	uint32_t count;
+	uint8_t number;
+	uint8_t bucket;
+	char name[16];
+
+	if (!benchCommand(cdb, 6, report, sizeof(report)) || report[0] != LATENCY_REPORT_FORMAT)
+	{
+		if (show) printf("  latency: READ LATENCY failed\n");
+		return;
+	}
+	if (!show) return;
+
+	clock = ((uint32_t)report[4] << 24) | ((uint32_t)report[5] << 16) | ((uint32_t)report[6] << 8) | report[7];
+	for (number = 0; number < report[1]; number++)
+	{
+		histogram = report + LATENCY_REPORT_HEADER + (size_t)number * LATENCY_BUCKETS * 4;
+		for (bucket = 0, count = 0; bucket < LATENCY_BUCKETS; bucket++)
+		{
+			count += ((uint32_t)histogram[bucket * 4] << 24) | ((uint32_t)histogram[bucket * 4 + 1] << 16) |
+				((uint32_t)histogram[bucket * 4 + 2] << 8) | histogram[bucket * 4 + 3];
+		}
+		if (count == 0) continue;
+
+		if (number < LATENCY_HISTOGRAM_LUN) snprintf(name, sizeof(name), "opcode 0x%02X", report[12 + number]);
+		else if (number < LATENCY_HISTOGRAM_COMMAND) snprintf(name, sizeof(name), "LUN %u", number - LATENCY_HISTOGRAM_LUN);
+		else snprintf(name, sizeof(name), "%s", benchLatencyNames[number - LATENCY_HISTOGRAM_COMMAND]);
+
+		printf("  latency %-11s %7u  p50 < %.2f us  p99 < %.2f us\n", name, count,
+			benchLatencyPercentile(histogram, count, 0.5, clock), benchLatencyPercentile(histogram, count, 0.99, clock));
+	}
+}
+
+// Send READ TRACE; with a path the capture is saved for lcscsi-trace
+// control is CDB byte 1 (bit 0 clears the trace, bit 1 starts and bit 2 stops tracing)
+static void benchReadTrace(uint8_t control, const char *path)
+{
+	static uint8_t report[TRACE_REPORT_LENGTH];
+	uint16_t allocationLength = path != NULL ? TRACE_REPORT_LENGTH : 0;
+	uint8_t cdb[6] = { 0xD9, control, 0x00, allocationLength >> 8, allocationLength & 0xFF, 0x00 };
+	uint32_t length;
+	FILE *capture;
+
+	if (!benchCommand(cdb, 6, report, allocationLength))
+	{
+		printf("  trace: READ TRACE failed\n");
+		return;
+	}
+	if (path == NULL) return;
+
+	length = TRACE_REPORT_HEADER + (((uint32_t)report[2] << 8) | report[3]) * TRACE_ENTRY_SIZE;
+	capture = fopen(path, "wb");
+	if (capture == NULL || fwrite(report, 1, length, capture) != length)
+	{
+		perror(path);
+		if (capture != NULL) fclose(capture);
+		return;
+	}
+	fclose(capture);
+
+	printf("  trace: %u of %u events saved to %s\n", ((uint32_t)report[2] << 8) | report[3],
+		((uint32_t)report[8] << 24) | ((uint32_t)report[9] << 16) | ((uint32_t)report[10] << 8) | report[11], path);
+}
+
+// Run one workload and report the results
+static void benchRunWorkload(uint8_t workload)
+{
+	uint8_t cdb[10];
+	uint8_t *dataBuffer;
+	uint8_t tag = 0;
+	uint8_t batchTag;
+	uint32_t batchLogicalBlockAddress[SIM_TAG_COUNT];
+	uint32_t mismatches = 0;
+	uint32_t block;
+	uint32_t lbaRange = BENCH_LUN_SECTORS - benchOptions.blocks;
+	uint32_t logicalBlockAddress = 0;
+	uint32_t failures = 0;
+	uint32_t commandNumber;
+	uint64_t totalCycles = 0;
+	uint64_t bytes;
+	double startTime, elapsed;
+	uint8_t phase;
+	char tracePath[256];
+
+	bool writeCommand = (workload == BENCH_SEQUENTIAL_WRITE || workload == BENCH_RANDOM_WRITE);
+	bool randomAccess = (workload == BENCH_RANDOM_READ || workload == BENCH_RANDOM_WRITE);
+
+	if (benchOptions.latency) benchReadLatency(false);
+	if (benchOptions.tracePath != NULL) benchReadTrace(0x03, NULL);
+	simResetStatistics();
+	startTime = benchSeconds();
+
+	for (commandNumber = 0; commandNumber < benchOptions.commands; commandNumber++)
+	{
+		if (randomAccess) logicalBlockAddress = benchRandom() % lbaRange;
+		else if (logicalBlockAddress >= lbaRange) logicalBlockAddress = 0;
+
+		if (benchOptions.cdbLength == 6)
+		{
+			cdb[0] = writeCommand ? 0x0A : 0x08;
+			cdb[1] = (benchOptions.lunNumber << 5) | ((logicalBlockAddress >> 16) & 0x1F);
+			cdb[2] = (logicalBlockAddress >> 8) & 0xFF;
+			cdb[3] = logicalBlockAddress & 0xFF;
+			cdb[4] = benchOptions.blocks & 0xFF;  // 0 = 256 blocks
+			cdb[5] = 0x00;
+		}
+		else
+		{
+			memset(cdb, 0, sizeof(cdb));
+			cdb[0] = writeCommand ? 0x2A : 0x28;
+			cdb[1] = benchOptions.lunNumber << 5;
+			cdb[2] = (logicalBlockAddress >> 24) & 0xFF;
+			cdb[3] = (logicalBlockAddress >> 16) & 0xFF;
+			cdb[4] = (logicalBlockAddress >> 8) & 0xFF;
+			cdb[5] = logicalBlockAddress & 0xFF;
+			cdb[7] = (benchOptions.blocks >> 8) & 0xFF;
+			cdb[8] = benchOptions.blocks & 0xFF;
+		}
+
+		// Each outstanding command has its own part of the buffer
+		dataBuffer = benchBuffer + (size_t)tag * benchOptions.blocks * SECTOR_SIZE;
+		if (writeCommand && benchOptions.verify)
+		{
+			for (block = 0; block < benchOptions.blocks; block++)
+				benchStampBlock(dataBuffer + (size_t)block * SECTOR_SIZE, logicalBlockAddress + block);
+		}
+		else if (writeCommand) memset(dataBuffer, commandNumber & 0xFF, benchOptions.blocks * SECTOR_SIZE);
+
+		if (benchOptions.queueDepth == 0)
+		{
+			if (!benchCommand(cdb, benchOptions.cdbLength, dataBuffer, benchOptions.blocks * SECTOR_SIZE)) failures++;
+			else if (!writeCommand && benchOptions.verify)
+				mismatches += benchCheckBlocks(dataBuffer, logicalBlockAddress, benchOptions.blocks);
+		}
+		else
+		{
+			// Queue the command, then wait for the batch once the queue depth is reached
+			benchSelect(tag, cdb, benchOptions.cdbLength, dataBuffer, benchOptions.blocks * SECTOR_SIZE);
+			benchRun(tag, true);
+			batchLogicalBlockAddress[tag] = logicalBlockAddress;
+			tag++;
+
+			if (tag == benchOptions.queueDepth || commandNumber + 1 == benchOptions.commands)
+			{
+				for (batchTag = 0; batchTag < tag; batchTag++)
+				{
+					if (!benchRun(batchTag, false)) failures++;
+					else if (!writeCommand && benchOptions.verify)
+						mismatches += benchCheckBlocks(benchBuffer + (size_t)batchTag * benchOptions.blocks * SECTOR_SIZE,
+							batchLogicalBlockAddress[batchTag], benchOptions.blocks);
+				}
+				tag = 0;
+			}
+		}
+
+		if (!randomAccess) logicalBlockAddress += benchOptions.blocks;
+	}
+
+	// Write workloads finish with SYNCHRONIZE CACHE so the write-back is measured too
+	if (writeCommand)
+	{
+		memset(cdb, 0, sizeof(cdb));
+		cdb[0] = 0x35;
+		cdb[1] = benchOptions.lunNumber << 5;
+		if (!benchCommand(cdb, 10, NULL, 0)) failures++;
+	}
+
+	elapsed = benchSeconds() - startTime;
+	bytes = writeCommand ? simStatistics.bytesOut : simStatistics.bytesIn;
+
+	for (phase = 0; phase < SIM_PHASE_COUNT; phase++) totalCycles += simStatistics.phaseCycles[phase];
+
+	printf("%s(%u): %u commands of %u blocks, %u failed\n", benchWorkloadNames[workload], benchOptions.cdbLength,
+		benchOptions.commands, benchOptions.blocks, failures);
+	printf("  %.0f commands/s, %.2f us/command, %.2f MB/s (%llu bytes on the bus, %.1f ms modelled delay)\n",
+		(double)benchOptions.commands / elapsed,
+		elapsed * 1e6 / (double)benchOptions.commands,
+		(double)bytes / elapsed / (1024.0 * 1024.0),
+		(unsigned long long)bytes,
+		(double)simStatistics.delayMicroseconds / 1000.0);
+	printf("  disk per command: %.2f reads (%.2f sectors), %.2f writes (%.2f sectors)\n",
+		(double)simStatistics.diskReads / benchOptions.commands,
+		(double)simStatistics.diskSectorsRead / benchOptions.commands,
+		(double)simStatistics.diskWrites / benchOptions.commands,
+		(double)simStatistics.diskSectorsWritten / benchOptions.commands);
+	if (benchOptions.disconnect || benchOptions.queueDepth != 0)
+		printf("  disconnects per command: %.2f (%u reselections)\n",
+			(double)simStatistics.disconnects / benchOptions.commands, simStatistics.reselections);
+	if (benchOptions.verify && !writeCommand)
+		printf("  verify: %u of %u blocks did not match\n", mismatches, benchOptions.commands * benchOptions.blocks);
+	if (benchOptions.sync)
+		printf("  synchronous data bytes: %.1f%%\n", bytes ? 100.0 * (double)simStatistics.bytesSync / (double)bytes : 0.0);
+	printf("  cycles per command:");
+	for (phase = 0; phase < SIM_PHASE_COUNT; phase++)
+	{
+		if (phase == SIM_PHASE_BUSFREE || simStatistics.phaseCycles[phase] == 0) continue;
+		printf(" %s %llu", simPhaseNames[phase],
+			(unsigned long long)(simStatistics.phaseCycles[phase] / benchOptions.commands));
+	}
+	printf(" (total %llu)\n", (unsigned long long)(totalCycles / benchOptions.commands));
+	if (benchOptions.latency) benchReadLatency(true);
+	if (benchOptions.tracePath != NULL)
+	{
+		snprintf(tracePath, sizeof(tracePath), "%s-%u.bin", benchOptions.tracePath, workload);
+		benchReadTrace(0x05, tracePath);
+	}
+}
+
+// Write (stamp) or read back and check the whole LUN with WRITE(10)/READ(10) commands
+// Returns the number of failed commands plus the number of blocks that did not match
+static uint32_t benchVerifyPass(bool writeCommand)
+{
+	uint8_t cdb[10];
+	uint32_t logicalBlockAddress;
+	uint32_t blocks;
+	uint32_t block;
+	uint32_t errors = 0;
+
+	for (logicalBlockAddress = 0; logicalBlockAddress < BENCH_LUN_SECTORS; logicalBlockAddress += blocks)
+	{
+		blocks = BENCH_LUN_SECTORS - logicalBlockAddress;
+		if (blocks > BENCH_MAX_BLOCKS) blocks = BENCH_MAX_BLOCKS;
+
+		memset(cdb, 0, sizeof(cdb));
+		cdb[0] = writeCommand ? 0x2A : 0x28;
+		cdb[1] = benchOptions.lunNumber << 5;
+		cdb[2] = (logicalBlockAddress >> 24) & 0xFF;
+		cdb[3] = (logicalBlockAddress >> 16) & 0xFF;
+		cdb[4] = (logicalBlockAddress >> 8) & 0xFF;
+		cdb[5] = logicalBlockAddress & 0xFF;
+		cdb[7] = (blocks >> 8) & 0xFF;
+		cdb[8] = blocks & 0xFF;
+
+		if (writeCommand)
+			for (block = 0; block < blocks; block++) benchStampBlock(benchBuffer + (size_t)block * SECTOR_SIZE, logicalBlockAddress + block);
+
+		if (!benchCommand(cdb, 10, benchBuffer, blocks * SECTOR_SIZE)) errors++;
+		else if (!writeCommand) errors += benchCheckBlocks(benchBuffer, logicalBlockAddress, blocks);
+	}
+
+	if (writeCommand)
+	{
+		memset(cdb, 0, sizeof(cdb));
+		cdb[0] = 0x35;
+		cdb[1] = benchOptions.lunNumber << 5;
+		if (!benchCommand(cdb, 10, NULL, 0)) errors++;
+	}
+
+	return errors;
+}
+
+static void benchUsage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-i image] [-n commands] [-b blocks] [-l lun] [-c 6|10] [-d] [-q depth] [-s] [-V] [-H] [-T path] [-k] [-v]\n", name);
+	fprintf(stderr, "  -i image     SD card image file (default lcscsi.img)\n");
+	fprintf(stderr, "  -n commands  Number of commands per workload (default 1000)\n");
+	fprintf(stderr, "  -b blocks    Blocks per command, 1-256 (1-%d with -c 10, default 8)\n", BENCH_MAX_BLOCKS);
+	fprintf(stderr, "  -l lun       Target LUN (default 0)\n");
+	fprintf(stderr, "  -c length    CDB length: 6 for READ(6)/WRITE(6), 10 for READ(10)/WRITE(10) (default 6)\n");
+	fprintf(stderr, "  -d           Allow the target to disconnect (IDENTIFY message before each command)\n");
+	fprintf(stderr, "  -q depth     Queue up to depth SIMPLE tagged commands at once, 1-%d (default untagged)\n", SCSI_QUEUE_DEPTH);
+	fprintf(stderr, "  -s           Negotiate synchronous transfers (SDTR message) before the workloads\n");
+	fprintf(stderr, "  -V           Stamp the LUN with LBA patterns and check all data read back\n");
+	fprintf(stderr, "  -H           Show the firmware latency histograms (READ LATENCY) after each workload\n");
+	fprintf(stderr, "  -T path      Save a READ TRACE capture of each workload to path-<workload>.bin\n");
+	fprintf(stderr, "  -k           Keep the image file afterwards\n");
+	fprintf(stderr, "  -v           Show the firmware debug output\n");
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t testUnitReady[6] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	uint8_t readCapacity[10] = { 0x25, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	uint8_t sdtrMessage[6] = { 0x80, 0x01, 0x03, 0x01, 25, 15 };  // IDENTIFY, SDTR 100nS offset 15
+	uint8_t capacity[8];
+	uint8_t workload;
+	int option;
+
+	benchOptions.imagePath = "lcscsi.img";
+	benchOptions.commands = 1000;
+	benchOptions.blocks = 8;
+	benchOptions.lunNumber = 0;
+	benchOptions.cdbLength = 6;
+	benchOptions.disconnect = false;
+	benchOptions.queueDepth = 0;
+	benchOptions.sync = false;
+	benchOptions.verify = false;
+	benchOptions.latency = false;
+	benchOptions.tracePath = NULL;
+	benchOptions.keepImage = false;
+
+	while ((option = getopt(argc, argv, "i:n:b:l:c:dq:sVHT:kv")) != -1)
+	{
+		switch (option)
+		{
+		case 'i':
+			benchOptions.imagePath = optarg;
+			break;
+
+		case 'n':
+			benchOptions.commands = (uint32_t)strtoul(optarg, NULL, 0);
+			break;
+
+		case 'b':
+			benchOptions.blocks = (uint32_t)strtoul(optarg, NULL, 0);
+			break;
+
+		case 'l':
+			benchOptions.lunNumber = (uint8_t)strtoul(optarg, NULL, 0);
+			break;
+
+		case 'c':
+			benchOptions.cdbLength = (uint8_t)strtoul(optarg, NULL, 0);
+			break;
+
+		case 'd':
+			benchOptions.disconnect = true;
+			break;
+
+		case 'q':
+			benchOptions.queueDepth = (uint8_t)strtoul(optarg, NULL, 0);
+			break;
+
+		case 's':
+			benchOptions.sync = true;
+			break;
+
+		case 'V':
+			benchOptions.verify = true;
+			break;
+
+		case 'H':
+			benchOptions.latency = true;
+			break;
+
+		case 'T':
+			benchOptions.tracePath = optarg;
+			break;
+
+		case 'k':
+			benchOptions.keepImage = true;
+			break;
+
+		case 'v':
+			simVerbose = true;
+			debugFlag_filesystem = true;
+			debugFlag_scsiCommands = true;
+			debugFlag_scsiState = true;
+			debugFlag_fatfs = true;
+			break;
+
+		default:
+			benchUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (benchOptions.commands == 0 || benchOptions.blocks == 0 || benchOptions.lunNumber > 7 ||
+		(benchOptions.cdbLength != 6 && benchOptions.cdbLength != 10) ||
+		benchOptions.blocks > (benchOptions.cdbLength == 6 ? 256 : BENCH_MAX_BLOCKS) ||
+		benchOptions.queueDepth > SCSI_QUEUE_DEPTH ||
+		benchOptions.blocks * (benchOptions.queueDepth ? benchOptions.queueDepth : 1) > BENCH_MAX_BLOCKS)
+	{
+		benchUsage(argv[0]);
+		return 1;
+	}
+
+	if (!benchPrepareImage()) return 1;
+
+	// Same start-up sequence as the firmware
+	debugInitialise();
+	hostadapterInitialise();
+	filesystemInitialise();
+	scsiInitialise();
+
+	// Make sure the target responds before measuring anything
+	if (!benchCommand(testUnitReady, 6, NULL, 0))
+	{
+		fprintf(stderr, "bench: TEST UNIT READY failed\n");
+		return 1;
+	}
+
+	// Check the reported capacity matches the LUN image
+	readCapacity[1] = benchOptions.lunNumber << 5;
+	if (!benchCommand(readCapacity, 10, capacity, sizeof(capacity)) ||
+		(((uint32_t)capacity[0] << 24) | ((uint32_t)capacity[1] << 16) | ((uint32_t)capacity[2] << 8) | capacity[3]) != BENCH_LUN_SECTORS - 1)
+	{
+		fprintf(stderr, "bench: READ CAPACITY failed\n");
+		return 1;
+	}
+
+	// Ask for faster transfers than the target supports; its reply is the agreement
+	if (benchOptions.sync)
+	{
+		sdtrMessage[0] |= benchOptions.lunNumber;
+		simInitiatorCommand(SIM_UNTAGGED, testUnitReady, 6, NULL, 0);
+		simInitiatorMessageOut(sdtrMessage, sizeof(sdtrMessage));
+		if (!benchRun(SIM_UNTAGGED, false) || simInitiatorSyncOffset() == 0)
+		{
+			fprintf(stderr, "bench: SDTR negotiation failed\n");
+			return 1;
+		}
+		printf("SDTR agreement: period %u ns, offset %u\n", simInitiatorSyncPeriod() * 4, simInitiatorSyncOffset());
+	}
+
+	// Stamp the LUN so the read workloads can check what they get back
+	if (benchOptions.verify && benchVerifyPass(true) != 0)
+	{
+		fprintf(stderr, "bench: stamping the LUN failed\n");
+		return 1;
+	}
+
+	for (workload = 0; workload < BENCH_WORKLOAD_COUNT; workload++) benchRunWorkload(workload);
+
+	// Read the whole LUN back after the write workloads
+	if (benchOptions.verify) printf("verify: %u errors reading back the LUN\n", benchVerifyPass(false));
+
+	filesystemDismount();
+	simDiskClose();
+	if (!benchOptions.keepImage) unlink(benchOptions.imagePath);
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*-----------------------------------------------------------------------*/
+/* Low level disk I/O module for the host build                          */
+/* Drive 0 ("SD:") is backed by an image file on the host filesystem     */
+/*-----------------------------------------------------------------------*/
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "diskio.h"
+#include "sim.h"
+
+static int simDiskFd = -1;
+static DWORD simDiskSectors = 0;
+
+// Open (creating or resizing if necessary) the image file backing the SD card
+bool simDiskOpen(const char *path, uint32_t sectorCount)
+{
+	struct stat imageStat;
+
+	simDiskFd = open(path, O_RDWR | O_CREAT, 0644);
+	if (simDiskFd < 0) return false;
+
+	if (fstat(simDiskFd, &imageStat) != 0) return false;
+
+	if (sectorCount != 0 && (uint64_t)imageStat.st_size != (uint64_t)sectorCount * SD_BLOCK_SIZE)
+	{
+		if (ftruncate(simDiskFd, (off_t)sectorCount * SD_BLOCK_SIZE) != 0) return false;
+		simDiskSectors = sectorCount;
+	}
+	else simDiskSectors = (DWORD)(imageStat.st_size / SD_BLOCK_SIZE);
+
+	return simDiskSectors != 0;
+}
+
+void simDiskClose(void)
+{
+	if (simDiskFd >= 0) close(simDiskFd);
+	simDiskFd = -1;
+	simDiskSectors = 0;
+}
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+	return disk_status(pdrv);
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+	if (pdrv != 0) return STA_NOINIT | STA_NODISK;
+	if (simDiskFd < 0) return STA_NOINIT | STA_NODISK;
+
+	return 0;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
+{
+	size_t length = (size_t)count * SD_BLOCK_SIZE;
+
+	if (pdrv != 0 || count == 0) return RES_PARERR;
+	if (simDiskFd < 0) return RES_NOTRDY;
+	if (sector + count > simDiskSectors) return RES_PARERR;
+
+	if (pread(simDiskFd, buff, length, (off_t)sector * SD_BLOCK_SIZE) != (ssize_t)length) return RES_ERROR;
+
+	simStatistics.diskReads++;
+	simStatistics.diskSectorsRead += count;
+
+	return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
+{
+	size_t length = (size_t)count * SD_BLOCK_SIZE;
+
+	if (pdrv != 0 || count == 0) return RES_PARERR;
+	if (simDiskFd < 0) return RES_NOTRDY;
+	if (sector + count > simDiskSectors) return RES_PARERR;
+
+	if (pwrite(simDiskFd, buff, length, (off_t)sector * SD_BLOCK_SIZE) != (ssize_t)length) return RES_ERROR;
+
+	simStatistics.diskWrites++;
+	simStatistics.diskSectorsWritten += count;
+
+	return RES_OK;
+}
+
+// Background transfers complete at once on the host; the result is kept for disk_finish()
+static DRESULT simDiskBackgroundResult = RES_OK;
+
+DRESULT disk_read_start(BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
+{
+	simDiskBackgroundResult = disk_read(pdrv, buff, sector, count);
+	return simDiskBackgroundResult;
+}
+
+DRESULT disk_write_start(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
+{
+	simDiskBackgroundResult = disk_write(pdrv, buff, sector, count);
+	return simDiskBackgroundResult;
+}
+
+DRESULT disk_finish(BYTE pdrv)
+{
+	DRESULT result = simDiskBackgroundResult;
+
+	simDiskBackgroundResult = RES_OK;
+	return result;
+}
+
+BYTE disk_busy(BYTE pdrv)
+{
+	return 0;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+	if (pdrv != 0) return RES_PARERR;
+	if (simDiskFd < 0) return RES_NOTRDY;
+
+	switch (cmd)
+	{
+	case CTRL_SYNC:
+		return RES_OK;
+
+	case GET_SECTOR_COUNT:
+		*(DWORD *)buff = simDiskSectors;
+		return RES_OK;
+
+	case GET_SECTOR_SIZE:
+		*(WORD *)buff = SD_BLOCK_SIZE;
+		return RES_OK;
+
+	case GET_BLOCK_SIZE:
+		*(DWORD *)buff = 1;
+		return RES_OK;
+	}
+
+	return RES_PARERR;
+}
+
+DWORD get_fattime(void)
+{
+	time_t now = time(NULL);
+	struct tm *local = localtime(&now);
+
+	return ((DWORD)(local->tm_year - 80) << 25)
+		| ((DWORD)(local->tm_mon + 1) << 21)
+		| ((DWORD)local->tm_mday << 16)
+		| ((DWORD)local->tm_hour << 11)
+		| ((DWORD)local->tm_min << 5)
+		| ((DWORD)local->tm_sec >> 1);
+}
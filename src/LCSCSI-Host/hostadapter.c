@@ -0,0 +1,251 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+
+// Local includes
+#include "debug.h"
+#include "hostadapter.h"
+#include "sim.h"
+#include "trace.h"
+
+// Simulated host adapter
+//
+// Implements the firmware host adapter interface against the in-process simulated
+// bus (sim.c) rather than the GPIO ports. Every REQ issued by the target is answered
+// immediately by the virtual initiator with ACK, so the firmware's handshake loops
+// never spin.
+
+// Globals for the (simulated) interrupt service routines
+volatile bool nrstFlag = false;
+
+// Synchronous transfer agreement (offset 0 = asynchronous)
+uint8_t syncPeriod = 0;
+uint8_t syncOffset = 0;
+
+// Selection latched by the (simulated) SEL interrupt
+static uint8_t selectionId = 1;
+static bool selectionFlag = false;
+static uint8_t selectionMask;
+
+// Initialise the host adapter hardware (called on a cold-start)
+void hostadapterInitialise(void)
+{
+	simBusInitialise();
+	nrstFlag = false;
+}
+
+// Reset the host adapter (called when the host signals reset)
+void hostadapterReset(void)
+{
+	simBusSetBusy(false);
+	simBusWriteReset(false);
+	TRACE(TRACE_HOST_RESET, 0, 0, 0);
+	hostadapterSetSyncTransfer(0, 0);
+	selectionFlag = false;
+}
+
+// Set the databus direction to input
+void hostadapterDatabusInput(void)
+{
+}
+
+// Set the databus direction to output
+void hostadapterDatabusOutput(void)
+{
+}
+
+// Read a byte from the databus (directly)
+uint8_t hostadapterReadDatabus(void)
+{
+	return simBusReadDatabus();
+}
+
+// Write a byte to the databus (directly)
+void hostadapterWritedatabus(uint8_t databusValue)
+{
+	(void)databusValue;
+}
+
+// Function to read a byte from the host (using REQ/ACK)
+uint8_t hostadapterReadByte(void)
+{
+	if (nrstFlag) return 0;
+	return simInitiatorSendByte();
+}
+
+// Function to write a byte to the host (using REQ/ACK)
+void hostadapterWriteByte(uint8_t databusValue)
+{
+	if (nrstFlag) return;
+	simInitiatorReceiveByte(databusValue);
+}
+
+// Function to write the host reset flag
+void hostadapterWriteResetFlag(bool flagState)
+{
+	nrstFlag = flagState;
+	simBusWriteReset(flagState);
+}
+
+// Function to return the state of the host reset flag
+// Note: the RST line is sampled here in place of the EXTI interrupt
+bool hostadapterReadResetFlag(void)
+{
+	if (simBusReadReset()) nrstFlag = true;
+	return nrstFlag;
+}
+
+// Function to write the data phase flags
+void hostadapterWriteDataPhaseFlags(bool message, bool commandNotData, bool inputNotOutput)
+{
+	simBusSetPhase(message, commandNotData, inputNotOutput);
+}
+
+// Function to write the host busy flag
+void hostadapterWriteBusyFlag(bool flagState)
+{
+	simBusSetBusy(flagState);
+}
+
+bool hostadapterReadBusyFlag(void)
+{
+	return simBusReadBusy();
+}
+
+// Function to write the host request flag
+void hostadapterWriteRequestFlag(bool flagState)
+{
+	(void)flagState;
+}
+
+// Function to read the state of the host select flag
+bool hostadapterReadSelectFlag(void)
+{
+	if (simBusReadReset()) nrstFlag = true;
+	return simBusReadSelect();
+}
+
+// Selection detection
+// Note: The SEL interrupt is modelled by sampling the bus when the emulation asks
+void hostadapterSetSelectionId(uint8_t targetId)
+{
+	selectionId = targetId;
+}
+
+bool hostadapterReadSelectionFlag(void)
+{
+	if (simBusReadReset()) nrstFlag = true;
+	
+	// Latch the ID mask and respond with BSY (as the interrupt does)
+	if (!selectionFlag && simBusReadSelect() && !simBusReadBusy() && (simBusReadDatabus() & (1 << selectionId)))
+	{
+		selectionMask = simBusReadDatabus();
+		selectionFlag = true;
+		simBusSetBusy(true);
+		TRACE(TRACE_HOST_SELECTION, selectionMask, 0, 0);
+	}
+	
+	return selectionFlag;
+}
+
+uint8_t hostadapterReadSelectionMask(void)
+{
+	if (!selectionFlag) return 0;
+	selectionFlag = false;
+	
+	return selectionMask;
+}
+
+// Function to read the state of the host attention flag
+bool hostadapterReadAttentionFlag(void)
+{
+	return simBusReadAttention();
+}
+
+// Function to write the select flag (only driven by the target during reselection)
+void hostadapterWriteSelectFlag(bool flagState)
+{
+	(void)flagState;
+}
+
+// Function to arbitrate for the bus and reselect an initiator (after a disconnect)
+bool hostadapterReselect(uint8_t targetId, uint8_t initiatorId)
+{
+	if (nrstFlag) return false;
+	return simBusReselect(targetId, initiatorId);
+}
+
+// Function to determine if the host adapter is connected to the external or internal
+// host bus
+bool hostadapterConnectedToExternalBus(void)
+{
+	return true;  // External bus
+}
+
+// Set the synchronous transfer agreement for the connected initiator
+// Note: The simulated initiator answers every REQ at once, so synchronous transfers are
+// only counted (the REQ pulses and offset are not modelled)
+void hostadapterSetSyncTransfer(uint8_t period, uint8_t offset)
+{
+	syncPeriod = period;
+	syncOffset = offset;
+}
+
+// Host data transfer functions --------------------------------------------------------
+
+// Send data to the host (data in phase, any length)
+// Returns the number of bytes transferred (less than the length if the host reset)
+uint16_t hostadapterTransferIn(const uint8_t *dataBuffer, uint16_t length)
+{
+	uint16_t transferred;
+	
+	TRACE(TRACE_HOST_TRANSFER_IN, length, syncOffset, 0);
+	hostadapterStartReadDMA(dataBuffer, length);
+	transferred = hostadapterFinishDMA();
+	TRACE(TRACE_HOST_TRANSFER_DONE, transferred, 0, 0);
+	
+	return transferred;
+}
+
+// Receive data from the host (data out phase, any length)
+// Returns the number of bytes transferred (less than the length if the host reset)
+uint16_t hostadapterTransferOut(uint8_t *dataBuffer, uint16_t length)
+{
+	uint16_t transferred;
+	
+	TRACE(TRACE_HOST_TRANSFER_OUT, length, syncOffset, 0);
+	hostadapterStartWriteDMA(dataBuffer, length);
+	transferred = hostadapterFinishDMA();
+	TRACE(TRACE_HOST_TRANSFER_DONE, transferred, 0, 0);
+	
+	return transferred;
+}
+
+// Asynchronous DMA engine
+// Note: The simulated initiator answers every REQ at once, so the block is moved when
+// it is started and is never busy
+static uint16_t dmaTransferred;
+
+void hostadapterStartReadDMA(const uint8_t *dataBuffer, uint16_t length)
+{
+	dmaTransferred = 0;
+	while (dmaTransferred < length && !nrstFlag) simInitiatorReceiveByte(dataBuffer[dmaTransferred++]);
+	if (syncOffset != 0) simStatistics.bytesSync += dmaTransferred;
+}
+
+void hostadapterStartWriteDMA(uint8_t *dataBuffer, uint16_t length)
+{
+	dmaTransferred = 0;
+	while (dmaTransferred < length && !nrstFlag) dataBuffer[dmaTransferred++] = simInitiatorSendByte();
+	if (syncOffset != 0) simStatistics.bytesSync += dmaTransferred;
+}
+
+bool hostadapterDMABusy(void)
+{
+	return false;
+}
+
+uint16_t hostadapterFinishDMA(void)
+{
+	return dmaTransferred;
+}
@@ -0,0 +1,27 @@
+/*-------------------------------------------*/
+/* Integer type definitions for FatFs module */
+/* (host build - force included so that the  */
+/* firmware integer.h is skipped)            */
+/*-------------------------------------------*/
+
+#ifndef _FF_INTEGER
+#define _FF_INTEGER
+
+#include <stdint.h>
+
+/* The firmware integer.h uses long for the 32-bit types, which is 64-bit on an LP64 host */
+typedef int				INT;
+typedef unsigned int	UINT;
+
+typedef unsigned char	BYTE;
+
+typedef short			SHORT;
+typedef unsigned short	WORD;
+typedef unsigned short	WCHAR;
+
+typedef int32_t			LONG;
+typedef uint32_t		DWORD;
+
+typedef uint64_t		QWORD;
+
+#endif
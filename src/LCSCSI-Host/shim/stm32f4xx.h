@@ -0,0 +1,29 @@
+#include <stdint.h>
+
+#pragma once
+// Host build replacement for the CMSIS device header
+
+// Interrupts do not exist on the host; the simulated bus is polled in-process
+static inline void __disable_irq(void) {}
+static inline void __enable_irq(void) {}
+static inline uint32_t __get_PRIMASK(void) { return 0; }
+static inline void __set_PRIMASK(uint32_t priMask) { (void)priMask; }
+
+// DWT cycle counter (reads the simulator cycle count)
+typedef struct
+{
+	uint32_t CYCCNT;
+} DWT_Type;
+
+uint64_t simCycles(void);
+
+static inline DWT_Type *simDwt(void)
+{
+	static DWT_Type dwt;
+	dwt.CYCCNT = (uint32_t)simCycles();
+	return &dwt;
+}
+#define DWT (simDwt())
+
+// Nominal cycle counter clock (see sim.c)
+extern uint32_t SystemCoreClock;
@@ -0,0 +1,11 @@
+#include <stdint.h>
+
+#pragma once
+// Host build replacement for the TM delay library header
+// Note: delays are accounted by the simulator rather than slept
+
+#include "sim.h"
+
+static inline void Delay(uint32_t micros) { simDelayMicroseconds(micros); }
+static inline void Delayms(uint32_t millis) { simDelayMicroseconds(millis * 1000); }
+static inline uint32_t HAL_GetTick(void) { return simMilliseconds(); }
@@ -0,0 +1,5 @@
+#pragma once
+// Host build replacement for the TM FatFs library header
+
+#include "ff.h"
+#include "diskio.h"
@@ -0,0 +1,6 @@
+#include <string.h>
+
+#pragma once
+// Host build replacement for the TM general library header
+
+#include "stm32f4xx.h"
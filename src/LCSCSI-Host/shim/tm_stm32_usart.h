@@ -0,0 +1,15 @@
+#include <stdio.h>
+
+#pragma once
+// Host build replacement for the TM USART library header
+// Debug output goes to stderr when the simulator is run verbose
+
+#include "sim.h"
+
+#define USART2	((void *)0)
+
+static inline void TM_USART_Puts(void *USARTx, char *str)
+{
+	(void)USARTx;
+	if (simVerbose) fputs(str, stderr);
+}
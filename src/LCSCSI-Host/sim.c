@@ -0,0 +1,491 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "sim.h"
+
+// Simulated bus state
+// Note: signals are held here in positive logic; the real bus is inverted
+struct simBusStruct
+{
+	bool sel;					// SEL (driven by the initiator)
+	bool atn;					// ATN (driven by the initiator)
+	bool rst;					// RST (driven by the initiator, latched like nrstFlag)
+	bool bsy;					// BSY (driven by the target)
+	uint8_t databus;			// Databus value driven by the initiator during selection
+
+	uint8_t phase;				// Current phase (for cycle accounting)
+	uint64_t phaseStart;		// Cycle count at the start of the current phase
+} simBus;
+
+// Virtual initiator command (one per queue tag, plus the untagged command)
+struct simTaskStruct
+{
+	uint8_t cdb[16];
+	uint8_t cdbLength;
+	uint8_t cdbPointer;
+
+	uint8_t *dataBuffer;
+	uint32_t dataLength;
+	uint32_t dataPointer;
+	uint32_t savedDataPointer;	// Set by SAVE DATA POINTER, restored by RESTORE POINTERS
+
+	uint8_t status;
+	uint8_t message;
+	bool complete;
+	bool disconnected;			// Target has disconnected and will reselect
+	bool overrun;				// Target asked for (or sent) more bytes than the initiator expected
+};
+
+// Virtual initiator state
+struct simInitiatorStruct
+{
+	struct simTaskStruct tasks[SIM_TAG_COUNT + 1];
+	struct simTaskStruct *task;	// Command of the current nexus (NULL until a reselecting target identifies it)
+
+	uint8_t messageOut[16];
+	uint8_t messageOutLength;
+	uint8_t messageOutPointer;
+
+	uint8_t messageIn;			// First byte of a multi-byte message in (queue tag and extended messages)
+	uint8_t extendedMessage[8];	// Extended message in (length, code and arguments)
+	uint8_t extendedPointer;
+
+	uint8_t syncPeriod;			// Synchronous transfer agreement from the target's SDTR reply
+	uint8_t syncOffset;			// (0 = asynchronous)
+} simInitiator;
+
+// Placeholder for bytes transferred without a nexus
+static struct simTaskStruct simNoTask;
+
+struct simStatisticsStruct simStatistics;
+bool simVerbose = false;
+
+// Rate of simCycles() (the firmware reads it as the DWT cycle counter clock)
+uint32_t SystemCoreClock = 1000000000;
+
+const char *simPhaseNames[SIM_PHASE_COUNT] =
+{
+	"bus free",
+	"selection",
+	"command",
+	"data in",
+	"data out",
+	"status",
+	"message in",
+	"message out"
+};
+
+// Timing functions ---------------------------------------------------------------------
+
+// Returns a free-running cycle count (TSC where available, otherwise nanoseconds)
+uint64_t simCycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Delays are modelled rather than slept so that the benchmark measures the firmware
+// code paths; the requested time is reported separately
+void simDelayMicroseconds(uint32_t microseconds)
+{
+	simStatistics.delayMicroseconds += microseconds;
+}
+
+// Millisecond tick (real time plus any modelled delay)
+uint32_t simMilliseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint32_t)((uint64_t)now.tv_sec * 1000ULL + (uint64_t)now.tv_nsec / 1000000ULL +
+		simStatistics.delayMicroseconds / 1000ULL);
+}
+
+// Clear the accumulated bus statistics
+void simResetStatistics(void)
+{
+	memset(&simStatistics, 0, sizeof(simStatistics));
+	simBus.phaseStart = simCycles();
+}
+
+// Account the cycles spent in the current phase and move to the next
+static void simBusAccountPhase(uint8_t phase)
+{
+	uint64_t now = simCycles();
+
+	simStatistics.phaseCycles[simBus.phase] += now - simBus.phaseStart;
+	simBus.phase = phase;
+	simBus.phaseStart = now;
+}
+
+// Bus signal functions -----------------------------------------------------------------
+
+void simBusInitialise(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	// Measure the TSC rate against the monotonic clock (10mS)
+	struct timespec start, now;
+	uint64_t startCycles = simCycles();
+	uint64_t elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (uint64_t)(now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec;
+	} while (elapsed < 10000000ULL);
+	SystemCoreClock = (uint32_t)((simCycles() - startCycles) * 1000000000ULL / elapsed);
+#endif
+
+	simBus.sel = false;
+	simBus.atn = false;
+	simBus.rst = false;
+	simBus.bsy = false;
+	simBus.databus = 0;
+	simBus.phase = SIM_PHASE_BUSFREE;
+	simBus.phaseStart = simCycles();
+}
+
+// Target sets MSG, C/D and I/O
+void simBusSetPhase(bool message, bool commandNotData, bool inputNotOutput)
+{
+	uint8_t phase;
+
+	// MSG	CD	IO
+	// 0	0	0	Data out phase
+	// 0	0	1	Data in phase
+	// 0	1	0	Command phase
+	// 0	1	1	Status phase
+	// 1	1	0	Message out phase
+	// 1	1	1	Message in phase
+	if (message) phase = inputNotOutput ? SIM_PHASE_MESSAGEIN : SIM_PHASE_MESSAGEOUT;
+	else if (commandNotData) phase = inputNotOutput ? SIM_PHASE_STATUS : SIM_PHASE_COMMAND;
+	else phase = inputNotOutput ? SIM_PHASE_DATAIN : SIM_PHASE_DATAOUT;
+
+	// The target resets the bus to data out when it goes bus free; don't count that as a phase
+	if (simBus.phase == SIM_PHASE_BUSFREE && phase == SIM_PHASE_DATAOUT) return;
+
+	if (phase != simBus.phase) simBusAccountPhase(phase);
+}
+
+// Target drives BSY
+void simBusSetBusy(bool flagState)
+{
+	simBus.bsy = flagState;
+
+	// The initiator releases SEL as soon as the target responds with BSY
+	if (flagState && simBus.sel)
+	{
+		simBus.sel = false;
+		simBus.databus = 0;
+	}
+
+	// Releasing BSY returns the bus to the bus free phase
+	if (!flagState && simBus.phase != SIM_PHASE_BUSFREE) simBusAccountPhase(SIM_PHASE_BUSFREE);
+}
+
+bool simBusReadSelect(void)
+{
+	return simBus.sel;
+}
+
+bool simBusReadBusy(void)
+{
+	return simBus.bsy;
+}
+
+bool simBusReadAttention(void)
+{
+	return simBus.atn;
+}
+
+uint8_t simBusReadDatabus(void)
+{
+	return simBus.databus;
+}
+
+bool simBusReadReset(void)
+{
+	return simBus.rst;
+}
+
+void simBusWriteReset(bool flagState)
+{
+	simBus.rst = flagState;
+}
+
+// Target arbitrates and reselects the initiator; returns true if the initiator responds
+// Note: There is only one initiator so arbitration always succeeds
+bool simBusReselect(uint8_t targetId, uint8_t initiatorId)
+{
+	uint8_t tag;
+	bool disconnected = false;
+
+	if (simBus.bsy || simBus.sel || simBus.rst) return false;
+	if (targetId != SIM_TARGET_ID || initiatorId != SIM_INITIATOR_ID) return false;
+
+	for (tag = 0; tag <= SIM_TAG_COUNT; tag++) disconnected |= simInitiator.tasks[tag].disconnected;
+	if (!disconnected) return false;
+
+	// The nexus is restored by the IDENTIFY (and queue tag) messages
+	simBusAccountPhase(SIM_PHASE_SELECTION);
+	simInitiator.task = NULL;
+	simInitiator.messageIn = 0;
+	simStatistics.reselections++;
+	simBus.bsy = true;
+
+	return true;
+}
+
+// Initiator REQ/ACK functions ----------------------------------------------------------
+
+// The target has asserted REQ in an output phase; return the byte the initiator places on the bus
+uint8_t simInitiatorSendByte(void)
+{
+	struct simTaskStruct *task = simInitiator.task != NULL ? simInitiator.task : &simNoTask;
+
+	switch (simBus.phase)
+	{
+	case SIM_PHASE_COMMAND:
+		if (task->cdbPointer < task->cdbLength) return task->cdb[task->cdbPointer++];
+		break;
+
+	case SIM_PHASE_DATAOUT:
+		if (task->dataPointer < task->dataLength)
+		{
+			simStatistics.bytesOut++;
+			return task->dataBuffer[task->dataPointer++];
+		}
+		break;
+
+	case SIM_PHASE_MESSAGEOUT:
+		if (simInitiator.messageOutPointer < simInitiator.messageOutLength)
+		{
+			uint8_t message = simInitiator.messageOut[simInitiator.messageOutPointer++];
+
+			// ATN is released before the ACK of the last message byte
+			if (simInitiator.messageOutPointer == simInitiator.messageOutLength) simBus.atn = false;
+			return message;
+		}
+		break;
+	}
+
+	// The target wanted more bytes than the initiator had to give
+	task->overrun = true;
+	return 0x00;
+}
+
+// The target has asserted REQ in an input phase; the initiator takes the byte from the bus
+void simInitiatorReceiveByte(uint8_t databusValue)
+{
+	struct simTaskStruct *task = simInitiator.task != NULL ? simInitiator.task : &simNoTask;
+
+	switch (simBus.phase)
+	{
+	case SIM_PHASE_DATAIN:
+		if (task->dataPointer < task->dataLength)
+		{
+			task->dataBuffer[task->dataPointer++] = databusValue;
+			simStatistics.bytesIn++;
+			return;
+		}
+		break;
+
+	case SIM_PHASE_STATUS:
+		task->status = databusValue;
+		return;
+
+	case SIM_PHASE_MESSAGEIN:
+		// Extended message: collect the length then the message bytes
+		if (simInitiator.messageIn == 0x01)
+		{
+			if (simInitiator.extendedPointer < sizeof(simInitiator.extendedMessage))
+				simInitiator.extendedMessage[simInitiator.extendedPointer] = databusValue;
+			simInitiator.extendedPointer++;
+			if (simInitiator.extendedPointer <= simInitiator.extendedMessage[0]) return;
+
+			// SDTR reply: the target's period and offset are the agreement
+			simInitiator.messageIn = 0;
+			if (simInitiator.extendedMessage[0] == 3 && simInitiator.extendedMessage[1] == 0x01)
+			{
+				simInitiator.syncPeriod = simInitiator.extendedMessage[2];
+				simInitiator.syncOffset = simInitiator.extendedMessage[3];
+			}
+			return;
+		}
+
+		// Second byte of a queue tag message: the tag selects the reconnecting command
+		if (simInitiator.messageIn != 0)
+		{
+			simInitiator.messageIn = 0;
+			if (databusValue < SIM_TAG_COUNT && simInitiator.tasks[databusValue].disconnected)
+			{
+				simInitiator.task = &simInitiator.tasks[databusValue];
+				simInitiator.task->disconnected = false;
+			}
+			return;
+		}
+
+		task->message = databusValue;
+
+		switch (databusValue)
+		{
+		case 0x02:  // SAVE DATA POINTER
+			task->savedDataPointer = task->dataPointer;
+			return;
+
+		case 0x03:  // RESTORE POINTERS
+			task->dataPointer = task->savedDataPointer;
+			return;
+
+		case 0x04:  // DISCONNECT (the target releases BSY next)
+			task->disconnected = true;
+			simStatistics.disconnects++;
+			return;
+
+		case 0x01:  // EXTENDED MESSAGE
+			simInitiator.messageIn = databusValue;
+			simInitiator.extendedPointer = 0;
+			return;
+
+		case 0x07:  // MESSAGE REJECT
+			return;
+
+		case 0x20:  // SIMPLE QUEUE TAG
+		case 0x21:  // HEAD OF QUEUE TAG
+		case 0x22:  // ORDERED QUEUE TAG
+			simInitiator.messageIn = databusValue;
+			return;
+		}
+
+		// IDENTIFY from a reselecting target (the untagged command unless a queue tag follows)
+		if (databusValue & 0x80)
+		{
+			if (simInitiator.tasks[SIM_UNTAGGED].disconnected)
+			{
+				simInitiator.task = &simInitiator.tasks[SIM_UNTAGGED];
+				simInitiator.task->disconnected = false;
+			}
+			return;
+		}
+
+		// COMMAND COMPLETE (or any other message for a SCSI-1 target) ends the command
+		task->complete = true;
+		simStatistics.commands++;
+		simBusAccountPhase(SIM_PHASE_BUSFREE);
+		return;
+	}
+
+	// The target sent more bytes than the initiator expected
+	task->overrun = true;
+}
+
+// Initiator control functions ----------------------------------------------------------
+
+// Arbitrate (trivially - there is only one initiator) and select the target with a CDB
+// (tag is the queue tag sent in the message out phase, or SIM_UNTAGGED)
+void simInitiatorCommand(uint8_t tag, const uint8_t *cdb, uint8_t cdbLength, uint8_t *dataBuffer, uint32_t dataLength)
+{
+	struct simTaskStruct *task = &simInitiator.tasks[tag];
+
+	memcpy(task->cdb, cdb, cdbLength);
+	task->cdbLength = cdbLength;
+	task->cdbPointer = 0;
+
+	task->dataBuffer = dataBuffer;
+	task->dataLength = dataLength;
+	task->dataPointer = 0;
+	task->savedDataPointer = 0;
+
+	task->status = 0xFF;
+	task->message = 0xFF;
+	task->complete = false;
+	task->disconnected = false;
+	task->overrun = false;
+
+	simInitiator.task = task;
+	simInitiator.messageIn = 0;
+
+	// Assert SEL with the initiator and target IDs on the databus
+	simBusAccountPhase(SIM_PHASE_SELECTION);
+	simBus.databus = (1 << SIM_INITIATOR_ID) | (1 << SIM_TARGET_ID);
+	simBus.sel = true;
+}
+
+// Queue message out bytes for the next selection (asserts ATN)
+void simInitiatorMessageOut(const uint8_t *message, uint8_t messageLength)
+{
+	memcpy(simInitiator.messageOut, message, messageLength);
+	simInitiator.messageOutLength = messageLength;
+	simInitiator.messageOutPointer = 0;
+	simBus.atn = messageLength != 0;
+}
+
+// Returns true if neither the initiator nor the target is using the bus
+bool simInitiatorBusFree(void)
+{
+	return !simBus.sel && !simBus.bsy;
+}
+
+// Returns the synchronous transfer agreement from the target's last SDTR reply
+uint8_t simInitiatorSyncPeriod(void)
+{
+	return simInitiator.syncPeriod;
+}
+
+uint8_t simInitiatorSyncOffset(void)
+{
+	return simInitiator.syncOffset;
+}
+
+bool simInitiatorComplete(uint8_t tag)
+{
+	return simInitiator.tasks[tag].complete;
+}
+
+uint8_t simInitiatorStatus(uint8_t tag)
+{
+	return simInitiator.tasks[tag].status;
+}
+
+uint32_t simInitiatorDataTransferred(uint8_t tag)
+{
+	return simInitiator.tasks[tag].dataPointer;
+}
+
+bool simInitiatorOverrun(uint8_t tag)
+{
+	return simInitiator.tasks[tag].overrun;
+}
+
+// Assert RST on the bus
+void simInitiatorReset(void)
+{
+	uint8_t tag;
+
+	// Commands waiting for reselection are cleared by the reset
+	for (tag = 0; tag <= SIM_TAG_COUNT; tag++) simInitiator.tasks[tag].disconnected = false;
+	simInitiator.task = NULL;
+
+	// So is the synchronous transfer agreement
+	simInitiator.syncPeriod = 0;
+	simInitiator.syncOffset = 0;
+
+	simBus.sel = false;
+	simBus.atn = false;
+	simBus.databus = 0;
+	simBus.rst = true;
+	simBusAccountPhase(SIM_PHASE_BUSFREE);
+}
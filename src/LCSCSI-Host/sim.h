@@ -0,0 +1,83 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#pragma once
+// Host-side simulation of the SCSI bus and a virtual initiator
+
+// Initiator and target IDs used on the simulated bus
+#define SIM_INITIATOR_ID	7
+#define SIM_TARGET_ID		1
+
+// Number of queue tags the initiator uses (SIM_UNTAGGED is the untagged command)
+#define SIM_TAG_COUNT		16
+#define SIM_UNTAGGED		SIM_TAG_COUNT
+
+// Bus phases used for cycle accounting
+#define SIM_PHASE_BUSFREE		0
+#define SIM_PHASE_SELECTION		1
+#define SIM_PHASE_COMMAND		2
+#define SIM_PHASE_DATAIN		3
+#define SIM_PHASE_DATAOUT		4
+#define SIM_PHASE_STATUS		5
+#define SIM_PHASE_MESSAGEIN		6
+#define SIM_PHASE_MESSAGEOUT	7
+#define SIM_PHASE_COUNT			8
+
+// Bus statistics (accumulated until simResetStatistics is called)
+struct simStatisticsStruct
+{
+	uint64_t phaseCycles[SIM_PHASE_COUNT];	// Cycles spent with the bus in each phase
+	uint64_t bytesIn;						// Data in bytes received by the initiator
+	uint64_t bytesOut;						// Data out bytes sent by the initiator
+	uint64_t bytesSync;						// Data bytes moved by the synchronous transfer engine
+	uint64_t delayMicroseconds;				// Time requested through Delayms() (modelled, not slept)
+	uint64_t diskReads;						// disk_read() calls
+	uint64_t diskWrites;					// disk_write() calls
+	uint64_t diskSectorsRead;				// Sectors read from the image
+	uint64_t diskSectorsWritten;			// Sectors written to the image
+	uint32_t commands;						// Completed commands
+	uint32_t disconnects;					// DISCONNECT messages received
+	uint32_t reselections;					// Successful reselections by the target
+};
+
+extern struct simStatisticsStruct simStatistics;
+extern const char *simPhaseNames[SIM_PHASE_COUNT];
+extern bool simVerbose;
+
+// Timing
+uint64_t simCycles(void);
+void simDelayMicroseconds(uint32_t microseconds);
+uint32_t simMilliseconds(void);
+void simResetStatistics(void);
+
+// Bus signals (called from the simulated host adapter)
+void simBusInitialise(void);
+void simBusSetPhase(bool message, bool commandNotData, bool inputNotOutput);
+void simBusSetBusy(bool flagState);
+bool simBusReadSelect(void);
+bool simBusReadBusy(void);
+bool simBusReadAttention(void);
+uint8_t simBusReadDatabus(void);
+bool simBusReadReset(void);
+void simBusWriteReset(bool flagState);
+bool simBusReselect(uint8_t targetId, uint8_t initiatorId);
+
+// Initiator REQ/ACK handshakes (called from the simulated host adapter)
+uint8_t simInitiatorSendByte(void);
+void simInitiatorReceiveByte(uint8_t databusValue);
+
+// Initiator control (called from the benchmark driver)
+void simInitiatorCommand(uint8_t tag, const uint8_t *cdb, uint8_t cdbLength, uint8_t *dataBuffer, uint32_t dataLength);
+void simInitiatorMessageOut(const uint8_t *message, uint8_t messageLength);
+bool simInitiatorBusFree(void);
+bool simInitiatorComplete(uint8_t tag);
+uint8_t simInitiatorStatus(uint8_t tag);
+uint32_t simInitiatorDataTransferred(uint8_t tag);
+bool simInitiatorOverrun(uint8_t tag);
+uint8_t simInitiatorSyncPeriod(void);
+uint8_t simInitiatorSyncOffset(void);
+void simInitiatorReset(void);
+
+// Disk image backend for diskio.c
+bool simDiskOpen(const char *path, uint32_t sectorCount);
+void simDiskClose(void);
@@ -0,0 +1,448 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Firmware includes (event IDs and the report layout)
+#include "trace.h"
+#include "scsi.h"
+
+// Trace decoder
+//
+// Decodes a READ TRACE (0xD9) capture - the raw reply, as saved by lcscsi-bench -T or
+// any SCSI pass-through tool - into a readable log, or with -j into Chrome trace event
+// JSON (open it with chrome://tracing or https://ui.perfetto.dev).
+
+// Decoded trace entry
+struct traceDecodeEntryStruct
+{
+	uint16_t event;
+	uint16_t sequence;
+	double time;				// Microseconds from the first event
+	uint32_t argument[3];
+};
+
+// Timeline tracks (Chrome trace thread IDs)
+#define TRACK_COMMANDS		1
+#define TRACK_BUS			2
+#define TRACK_PHASES		3
+#define TRACK_CARD			4
+#define TRACK_TRANSFERS		5
+
+static const char *decodeTrackNames[] =
+{
+	NULL, "SCSI commands", "SCSI bus", "SCSI phases", "SD card", "Host transfers"
+};
+
+static const char *decodePhaseNames[] =
+{
+	"Data out", "Data in", "Command", "Status", "Message out", "Message in"
+};
+
+// Read a big-endian value from the capture
+static uint32_t decodeValue(const uint8_t *buffer, uint8_t bytes)
+{
+	uint32_t value = 0;
+
+	while (bytes--) value = (value << 8) | *buffer++;
+	return value;
+}
+
+// Name of a SCSI opcode
+static const char *decodeOpcodeName(uint8_t opcode)
+{
+	switch (opcode)
+	{
+		case 0x00: return "TEST UNIT READY";
+		case 0x01: return "REZERO UNIT";
+		case 0x03: return "REQUEST SENSE";
+		case 0x04: return "FORMAT";
+		case 0x08: return "READ(6)";
+		case 0x0A: return "WRITE(6)";
+		case 0x0B: return "SEEK";
+		case 0x0F: return "TRANSLATE";
+		case 0x12: return "INQUIRY";
+		case 0x15: return "MODE SELECT";
+		case 0x1A: return "MODE SENSE";
+		case 0x1B: return "START STOP UNIT";
+		case 0x25: return "READ CAPACITY";
+		case 0x28: return "READ(10)";
+		case 0x2A: return "WRITE(10)";
+		case 0x2F: return "VERIFY";
+		case 0x35: return "SYNCHRONIZE CACHE";
+		case 0xD8: return "READ LATENCY";
+		case 0xD9: return "READ TRACE";
+	}
+
+	return NULL;
+}
+
+// Describe a command nexus (opcode | LUN << 8 | tag << 16 | tagged << 24)
+static void decodeNexus(char *text, size_t size, uint32_t nexus)
+{
+	const char *name = decodeOpcodeName(nexus & 0xFF);
+	int length;
+
+	if (name != NULL) length = snprintf(text, size, "%s LUN %u", name, (nexus >> 8) & 0x07);
+	else length = snprintf(text, size, "opcode 0x%02X LUN %u", nexus & 0xFF, (nexus >> 8) & 0x07);
+
+	if ((nexus >> 24) & 0x01) snprintf(text + length, size - length, " tag %u", (nexus >> 16) & 0xFF);
+}
+
+// Name of an event
+static const char *decodeEventName(uint16_t event)
+{
+	switch (event)
+	{
+		case TRACE_SCSI_SELECTED: return "SCSI selected";
+		case TRACE_SCSI_COMMAND: return "SCSI command";
+		case TRACE_SCSI_PHASE: return "SCSI phase";
+		case TRACE_SCSI_STATUS: return "SCSI status";
+		case TRACE_SCSI_COMPLETE: return "SCSI complete";
+		case TRACE_SCSI_BUS_FREE: return "SCSI bus free";
+		case TRACE_SCSI_QUEUED: return "SCSI queued";
+		case TRACE_SCSI_DISPATCH: return "SCSI dispatch";
+		case TRACE_SCSI_RESELECTED: return "SCSI reselected";
+		case TRACE_SCSI_RESET: return "SCSI reset";
+		case TRACE_SD_READ_START: return "SD read";
+		case TRACE_SD_READ_DONE: return "SD read done";
+		case TRACE_SD_WRITE_START: return "SD write";
+		case TRACE_SD_WRITE_DONE: return "SD write done";
+		case TRACE_HOST_SELECTION: return "Host selection";
+		case TRACE_HOST_TRANSFER_IN: return "Host transfer in";
+		case TRACE_HOST_TRANSFER_OUT: return "Host transfer out";
+		case TRACE_HOST_TRANSFER_DONE: return "Host transfer done";
+		case TRACE_HOST_RESET: return "Host reset";
+	}
+
+	return "Unknown event";
+}
+
+// Describe the arguments of an event
+static void decodeEventDetails(char *text, size_t size, const struct traceDecodeEntryStruct *entry)
+{
+	const uint32_t *argument = entry->argument;
+	int length;
+
+	text[0] = '\0';
+	switch (entry->event)
+	{
+		case TRACE_SCSI_SELECTED:
+		case TRACE_SCSI_RESELECTED:
+			if (argument[0] == 0xFF) snprintf(text, size, "initiator unknown");
+			else snprintf(text, size, "initiator %u", argument[0]);
+			break;
+
+		case TRACE_SCSI_COMMAND:
+			decodeNexus(text, size, argument[0]);
+			length = strlen(text);
+			snprintf(text + length, size - length, "  CDB %02X %02X %02X %02X %02X %02X %02X %02X %02X",
+				argument[0] & 0xFF, argument[1] >> 24, (argument[1] >> 16) & 0xFF, (argument[1] >> 8) & 0xFF, argument[1] & 0xFF,
+				argument[2] >> 24, (argument[2] >> 16) & 0xFF, (argument[2] >> 8) & 0xFF, argument[2] & 0xFF);
+			break;
+
+		case TRACE_SCSI_PHASE:
+			if (argument[0] <= ITPHASE_MESSAGEIN) snprintf(text, size, "%s", decodePhaseNames[argument[0]]);
+			else snprintf(text, size, "phase %u", argument[0]);
+			break;
+
+		case TRACE_SCSI_STATUS:
+			snprintf(text, size, "status 0x%02X", argument[0]);
+			break;
+
+		case TRACE_SCSI_COMPLETE:
+			decodeNexus(text, size, argument[0]);
+			length = strlen(text);
+			snprintf(text + length, size - length, "  status 0x%02X", argument[1]);
+			break;
+
+		case TRACE_SCSI_BUS_FREE:
+		case TRACE_SCSI_DISPATCH:
+			decodeNexus(text, size, argument[0]);
+			break;
+
+		case TRACE_SCSI_QUEUED:
+			decodeNexus(text, size, argument[0]);
+			length = strlen(text);
+			snprintf(text + length, size - length, "  (%u queued)", argument[1]);
+			break;
+
+		case TRACE_SD_READ_START:
+		case TRACE_SD_WRITE_START:
+			snprintf(text, size, "sector %u, %u sectors%s", argument[0], argument[1], argument[2] ? " (background)" : "");
+			break;
+
+		case TRACE_SD_READ_DONE:
+		case TRACE_SD_WRITE_DONE:
+			snprintf(text, size, argument[0] ? "result %u" : "OK", argument[0]);
+			break;
+
+		case TRACE_HOST_SELECTION:
+			snprintf(text, size, "ID mask 0x%02X", argument[0]);
+			break;
+
+		case TRACE_HOST_TRANSFER_IN:
+		case TRACE_HOST_TRANSFER_OUT:
+			snprintf(text, size, "%u bytes%s", argument[0], argument[1] ? " (synchronous)" : "");
+			break;
+
+		case TRACE_HOST_TRANSFER_DONE:
+			snprintf(text, size, "%u bytes", argument[0]);
+			break;
+
+		case TRACE_SCSI_RESET:
+		case TRACE_HOST_RESET:
+			break;
+
+		default:
+			snprintf(text, size, "0x%08X 0x%08X 0x%08X", argument[0], argument[1], argument[2]);
+	}
+}
+
+// Write the trace as a readable log
+static void decodeWriteLog(const struct traceDecodeEntryStruct *entries, uint32_t count)
+{
+	char details[128];
+	uint32_t entryNumber;
+
+	for (entryNumber = 0; entryNumber < count; entryNumber++)
+	{
+		decodeEventDetails(details, sizeof(details), &entries[entryNumber]);
+		printf("%12.3f us %+10.3f  %-18s %s\n", entries[entryNumber].time,
+			entryNumber ? entries[entryNumber].time - entries[entryNumber - 1].time : 0.0,
+			decodeEventName(entries[entryNumber].event), details);
+	}
+}
+
+// Most commands that can be open at once in a trace (queued commands for every LUN)
+#define DECODE_OPEN_COMMANDS	64
+
+// Write one Chrome trace event (JSON)
+// Note: The id only applies to async ('b' and 'e') events
+static void decodeWriteJsonEvent(bool *first, const char *name, char phase, uint8_t track, double time, double duration, uint32_t id, const char *details)
+{
+	printf("%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%.3f", *first ? "" : ",", name, phase, track, time);
+	if (phase == 'b' || phase == 'e') printf(",\"cat\":\"command\",\"id\":\"0x%06X\"", id);
+	if (phase == 'X') printf(",\"dur\":%.3f", duration);
+	if (phase == 'i') printf(",\"s\":\"t\"");
+	if (details != NULL && details[0] != '\0') printf(",\"args\":{\"details\":\"%s\"}", details);
+	printf("}");
+	*first = false;
+}
+
+// Write the trace as Chrome trace event JSON
+// Commands (command phase to completion) are async events keyed by their nexus, the bus
+// connections, phases, card accesses and host transfers are complete events on their own
+// tracks and everything else is an instant event
+static void decodeWriteJson(const struct traceDecodeEntryStruct *entries, uint32_t count)
+{
+	const struct traceDecodeEntryStruct *entry;
+	double connectionStart = -1, phaseStart = -1, cardStart = -1, transferStart = -1;
+	const struct traceDecodeEntryStruct *phaseEntry = NULL, *cardEntry = NULL, *transferEntry = NULL;
+	char details[128];
+	char name[64];
+	bool first = true;
+	uint32_t entryNumber;
+	uint8_t track;
+	uint32_t openIds[DECODE_OPEN_COMMANDS];	// Nexus ids of the commands begun and not yet ended
+	uint32_t openCount = 0;
+	uint32_t openNumber;
+	uint32_t id;
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (track = TRACK_COMMANDS; track <= TRACK_TRANSFERS; track++)
+	{
+		printf("%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first ? "" : ",", track, decodeTrackNames[track]);
+		first = false;
+	}
+
+	for (entryNumber = 0; entryNumber < count; entryNumber++)
+	{
+		entry = &entries[entryNumber];
+		decodeEventDetails(details, sizeof(details), entry);
+
+		switch (entry->event)
+		{
+			case TRACE_SCSI_SELECTED:
+			case TRACE_SCSI_RESELECTED:
+				connectionStart = entry->time;
+				break;
+
+			case TRACE_SCSI_BUS_FREE:
+				if (phaseEntry != NULL)
+				{
+					decodeWriteJsonEvent(&first, decodePhaseNames[phaseEntry->argument[0] <= ITPHASE_MESSAGEIN ? phaseEntry->argument[0] : 0],
+						'X', TRACK_PHASES, phaseStart, entry->time - phaseStart, 0, NULL);
+					phaseEntry = NULL;
+				}
+				if (connectionStart >= 0)
+				{
+					decodeNexus(name, sizeof(name), entry->argument[0]);
+					decodeWriteJsonEvent(&first, name, 'X', TRACK_BUS, connectionStart, entry->time - connectionStart, 0, NULL);
+					connectionStart = -1;
+				}
+				break;
+
+			case TRACE_SCSI_PHASE:
+				if (phaseEntry != NULL)
+				{
+					decodeWriteJsonEvent(&first, decodePhaseNames[phaseEntry->argument[0] <= ITPHASE_MESSAGEIN ? phaseEntry->argument[0] : 0],
+						'X', TRACK_PHASES, phaseStart, entry->time - phaseStart, 0, NULL);
+				}
+				phaseEntry = entry;
+				phaseStart = entry->time;
+				break;
+
+			case TRACE_SCSI_COMMAND:
+			case TRACE_SCSI_COMPLETE:
+				// A completion whose command was overwritten in the ring has nothing to end
+				id = entry->argument[0] & 0x01FF07FF;
+				for (openNumber = 0; openNumber < openCount && openIds[openNumber] != id; openNumber++);
+				if (entry->event == TRACE_SCSI_COMMAND)
+				{
+					if (openNumber == openCount && openCount < DECODE_OPEN_COMMANDS) openIds[openCount++] = id;
+				}
+				else
+				{
+					if (openNumber == openCount) break;
+					openIds[openNumber] = openIds[--openCount];
+				}
+				decodeNexus(name, sizeof(name), entry->argument[0]);
+				decodeWriteJsonEvent(&first, name, entry->event == TRACE_SCSI_COMMAND ? 'b' : 'e', TRACK_COMMANDS, entry->time, 0, id, details);
+				break;
+
+			case TRACE_SD_READ_START:
+			case TRACE_SD_WRITE_START:
+				cardEntry = entry;
+				cardStart = entry->time;
+				break;
+
+			case TRACE_SD_READ_DONE:
+			case TRACE_SD_WRITE_DONE:
+				if (cardEntry != NULL)
+				{
+					decodeEventDetails(details, sizeof(details), cardEntry);
+					decodeWriteJsonEvent(&first, decodeEventName(cardEntry->event), 'X', TRACK_CARD, cardStart, entry->time - cardStart, 0, details);
+					cardEntry = NULL;
+				}
+				break;
+
+			case TRACE_HOST_TRANSFER_IN:
+			case TRACE_HOST_TRANSFER_OUT:
+				transferEntry = entry;
+				transferStart = entry->time;
+				break;
+
+			case TRACE_HOST_TRANSFER_DONE:
+				if (transferEntry != NULL)
+				{
+					decodeEventDetails(details, sizeof(details), transferEntry);
+					decodeWriteJsonEvent(&first, decodeEventName(transferEntry->event), 'X', TRACK_TRANSFERS, transferStart, entry->time - transferStart, 0, details);
+					transferEntry = NULL;
+				}
+				break;
+
+			default:
+				decodeWriteJsonEvent(&first, decodeEventName(entry->event), 'i',
+					(entry->event >> 8) == (TRACE_SD_READ_START >> 8) ? TRACK_CARD : TRACK_BUS, entry->time, 0, 0, details);
+		}
+	}
+
+	printf("\n]}\n");
+}
+
+static void decodeUsage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-j] capture\n", name);
+	fprintf(stderr, "  -j           Write Chrome/Perfetto trace event JSON instead of a log\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct traceDecodeEntryStruct *entries;
+	uint8_t header[TRACE_REPORT_HEADER];
+	uint8_t record[TRACE_ENTRY_SIZE];
+	uint64_t cycles = 0;
+	uint32_t lastCycles = 0;
+	uint32_t clock;
+	uint32_t count;
+	uint32_t recorded;
+	uint32_t entryNumber;
+	bool json = false;
+	FILE *capture;
+	int option;
+
+	while ((option = getopt(argc, argv, "j")) != -1)
+	{
+		switch (option)
+		{
+		case 'j':
+			json = true;
+			break;
+
+		default:
+			decodeUsage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1)
+	{
+		decodeUsage(argv[0]);
+		return 1;
+	}
+
+	capture = fopen(argv[optind], "rb");
+	if (capture == NULL)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+
+	// Check the report header
+	if (fread(header, 1, sizeof(header), capture) != sizeof(header) || header[0] != TRACE_REPORT_FORMAT || header[1] != TRACE_ENTRY_SIZE)
+	{
+		fprintf(stderr, "%s: not a READ TRACE capture (format %u)\n", argv[optind], header[0]);
+		fclose(capture);
+		return 1;
+	}
+	count = decodeValue(header + 2, 2);
+	clock = decodeValue(header + 4, 4);
+	recorded = decodeValue(header + 8, 4);
+	if (clock == 0) clock = 1;
+
+	// Read the entries and convert the (wrapping) cycle counts to time
+	entries = calloc(count ? count : 1, sizeof(*entries));
+	if (entries == NULL) return 1;
+
+	for (entryNumber = 0; entryNumber < count; entryNumber++)
+	{
+		if (fread(record, 1, sizeof(record), capture) != sizeof(record))
+		{
+			fprintf(stderr, "%s: capture is truncated after %u of %u events\n", argv[optind], entryNumber, count);
+			count = entryNumber;
+			break;
+		}
+
+		entries[entryNumber].event = decodeValue(record, 2);
+		entries[entryNumber].sequence = decodeValue(record + 2, 2);
+		if (entryNumber != 0) cycles += (uint32_t)(decodeValue(record + 4, 4) - lastCycles);
+		lastCycles = decodeValue(record + 4, 4);
+		entries[entryNumber].time = (double)cycles * 1e6 / clock;
+		entries[entryNumber].argument[0] = decodeValue(record + 8, 4);
+		entries[entryNumber].argument[1] = decodeValue(record + 12, 4);
+		entries[entryNumber].argument[2] = decodeValue(record + 16, 4);
+	}
+	fclose(capture);
+
+	if (json) decodeWriteJson(entries, count);
+	else
+	{
+		printf("%u events (%u recorded, %u overwritten), %u Hz cycle counter\n", count, recorded, recorded - count, clock);
+		decodeWriteLog(entries, count);
+	}
+
+	free(entries);
+	return 0;
+}
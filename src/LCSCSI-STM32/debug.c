@@ -1,5 +1,6 @@
 
 #include "tm_stm32_usart.h"
+#include "tm_stm32_usart_dma.h"
  
 /* In stdio.h file is everything related to output stream */
 #include <stdio.h>
@@ -12,6 +13,21 @@
 
 #define DEBUG_USART USART2
 
+// Debug output ring buffer (must be a power of 2).  Messages are copied in and
+// sent by DMA in the background; a message that does not fit is dropped whole
+#define DEBUG_BUFFER_SIZE	4096
+#define DEBUG_BUFFER_MASK	(DEBUG_BUFFER_SIZE - 1)
+
+static char debugBuffer[DEBUG_BUFFER_SIZE];
+static volatile uint16_t debugHead;			// Next byte to write (advanced by the writers)
+static volatile uint16_t debugTail;			// Next byte to send (advanced when the DMA completes)
+static volatile uint16_t debugSending;		// Bytes from debugTail in the current DMA transfer
+static bool debugDmaReady = false;			// False until debugInitialise (output is sent by polling)
+
+// Messages dropped because the buffer was full
+volatile uint32_t debugDroppedCount = 0;
+static uint32_t debugDroppedReported = 0;
+
 void u_printf(const char *fmt, ...);
 
 // Define default debug output flags (all debug off)
@@ -58,10 +74,122 @@ void u_printf(const char *fmt, ...)
 
 
 
+// Start sending the buffered output if the DMA is idle
+// Called with interrupts masked (or from the transfer complete interrupt)
+static void debugStartTransfer(void)
+{
+	DMA_Stream_TypeDef *stream = TM_USART_DMA_GetStreamTX(DEBUG_USART);
+	uint16_t tail;
+	uint16_t count;
+
+	// Still sending?
+	if (stream->NDTR != 0) return;
+
+	// Release the bytes of the last transfer
+	tail = (debugTail + debugSending) & DEBUG_BUFFER_MASK;
+	debugTail = tail;
+	debugSending = 0;
+	if (debugHead == tail) return;
+
+	// Send up to the head or the end of the buffer (the rest goes on the next transfer)
+	if (debugHead > tail) count = debugHead - tail;
+	else count = DEBUG_BUFFER_SIZE - tail;
+
+	if (TM_USART_DMA_Send(DEBUG_USART, (uint8_t *)&debugBuffer[tail], count))
+	{
+		debugSending = count;
+		stream->CR |= DMA_SxCR_TCIE;
+	}
+}
+
+// Copy a message into the ring buffer; returns false if it does not fit
+static bool debugBufferWrite(const char *string, uint16_t length)
+{
+	uint16_t head = debugHead;
+	uint16_t space = DEBUG_BUFFER_MASK - ((head - debugTail) & DEBUG_BUFFER_MASK);
+	uint16_t first;
+
+	if (length > space) return false;
+
+	first = DEBUG_BUFFER_SIZE - head;
+	if (first > length) first = length;
+	memcpy(&debugBuffer[head], string, first);
+	memcpy(&debugBuffer[0], string + first, length - first);
+	debugHead = (head + length) & DEBUG_BUFFER_MASK;
+
+	return true;
+}
+
+// Initialise the DMA driven debug output (the USART must already be initialised)
+void debugInitialise(void)
+{
+	TM_USART_DMA_Init(DEBUG_USART);
+	TM_USART_DMA_EnableInterrupts(DEBUG_USART);
+	debugDmaReady = true;
+}
+
+// DMA transfer complete: send the next part of the buffer
+void TM_DMA_TransferCompleteHandler(DMA_Stream_TypeDef *DMA_Stream)
+{
+	if (DMA_Stream == TM_USART_DMA_GetStreamTX(DEBUG_USART)) debugStartTransfer();
+}
+
+// Wait until all of the buffered output has been sent
+// This polls the DMA so it also works from a fault handler with interrupts masked
+void debugFlush(void)
+{
+	uint32_t primask;
+
+	if (!debugDmaReady) return;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	while (debugHead != debugTail || debugSending != 0)
+	{
+		debugStartTransfer();
+	}
+	while (TM_USART_DMA_Transmitting(DEBUG_USART));
+	__set_PRIMASK(primask);
+}
+
+// Report a fault: send the message and everything still buffered, then stop
+void debugFault(char *string)
+{
+	__disable_irq();
+	debugString(string);
+	debugFlush();
+	while (1);
+}
+
 // This function outputs a string stored in RAM space to the UART
+// The string is buffered and sent by DMA, so this can be called from an interrupt
 void debugString(char *string)
 {
-	TM_USART_Puts(DEBUG_USART, string);
+	char dropped[40];
+	uint16_t length = strlen(string);
+	uint32_t primask;
+
+	// Before initialisation (or without the DMA) send the string directly
+	if (!debugDmaReady)
+	{
+		TM_USART_Puts(DEBUG_USART, string);
+		return;
+	}
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+
+	// Say how many messages were lost once there is room again
+	if (debugDroppedReported != debugDroppedCount)
+	{
+		sprintf(dropped, "[%lu debug messages dropped]\r\n", (unsigned long)(debugDroppedCount - debugDroppedReported));
+		if (debugBufferWrite(dropped, strlen(dropped))) debugDroppedReported = debugDroppedCount;
+	}
+
+	if (debugDroppedReported != debugDroppedCount || !debugBufferWrite(string, length)) debugDroppedCount++;
+	debugStartTransfer();
+
+	__set_PRIMASK(primask);
 }
 
 
@@ -9,7 +9,12 @@ extern volatile bool debugFlag_scsiFcodes;
 extern volatile bool debugFlag_scsiState;
 extern volatile bool debugFlag_fatfs;
 
+extern volatile uint32_t debugDroppedCount;
+
 // Function prototypes
+void debugInitialise(void);
+void debugFlush(void);
+void debugFault(char *string);
 void debugString(char *string);
 void debugString_P(char *string);
 
@@ -46,8 +46,20 @@
 //Disable EXTI1_IRQHandler function
 //#define EXTI_DISABLE_DEFAULT_HANDLER_1
 
+/* The SDIO driver handles its own DMA interrupts (the TM DMA library is used for the debug USART) */
+#define DMA2_STREAM3_DISABLE_IRQHANDLER
+#define DMA2_STREAM6_DISABLE_IRQHANDLER
+
+/* Run the host adapter REQ/ACK handshake benchmark at start-up (disconnect the SCSI bus first) */
+//#define HOSTADAPTER_BENCHMARK
+
+/* Run the SD card 1/8/64 block read and write benchmark at start-up (needs 32 Kbytes of RAM; */
+/* the sectors in the middle of the card are rewritten with their own contents) */
+//#define FILESYSTEM_BENCHMARK
+
 /* Activate SDIO 4-bit mode */
-//#define FATFS_SDIO_4BIT         1
-#define FATFS_SDIO_4BIT   0
+/* The start-up probe falls back to 1-bit (and slower clocks) if DAT1-DAT3 do not read reliably */
+#define FATFS_SDIO_4BIT         1
+//#define FATFS_SDIO_4BIT   0
 
 #endif
\ No newline at end of file
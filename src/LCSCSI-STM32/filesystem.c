@@ -7,10 +7,13 @@
 
 #include "stm32f4xx.h"
 #include "tm_stm32_fatfs.h"
+#include "tm_stm32_delay.h"
 
 
 #include "filesystem.h"
 #include "debug.h"
+#include "latency.h"
+#include "trace.h"
 
 // File system state structure
 struct filesystemStateStruct
@@ -28,19 +31,68 @@ struct filesystemStateStruct
 	uint8_t lunDirectory; 	// Current LUN directory ID
 	bool fsLunStatus[8]; 	// LUN image availability flags for the currently selected LUN directory (true = started, false = stopped)
 	uint8_t fsLunUserCode[8][5]; 	// LUN 5-byte User code (used for F-Code interactions - only present for laser disc images)
+	FIL fsLunFileObject[8]; 	// LUN image file objects (kept open while the LUN is started)
+	DWORD fsLunLinkMap[8][LUN_LINKMAP_SIZE]; 	// Cluster link maps for fast seeking in the LUN image files
+	uint32_t fsLunBaseSector[8]; 	// First physical sector of contiguous LUN images (0 = fragmented, use FatFs)
+	uint32_t fsLunSectorCount[8]; 	// LUN image size in sectors
 	
 } filesystemState;
 
 char fileName[255]; 			// String for storing LFN filename
 char fatDirectory[255]; 		// String for storing FAT directory (for FAT transfer operations)
 
-uint8_t sectorBuffer[SECTOR_BUFFER_SIZE]; 	// Buffer for reading sectors
+uint8_t sectorBuffer[SECTOR_SIZE]; 	// Buffer for reading and writing LUN descriptors
 bool lunOpenFlag = false;  // Flag to track when a LUN is open for read/write (to prevent multiple file opens)
+FIL *lunFileObject;  // File object of the LUN image currently open for read/write
+uint8_t lunOpenNumber = 0;  // LUN currently open for read/write
+
+// Globals for the read-ahead windows
+// Note: The windows survive between commands; they are invalidated when the LUN status
+// changes or when the LUN is written to in the windowed range.  The two windows are
+// used in turn: while the host is sent the sectors in one window the following sectors
+// are read into the other in the background (contiguous LUN images only), so a
+// sequential stream runs at the slower of the card and bus rates rather than their sum.
+#define BUFFER_INVALID		0xFF
+#define READ_AHEAD_WINDOWS	2
+uint8_t readAheadBuffer[READ_AHEAD_WINDOWS][SECTOR_BUFFER_SIZE] __attribute__((aligned(4)));  // Word aligned for the SDIO DMA
+uint8_t bufferLunNumber[READ_AHEAD_WINDOWS] = { BUFFER_INVALID, BUFFER_INVALID };  // LUN held in each window
+uint32_t bufferFirstSector[READ_AHEAD_WINDOWS];  // First LUN sector held in each window
+uint32_t sectorsInBuffer[READ_AHEAD_WINDOWS];  // Number of sectors held in each window
+uint8_t bufferFilling = BUFFER_INVALID;  // Window being filled by a background read
+uint8_t bufferCurrent = 0;  // Window the last sector was read from
 
 // Globals for multi-sector reading
-uint32_t sectorsInBuffer = 0;
-uint32_t currentBufferSector = 0;
-uint32_t sectorsRemaining = 0;
+uint32_t readNextSector = 0;  // Next LUN sector to be returned by filesystemAcquireReadSector()
+uint32_t sectorsRemaining = 0;  // Sectors remaining in the current read
+bool readSequential = false;  // Current read continues from where the previous read ended
+uint8_t lastReadLunNumber = BUFFER_INVALID;
+uint32_t lastReadEndSector = 0;
+
+// Globals for the write-back cache
+// Note: Written sectors are held here and written to the card later.  The cache is a
+// ring: sequentially written sectors occupy consecutive slots, so each run of adjacent
+// sectors is written back with a single multi-sector write straight from the cache.
+// Once WRITE_CACHE_DRAIN_SECTORS are cached the oldest run is written to the card in the
+// background while the host carries on filling the following slots.
+#define WRITE_CACHE_SLOT(position)	((writeCacheFirst + (position)) % WRITE_CACHE_SECTORS)
+uint8_t writeCacheBuffer[WRITE_CACHE_SECTORS][SECTOR_SIZE] __attribute__((aligned(4)));  // Word aligned for the SDIO DMA
+uint8_t writeCacheLunNumber[WRITE_CACHE_SECTORS];  // LUN of each cache slot
+uint32_t writeCacheSector[WRITE_CACHE_SECTORS];  // LUN sector of each cache slot
+uint32_t writeCacheFirst = 0;  // Slot holding the oldest cached sector
+uint32_t writeCacheCount = 0;  // Number of cache slots in use
+uint32_t writeCacheDraining = 0;  // Number of the oldest slots being written back in the background
+uint32_t writeCacheTick = 0;  // Time of the last write to the cache
+bool writeCacheErrorFlag = false;  // A write-back failed (reported by the next filesystemFlushWriteCache())
+uint32_t writeNextSector = 0;  // Next LUN sector to be written by filesystemAcquireWriteSector()
+uint32_t writeAcquiredSlot = WRITE_CACHE_SECTORS;  // Cache slot handed out for writeNextSector (WRITE_CACHE_SECTORS = none)
+
+// Start of the background read or write (for the SD card latency histograms)
+uint32_t backgroundStartCycles = 0;
+
+// Local prototypes
+static void filesystemInvalidateReadAhead(uint8_t lunNumber, uint32_t startSector, uint32_t numberOfSectors);
+static void filesystemFinishReadAhead(void);
+static void filesystemFinishWriteBack(void);
 
 
 // External prototypes
@@ -70,19 +122,28 @@ void filesystemReset(void)
 	// Reset the default FAT transfer directory
 	sprintf(fatDirectory, "/Transfer");
 	
+	// Write back any cached sectors before the LUNs are restarted
+	if (!filesystemFlushWriteCache())
+	{
+		if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemReset(): ERROR: Write-back of cached sectors failed!\r\n"));
+	}
+	
 	// Is the SD card/FAT file system  mounted?
 	if(filesystemState.fsMountState == true)
 	{
 		if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemReset(): File system is flagged as mounted\r\n"));
 		
-		// Test mounted LUNs to make sure they are still available
+		// Restart mounted LUNs to make sure they are still available
 		// Note: This is in case the SD card has been removed or changed since the last reset.
+		// Stopping the LUN closes its image file and starting it again re-checks the
+		// image and reopens the file.
 		for(lunNumber = 0 ; lunNumber < 8 ; lunNumber++)
 		{
 			// If the LUN status is available, test it to make sure
 			if(filesystemReadLunStatus(lunNumber))
 			{
-				if (!filesystemTestLunStatus(lunNumber)) errorFlag = true;
+				filesystemSetLunStatus(lunNumber, false);
+				if (!filesystemSetLunStatus(lunNumber, true)) errorFlag = true;
 			}
 		}
 		
@@ -106,6 +167,8 @@ void filesystemReset(void)
 
 bool filesystemMount(void)
 {
+	uint32_t busMode[3];
+	
 	if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemMount(): Mounting file system\r\n"));
 	
 	// Is the file system already mounted?
@@ -163,6 +226,16 @@ bool filesystemMount(void)
 	if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemMount(): Successful\r\n"));
 	filesystemState.fsMountState = true;
 	
+	// Show the bus mode negotiated with the card
+	if(filesystemReadCardBusMode(busMode))
+	{
+		debugStringInt16_P(PSTR("File system: SD card bus width = "), (uint16_t)busMode[0], false);
+		debugStringInt32_P(PSTR(" bit(s), clock (kHz) = "), busMode[1], false);
+		if(busMode[2] & MMC_BUSMODE_HIGHSPEED) debugString_P(PSTR(", high speed"));
+		if(busMode[2] & MMC_BUSMODE_FALLBACK) debugString_P(PSTR(", after fallback"));
+		debugString_P(PSTR("\r\n"));
+	}
+	
 	// Note: ADFS does not send a SCSI STARTSTOP command on reboot... it assumes that LUN 0 is already started.
 	// This is theoretically incorrect... the host should not assume anything about the state of a SCSI LUN.
 	// However, in order to support this buggy implementation we have to start LUN 0 here.
@@ -281,8 +354,60 @@ bool filesystemSetLunStatus(uint8_t lunNumber, bool lunStatus)
 			return false;
 		}
 		
+		// Open the LUN image file; it stays open until the LUN is stopped so that reads
+		// and writes only need to seek
+		sprintf(fileName, "/BeebSCSI%d/scsi%d.dat", filesystemState.lunDirectory, lunNumber);
+		filesystemState.fsResult = f_open(&filesystemState.fsLunFileObject[lunNumber], fileName, FA_READ | FA_WRITE);
+		if(filesystemState.fsResult != FR_OK)
+		{
+			// Failed!
+			if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemSetLunStatus(): ERROR: Could not open LUN image file!\r\n"));
+			return false;
+		}
+		
+		// Create the cluster link map for the LUN image so that seeking to a sector
+		// doesn't have to follow the FAT chain from the start of the file
+		filesystemState.fsLunLinkMap[lunNumber][0] = LUN_LINKMAP_SIZE;
+		filesystemState.fsLunFileObject[lunNumber].cltbl = filesystemState.fsLunLinkMap[lunNumber];
+		filesystemState.fsResult = f_lseek(&filesystemState.fsLunFileObject[lunNumber], CREATE_LINKMAP);
+		
+		if(filesystemState.fsResult == FR_NOT_ENOUGH_CORE)
+		{
+			// The image is too fragmented for the link map; fall back to normal seeking
+			// Note: FatFs returns the required table size in the first entry
+			if(debugFlag_filesystem) debugStringInt32_P(PSTR("File system: filesystemSetLunStatus(): LUN image too fragmented for fast seek, link map entries required = "), filesystemState.fsLunLinkMap[lunNumber][0], true);
+			filesystemState.fsLunFileObject[lunNumber].cltbl = 0;
+		}
+		else if(filesystemState.fsResult != FR_OK)
+		{
+			// Failed!
+			if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemSetLunStatus(): ERROR: Could not create link map for LUN image file!\r\n"));
+			f_close(&filesystemState.fsLunFileObject[lunNumber]);
+			return false;
+		}
+		else
+		{
+			if(debugFlag_filesystem) debugStringInt32_P(PSTR("File system: filesystemSetLunStatus(): LUN image link map entries used = "), filesystemState.fsLunLinkMap[lunNumber][0], true);
+		}
+		
+		// If the link map holds a single fragment the LUN image is contiguous on the card
+		// (as created by filesystemFormatLun) and can be read and written by physical sector
+		// number without going through FatFs
+		filesystemState.fsLunSectorCount[lunNumber] = (uint32_t)(f_size(&filesystemState.fsLunFileObject[lunNumber]) / SECTOR_SIZE);
+		filesystemState.fsLunBaseSector[lunNumber] = 0;
+		
+		if(filesystemState.fsLunFileObject[lunNumber].cltbl && filesystemState.fsLunLinkMap[lunNumber][0] == 4)
+		{
+			filesystemState.fsLunBaseSector[lunNumber] = filesystemState.fsObject.database +
+				(filesystemState.fsLunLinkMap[lunNumber][2] - 2) * filesystemState.fsObject.csize;
+			
+			if(debugFlag_filesystem) debugStringInt32_P(PSTR("File system: filesystemSetLunStatus(): LUN image is contiguous from sector "), filesystemState.fsLunBaseSector[lunNumber], true);
+		}
+		
 		// Exit with success
 		filesystemState.fsLunStatus[lunNumber] = true;
+		filesystemInvalidateReadAhead(lunNumber, 0, filesystemState.fsLunSectorCount[lunNumber]);
+		lastReadLunNumber = BUFFER_INVALID;
 		
 		if (debugFlag_filesystem)
 		{
@@ -296,9 +421,16 @@ bool filesystemSetLunStatus(uint8_t lunNumber, bool lunStatus)
 	// Transitioning from started to stopped?
 	if(filesystemState.fsLunStatus[lunNumber] == true && lunStatus == false)
 	{
-		// If the LUN image is stopping the file system doesn't need to do anything other
-		// than note the change of status
+		// If the LUN image is stopping the file system only needs to write back any
+		// cached sectors, close the LUN image file and note the change of status
+		if (!filesystemFlushWriteCache())
+		{
+			if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemSetLunStatus(): ERROR: Write-back of cached sectors failed!\r\n"));
+		}
+		f_close(&filesystemState.fsLunFileObject[lunNumber]);
 		filesystemState.fsLunStatus[lunNumber] = false;
+		filesystemInvalidateReadAhead(lunNumber, 0, 0xFFFFFFFF);
+		lastReadLunNumber = BUFFER_INVALID;
 		
 		if (debugFlag_filesystem)
 		{
@@ -319,6 +451,102 @@ bool filesystemReadLunStatus(uint8_t lunNumber)
 	return filesystemState.fsLunStatus[lunNumber];
 }
 
+// Function to read the size of a started LUN image (in sectors)
+uint32_t filesystemGetLunSectorCount(uint8_t lunNumber)
+{
+	if(!filesystemState.fsLunStatus[lunNumber]) return 0;
+	return filesystemState.fsLunSectorCount[lunNumber];
+}
+
+// Function to read the bus mode negotiated with the card
+// busMode[0] = bus width (bits), busMode[1] = bus clock (kHz), busMode[2] = MMC_BUSMODE_ flags
+// Returns false if the card driver does not report a bus mode
+bool filesystemReadCardBusMode(uint32_t busMode[3])
+{
+	DWORD driverBusMode[3];
+	
+	if(!filesystemState.fsMountState) return false;
+	if(disk_ioctl(filesystemState.fsObject.drv, MMC_GET_BUSMODE, driverBusMode) != RES_OK) return false;
+	
+	busMode[0] = driverBusMode[0];
+	busMode[1] = driverBusMode[1];
+	busMode[2] = driverBusMode[2];
+	return true;
+}
+
+#ifdef FILESYSTEM_BENCHMARK
+// Card benchmark -------------------------------------------------------------------------
+//
+// Measures the card transfer rate for single and multiple block runs with the DWT cycle
+// counter.  The write pass rewrites sectors with the data just read from them, so the
+// card contents are unchanged (but do not remove power while it runs).
+
+#define BENCHMARK_RUN_SECTORS	64
+#define BENCHMARK_BYTES			(1024UL * 1024UL)
+
+static uint8_t benchmarkBuffer[BENCHMARK_RUN_SECTORS * SECTOR_SIZE] __attribute__((aligned(4)));  // Word aligned for the SDIO DMA
+
+// Show the transfer rate of a benchmark pass
+static void filesystemBenchmarkReport(const char *name, uint16_t runSectors, uint32_t cycles)
+{
+	debugString_P((char *)name);
+	debugStringInt16_P(PSTR(" "), runSectors, false);
+	debugStringInt32_P(PSTR(" block runs, bytes/s = "), (uint32_t)((uint64_t)SystemCoreClock * BENCHMARK_BYTES / cycles), true);
+}
+
+// Run the card benchmark (called once at start-up after the file system is mounted)
+void filesystemBenchmarkCard(void)
+{
+	static const uint16_t runLengths[] = { 1, 8, BENCHMARK_RUN_SECTORS };
+	BYTE drive = filesystemState.fsObject.drv;
+	DWORD sectorCount;
+	DWORD firstSector;
+	uint32_t runs;
+	uint32_t currentRun;
+	uint32_t startCycles;
+	uint32_t readCycles;
+	uint32_t writeCycles;
+	uint8_t size;
+	
+	if(!filesystemState.fsMountState) return;
+	if(disk_ioctl(drive, GET_SECTOR_COUNT, &sectorCount) != RES_OK) return;
+	
+	// Use the middle of the card, clear of the FAT and directory areas
+	firstSector = sectorCount / 2;
+	
+	for (size = 0; size < sizeof(runLengths) / sizeof(runLengths[0]); size++)
+	{
+		runs = BENCHMARK_BYTES / ((uint32_t)runLengths[size] * SECTOR_SIZE);
+		readCycles = 0;
+		writeCycles = 0;
+		
+		for (currentRun = 0; currentRun < runs; currentRun++)
+		{
+			DWORD sector = firstSector + currentRun * runLengths[size];
+			
+			startCycles = DWT->CYCCNT;
+			if(disk_read(drive, benchmarkBuffer, sector, runLengths[size]) != RES_OK) break;
+			readCycles += DWT->CYCCNT - startCycles;
+			
+			startCycles = DWT->CYCCNT;
+			if(disk_write(drive, benchmarkBuffer, sector, runLengths[size]) != RES_OK) break;
+			writeCycles += DWT->CYCCNT - startCycles;
+		}
+		
+		if (currentRun != runs)
+		{
+			debugStringInt16_P(PSTR("File system: Card benchmark failed with run length "), runLengths[size], true);
+			return;
+		}
+		
+		filesystemBenchmarkReport(PSTR("File system: Card read,"), runLengths[size], readCycles);
+		filesystemBenchmarkReport(PSTR("File system: Card write,"), runLengths[size], writeCycles);
+	}
+	
+	disk_ioctl(drive, CTRL_SYNC, NULL);
+}
+#endif
+
 // Function to confirm that a LUN image is still available
 bool filesystemTestLunStatus(uint8_t lunNumber)
 {
@@ -1117,6 +1345,9 @@ bool filesystemFormatLun(uint8_t lunNumber, uint8_t dataPattern)
 	
 	if (debugFlag_filesystem) debugStringInt16_P(PSTR("File system: filesystemFormatLun(): Formatting LUN image "), lunNumber, true);
 	
+	// The .dat file is recreated below, so the LUN must be stopped to close its image file
+	filesystemSetLunStatus(lunNumber, false);
+	
 	// Read the LUN descriptor for the LUN image into the sector buffer
 	if(!filesystemReadLunDescriptor(lunNumber, sectorBuffer))
 	{
@@ -1189,12 +1420,12 @@ bool filesystemFormatLun(uint8_t lunNumber, uint8_t dataPattern)
 // Functions for reading and writing LUN images ---------------------------------------------------------------------------------------------------------------
 
 // Function to open a LUN ready for reading
-// Note: The read functions use a multi-sector buffer to lower the number of required
-// reads from the physical media.  This is to allow more efficient (larger) reads of data.
+// Note: The read functions use a multi-sector read-ahead window (the sector buffer) to
+// lower the number of required reads from the physical media.  When a read continues
+// from where the previous read ended, a whole window is fetched each time so that the
+// following back-to-back reads are served from memory.
 bool filesystemOpenLunForRead(uint8_t lunNumber, uint32_t startSector, uint32_t requiredNumberOfSectors)
 {
-	uint32_t sectorsToRead = 0;
-	
 	// Ensure there isn't already a LUN image open
 	if(lunOpenFlag)
 	{
@@ -1202,105 +1433,259 @@ bool filesystemOpenLunForRead(uint8_t lunNumber, uint32_t startSector, uint32_t
 		return false;	
 	}
 	
-	// Assemble the .dat file name
-	sprintf(fileName, "/BeebSCSI%d/scsi%d.dat", filesystemState.lunDirectory, lunNumber);
-
-	// Open the DAT file
-	filesystemState.fsResult = f_open(&filesystemState.fileObject, fileName, FA_READ);
-	if (filesystemState.fsResult == FR_OK)
+	// The LUN image file is opened when the LUN is started
+	if(!filesystemState.fsLunStatus[lunNumber])
 	{
-		// Move to the correct point in the DAT file
-		// This is * SECTOR_SIZE as each block is 512 bytes
-		filesystemState.fsResult = f_lseek(&filesystemState.fileObject, startSector * SECTOR_SIZE);
-
-		// Check that the file seek was OK
-		if(filesystemState.fsResult != FR_OK)
+		if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemOpenLunForRead(): ERROR: LUN is not started!\r\n"));
+		return false;
+	}
+	
+	// Check the requested sectors are inside the LUN image
+	if(startSector >= filesystemState.fsLunSectorCount[lunNumber] || requiredNumberOfSectors > filesystemState.fsLunSectorCount[lunNumber] - startSector)
+	{
+		if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemOpenLunForRead(): ERROR: Requested sectors are beyond the end of the LUN image!\r\n"));
+		return false;
+	}
+	
+	// Write back any cached sectors in the requested range so they are read from the card
+	if(filesystemWriteCacheOverlaps(lunNumber, startSector, requiredNumberOfSectors))
+	{
+		if(!filesystemFlushWriteCache())
 		{
-			// Something went wrong with seeking, do not retry
-			if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemOpenLunForRead(): ERROR: Unable to seek to required sector in LUN image file!\r\n"));
-			f_close(&filesystemState.fileObject);
+			if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemOpenLunForRead(): ERROR: Write-back of cached sectors failed!\r\n"));
 			return false;
 		}
 	}
 	
-	// Fill the file system sector buffer
-	sectorsToRead = requiredNumberOfSectors;
-	if (sectorsToRead > SECTOR_BUFFER_LENGTH) sectorsToRead = SECTOR_BUFFER_LENGTH;
+	lunFileObject = &filesystemState.fsLunFileObject[lunNumber];
+	lunOpenNumber = lunNumber;
 	
-	sectorsInBuffer = sectorsToRead;
-	currentBufferSector = 0;
-	sectorsRemaining = requiredNumberOfSectors - sectorsInBuffer;
+	// Is this read continuing a sequential stream?
+	readSequential = (lunNumber == lastReadLunNumber && startSector == lastReadEndSector);
+	lastReadLunNumber = lunNumber;
+	lastReadEndSector = startSector + requiredNumberOfSectors;
 	
-	// Read the required data into the sector buffer
-	filesystemState.fsResult = f_read(&filesystemState.fileObject, sectorBuffer, sectorsToRead * SECTOR_SIZE, &filesystemState.fsCounter);
-	
-	// Check that the file was read OK
-	if(filesystemState.fsResult != FR_OK)
-	{
-		// Something went wrong
-		if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemReadNextSector(): ERROR: Cannot read from LUN image!\r\n"));
-		f_close(&filesystemState.fileObject);
-		return false;
-	}
+	readNextSector = startSector;
+	sectorsRemaining = requiredNumberOfSectors;
 
 	// Exit with success
 	lunOpenFlag = true;
-	if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemOpenLunForRead(): Successful\r\n"));
+	if (debugFlag_filesystem)
+	{
+		if (readSequential) debugString_P(PSTR("File system: filesystemOpenLunForRead(): Successful (sequential)\r\n"));
+		else debugString_P(PSTR("File system: filesystemOpenLunForRead(): Successful\r\n"));
+	}
 	return true;
 }
 
-// Function to read next sector from a LUN
-bool filesystemReadNextSector(uint8_t buffer[])
+// Function to find the read-ahead window holding a LUN sector (BUFFER_INVALID if none)
+static uint8_t filesystemFindReadAhead(uint8_t lunNumber, uint32_t sector)
+{
+	uint8_t window;
+	
+	for(window = 0 ; window < READ_AHEAD_WINDOWS ; window++)
+	{
+		if(bufferLunNumber[window] == lunNumber && sector >= bufferFirstSector[window] &&
+			sector < bufferFirstSector[window] + sectorsInBuffer[window]) return window;
+	}
+	
+	return BUFFER_INVALID;
+}
+
+// Function to wait for the background read-ahead (if any) to complete
+static void filesystemFinishReadAhead(void)
+{
+	DRESULT diskResult;
+	
+	if(bufferFilling == BUFFER_INVALID) return;
+	
+	diskResult = disk_finish(filesystemState.fsObject.drv);
+	if(diskResult != RES_OK)
+	{
+		if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemFinishReadAhead(): ERROR: Background read failed!\r\n"));
+		bufferLunNumber[bufferFilling] = BUFFER_INVALID;
+	}
+	latencyRecord(LATENCY_HISTOGRAM_SD_READ, latencyNow() - backgroundStartCycles);
+	TRACE(TRACE_SD_READ_DONE, diskResult, 0, 0);
+	bufferFilling = BUFFER_INVALID;
+}
+
+// Function to discard the read-ahead windows holding any of the specified LUN sectors
+// Note: A window being filled in the background keeps its buffer until the read completes
+static void filesystemInvalidateReadAhead(uint8_t lunNumber, uint32_t startSector, uint32_t numberOfSectors)
+{
+	uint8_t window;
+	
+	for(window = 0 ; window < READ_AHEAD_WINDOWS ; window++)
+	{
+		if(bufferLunNumber[window] == lunNumber && startSector < bufferFirstSector[window] + sectorsInBuffer[window] &&
+			startSector + numberOfSectors > bufferFirstSector[window]) bufferLunNumber[window] = BUFFER_INVALID;
+	}
+}
+
+// Function to return the number of sectors a window must be read from the card starting
+// at firstSector (the whole window for a sequential stream, otherwise only the sectors
+// still required)
+static uint32_t filesystemReadAheadLength(uint32_t firstSector, uint32_t sectorsRequired)
+{
+	uint32_t sectorsToRead = SECTOR_BUFFER_LENGTH;
+	
+	if (!readSequential && sectorsRequired < sectorsToRead) sectorsToRead = sectorsRequired;
+	if (firstSector + sectorsToRead > filesystemState.fsLunSectorCount[lunOpenNumber])
+		sectorsToRead = filesystemState.fsLunSectorCount[lunOpenNumber] - firstSector;
+	
+	// Sectors beyond the requested ones may be newer in the write-back cache
+	if (sectorsToRead > sectorsRequired && filesystemWriteCacheOverlaps(lunOpenNumber, firstSector, sectorsToRead))
+		sectorsToRead = sectorsRequired;
+	
+	return sectorsToRead;
+}
+
+// Function to return the number of sectors the read-ahead windows must be refilled with
+// before the next sector can be read (0 if the next sector is already in a window)
+static uint32_t filesystemReadRefillLength(void)
+{
+	// Is the required sector inside one of the read-ahead windows?
+	if(filesystemFindReadAhead(lunOpenNumber, readNextSector) != BUFFER_INVALID) return 0;
+	
+	// Refill a window starting from the required sector
+	return filesystemReadAheadLength(readNextSector, sectorsRemaining);
+}
+
+// Function to start reading the sectors that follow a window into the other window in
+// the background (while the host is sent the sectors of the first window)
+static void filesystemStartReadAhead(uint8_t window)
+{
+	uint8_t nextWindow = (window + 1) % READ_AHEAD_WINDOWS;
+	uint32_t nextSector = bufferFirstSector[window] + sectorsInBuffer[window];
+	uint32_t sectorsRequired = 0;
+	uint32_t sectorsToRead;
+	
+	// Collect a background read whose window has since been discarded
+	if(bufferFilling != BUFFER_INVALID && bufferLunNumber[bufferFilling] == BUFFER_INVALID) filesystemFinishReadAhead();
+	
+	// Only one background read at a time, and only directly from the card
+	if(bufferFilling != BUFFER_INVALID || filesystemState.fsLunBaseSector[lunOpenNumber] == 0) return;
+	if(filesystemFindReadAhead(lunOpenNumber, nextSector) != BUFFER_INVALID) return;
+	
+	// Sectors of this read beyond the window?
+	if(sectorsRemaining > nextSector - readNextSector) sectorsRequired = sectorsRemaining - (nextSector - readNextSector);
+	if(!readSequential && sectorsRequired == 0) return;
+	if(nextSector >= filesystemState.fsLunSectorCount[lunOpenNumber]) return;
+	
+	sectorsToRead = filesystemReadAheadLength(nextSector, sectorsRequired);
+	if(sectorsToRead == 0) return;
+	
+	// One background transfer at a time
+	filesystemFinishWriteBack();
+	
+	bufferLunNumber[nextWindow] = BUFFER_INVALID;
+	backgroundStartCycles = latencyNow();
+	TRACE(TRACE_SD_READ_START, filesystemState.fsLunBaseSector[lunOpenNumber] + nextSector, sectorsToRead, 1);
+	if(disk_read_start(filesystemState.fsObject.drv, readAheadBuffer[nextWindow], filesystemState.fsLunBaseSector[lunOpenNumber] + nextSector, sectorsToRead) != RES_OK) return;
+	
+	bufferLunNumber[nextWindow] = lunOpenNumber;
+	bufferFirstSector[nextWindow] = nextSector;
+	sectorsInBuffer[nextWindow] = sectorsToRead;
+	bufferFilling = nextWindow;
+}
+
+// Function to return the number of sectors the next filesystemAcquireReadSector() will read
+// from the card (0 if it will be served from a read-ahead window)
+uint32_t filesystemReadSectorsPending(void)
+{
+	if(!lunOpenFlag || sectorsRemaining == 0) return 0;
+	return filesystemReadRefillLength();
+}
+
+// Function to acquire the next sector of a LUN
+// Returns a pointer to the sector in a read-ahead window (NULL on error).  The sector
+// is sent to the host straight from the window and must be released with
+// filesystemReleaseReadSector() before the next sector is acquired.
+uint8_t *filesystemAcquireReadSector(void)
 {
-	//uint16_t byteCounter;
 	uint32_t sectorsToRead = 0;
+	uint32_t startCycles;
+	uint8_t window;
 	
 	// Ensure there is a LUN image open
-	if(!lunOpenFlag)
+	if(!lunOpenFlag || sectorsRemaining == 0)
 	{
-		if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemReadNextSector(): ERROR: No LUN image open!\r\n"));
-		return false;
+		if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemAcquireReadSector(): ERROR: No LUN image open!\r\n"));
+		return NULL;
 	}
 	
-	// Is the required sector already in the sector buffer?
-	if(currentBufferSector < sectorsInBuffer)
+	// Is the required sector being read in the background?  Wait for it.
+	window = filesystemFindReadAhead(lunOpenNumber, readNextSector);
+	if(window != BUFFER_INVALID && window == bufferFilling)
 	{
-		// Fill the function buffer from the sector buffer
-		memcpy(buffer, sectorBuffer + (currentBufferSector * SECTOR_SIZE), SECTOR_SIZE);
-		
-		// Move to the next sector
-		currentBufferSector++;
+		filesystemFinishReadAhead();
+		window = filesystemFindReadAhead(lunOpenNumber, readNextSector);
 	}
 	
-	// Refill the sector buffer?
-	if(currentBufferSector == sectorsInBuffer)
+	// Is the required sector outside of the read-ahead windows?
+	if(window == BUFFER_INVALID)
 	{
-		// Ensure we have sectors remaining to be read
-		if(sectorsRemaining != 0)
+		// The other window is refilled (after any background read completes)
+		filesystemFinishReadAhead();
+		window = (bufferCurrent + 1) % READ_AHEAD_WINDOWS;
+		bufferLunNumber[window] = BUFFER_INVALID;
+		sectorsToRead = filesystemReadRefillLength();
+		startCycles = latencyNow();
+		TRACE(TRACE_SD_READ_START, filesystemState.fsLunBaseSector[lunOpenNumber] + readNextSector, sectorsToRead, 0);
+		
+		// Read the required data into the window
+		if(filesystemState.fsLunBaseSector[lunOpenNumber] != 0)
 		{
-			sectorsToRead = sectorsRemaining;
-			if (sectorsRemaining > SECTOR_BUFFER_LENGTH) sectorsToRead = SECTOR_BUFFER_LENGTH;
-			
-			sectorsInBuffer = sectorsToRead;
-			currentBufferSector = 0;
-			sectorsRemaining = sectorsRemaining - sectorsInBuffer;
-			
-			// Read the required data into the sector buffer
-			filesystemState.fsResult = f_read(&filesystemState.fileObject, sectorBuffer, sectorsToRead * SECTOR_SIZE, &filesystemState.fsCounter);
+			// Contiguous LUN image - read directly from the physical sectors
+			if(disk_read(filesystemState.fsObject.drv, readAheadBuffer[window], filesystemState.fsLunBaseSector[lunOpenNumber] + readNextSector, sectorsToRead) != RES_OK) filesystemState.fsResult = FR_DISK_ERR;
+			else filesystemState.fsResult = FR_OK;
+		}
+		else
+		{
+			// Move to the correct point in the DAT file (if not already there)
+			filesystemState.fsResult = FR_OK;
+			if (f_tell(lunFileObject) != (FSIZE_t)readNextSector * SECTOR_SIZE)
+				filesystemState.fsResult = f_lseek(lunFileObject, (FSIZE_t)readNextSector * SECTOR_SIZE);
 			
-			// Check that the file was read OK
-			if(filesystemState.fsResult != FR_OK)
+			if (filesystemState.fsResult == FR_OK)
 			{
-				// Something went wrong
-				if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemReadNextSector(): ERROR: Cannot read from LUN image!\r\n"));
-				f_close(&filesystemState.fileObject);
-				return false;
+				filesystemState.fsResult = f_read(lunFileObject, readAheadBuffer[window], sectorsToRead * SECTOR_SIZE, &filesystemState.fsCounter);
+				sectorsToRead = filesystemState.fsCounter / SECTOR_SIZE;
 			}
 		}
+		latencyRecord(LATENCY_HISTOGRAM_SD_READ, latencyNow() - startCycles);
+		TRACE(TRACE_SD_READ_DONE, filesystemState.fsResult, 0, 0);
+		
+		// Check that the file was read OK
+		if(filesystemState.fsResult != FR_OK || sectorsToRead == 0)
+		{
+			// Something went wrong
+			if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemAcquireReadSector(): ERROR: Cannot read from LUN image!\r\n"));
+			return NULL;
+		}
+		
+		bufferLunNumber[window] = lunOpenNumber;
+		bufferFirstSector[window] = readNextSector;
+		sectorsInBuffer[window] = sectorsToRead;
 	}
+	bufferCurrent = window;
+	
+	// Read the following sectors into the other window while this one is sent to the host
+	filesystemStartReadAhead(window);
 	
 	// Exit with success
-	return true;
+	return readAheadBuffer[window] + ((readNextSector - bufferFirstSector[window]) * SECTOR_SIZE);
+}
+
+// Function to release the sector returned by filesystemAcquireReadSector() and move to
+// the next sector
+void filesystemReleaseReadSector(void)
+{
+	if(!lunOpenFlag || sectorsRemaining == 0) return;
+	
+	readNextSector++;
+	sectorsRemaining--;
 }
 
 // Function to close a LUN for reading
@@ -1313,14 +1698,18 @@ bool filesystemCloseLunForRead(void)
 		return false;
 	}
 	
-	// Close the open file object
-	f_close(&filesystemState.fileObject);
+	// The LUN image file stays open (until the LUN is stopped).  The stream ends at the
+	// last sector actually read (the open may have covered adjacent queued reads).
 	lunOpenFlag = false;
+	lastReadEndSector = readNextSector;
 	if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemCloseLunForRead(): Completed\r\n"));
 	return false;
 }
 
 // Function to open a LUN ready for writing
+// Note: The write functions place the written sectors in the write-back cache; they are
+// written to the card when the cache fills, on filesystemFlushWriteCache() (SYNCHRONIZE
+// CACHE, host reset and LUN stop) and by filesystemFlushIdleWriteCache().
 bool filesystemOpenLunForWrite(uint8_t lunNumber, uint32_t startSector, uint32_t requiredNumberOfSectors)
 {
 	// Ensure there isn't already a LUN image open
@@ -1330,26 +1719,26 @@ bool filesystemOpenLunForWrite(uint8_t lunNumber, uint32_t startSector, uint32_t
 		return false;
 	}
 	
-	// Assemble the .dat file name
-	sprintf(fileName, "/BeebSCSI%d/scsi%d.dat", filesystemState.lunDirectory, lunNumber);
-
-	// Open the DAT file
-	filesystemState.fsResult = f_open(&filesystemState.fileObject, fileName, FA_READ | FA_WRITE);
-	if (filesystemState.fsResult == FR_OK)
+	// The LUN image file is opened when the LUN is started
+	if(!filesystemState.fsLunStatus[lunNumber])
 	{
-		// Move to the correct point in the DAT file
-		// This is * 512 as each block is 512 bytes
-		filesystemState.fsResult = f_lseek(&filesystemState.fileObject, startSector * SECTOR_SIZE);
-
-		// Check that the file seek was OK
-		if(filesystemState.fsResult != FR_OK)
-		{
-			// Something went wrong with seeking, do not retry
-			if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemOpenLunForWrite(): ERROR: Unable to seek to required sector in LUN image file!\r\n"));
-			f_close(&filesystemState.fileObject);
-			return false;
-		}
+		if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemOpenLunForWrite(): ERROR: LUN is not started!\r\n"));
+		return false;
+	}
+	
+	// Check the requested sectors are inside the LUN image
+	if(startSector >= filesystemState.fsLunSectorCount[lunNumber] || requiredNumberOfSectors > filesystemState.fsLunSectorCount[lunNumber] - startSector)
+	{
+		if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemOpenLunForWrite(): ERROR: Requested sectors are beyond the end of the LUN image!\r\n"));
+		return false;
 	}
+	
+	lunFileObject = &filesystemState.fsLunFileObject[lunNumber];
+	lunOpenNumber = lunNumber;
+	writeNextSector = startSector;
+	
+	// Discard the read-ahead windows holding any of the sectors being written
+	filesystemInvalidateReadAhead(lunNumber, startSector, requiredNumberOfSectors);
 
 	// Exit with success
 	lunOpenFlag = true;
@@ -1357,30 +1746,138 @@ bool filesystemOpenLunForWrite(uint8_t lunNumber, uint32_t startSector, uint32_t
 	return true;
 }
 
-// Function to write next sector to a LUN
-bool filesystemWriteNextSector(uint8_t buffer[])
+// Function to return the number of adjacent sectors held in consecutive slots from a
+// cache position (a run stops at the end of the slot array so it is contiguous in memory)
+static uint32_t filesystemWriteCacheRun(uint32_t position)
+{
+	uint32_t slot = WRITE_CACHE_SLOT(position);
+	uint32_t runLength = 1;
+	
+	while(position + runLength < writeCacheCount && slot + runLength < WRITE_CACHE_SECTORS &&
+		writeCacheLunNumber[slot + runLength] == writeCacheLunNumber[slot] &&
+		writeCacheSector[slot + runLength] == writeCacheSector[slot] + runLength) runLength++;
+	
+	return runLength;
+}
+
+// Function to wait for the background write-back (if any) and free its slots
+// Note: A failure is reported by the next filesystemFlushWriteCache()
+static void filesystemFinishWriteBack(void)
+{
+	DRESULT diskResult;
+	
+	if(writeCacheDraining == 0) return;
+	
+	diskResult = disk_finish(filesystemState.fsObject.drv);
+	if(diskResult != RES_OK)
+	{
+		if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemFinishWriteBack(): ERROR: Background write-back failed!\r\n"));
+		writeCacheErrorFlag = true;
+	}
+	latencyRecord(LATENCY_HISTOGRAM_SD_WRITE, latencyNow() - backgroundStartCycles);
+	TRACE(TRACE_SD_WRITE_DONE, diskResult, 0, 0);
+	
+	writeCacheFirst = WRITE_CACHE_SLOT(writeCacheDraining);
+	writeCacheCount -= writeCacheDraining;
+	writeCacheDraining = 0;
+}
+
+// Function to start writing the oldest run of cached sectors to the card in the background
+// Note: Only contiguous LUN images are written in the background (straight to the card);
+// returns false if nothing was started
+static bool filesystemStartWriteBack(void)
+{
+	uint32_t slot = writeCacheFirst;
+	uint8_t lunNumber = writeCacheLunNumber[slot];
+	uint32_t runLength;
+	
+	if(writeCacheDraining != 0 || writeCacheCount == 0) return false;
+	if(!filesystemState.fsLunStatus[lunNumber] || filesystemState.fsLunBaseSector[lunNumber] == 0) return false;
+	
+	// One background transfer at a time
+	filesystemFinishReadAhead();
+	
+	runLength = filesystemWriteCacheRun(0);
+	backgroundStartCycles = latencyNow();
+	TRACE(TRACE_SD_WRITE_START, filesystemState.fsLunBaseSector[lunNumber] + writeCacheSector[slot], runLength, 1);
+	if(disk_write_start(filesystemState.fsObject.drv, writeCacheBuffer[slot], filesystemState.fsLunBaseSector[lunNumber] + writeCacheSector[slot], runLength) != RES_OK) return false;
+	
+	writeCacheDraining = runLength;
+	return true;
+}
+
+// Function to collect a completed background write-back and start the next one (never waits)
+static void filesystemServiceWriteCache(void)
+{
+	if(writeCacheDraining != 0 && !disk_busy(filesystemState.fsObject.drv)) filesystemFinishWriteBack();
+	if(writeCacheDraining == 0 && writeCacheCount >= WRITE_CACHE_DRAIN_SECTORS) filesystemStartWriteBack();
+}
+
+// Function to acquire the write-back cache slot for the next sector of a LUN
+// Returns a pointer to the slot (NULL on error).  The sector is always received from the
+// host into the next free slot (never into a cached copy of the same sector), so a
+// transfer cut short by a reset leaves the cache untouched; it is only added to the cache
+// by filesystemReleaseWriteSector().
+uint8_t *filesystemAcquireWriteSector(void)
 {
 	// Ensure there is a LUN image open
 	if(!lunOpenFlag)
 	{
-		if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemWriteNextSector(): ERROR: No LUN image open!\r\n"));
-		return false;
+		if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemAcquireWriteSector(): ERROR: No LUN image open!\r\n"));
+		return NULL;
 	}
 	
-	// Write the required data
-	filesystemState.fsResult = f_write(&filesystemState.fileObject, buffer, SECTOR_SIZE, &filesystemState.fsCounter);
-	
-	// Check that the file was written OK
-	if(filesystemState.fsResult != FR_OK)
+	// Make room in the cache if it is full (waiting for the background write-back
+	// first, then writing the oldest run or, failing that, the whole cache)
+	if(writeCacheCount == WRITE_CACHE_SECTORS) filesystemFinishWriteBack();
+	if(writeCacheCount == WRITE_CACHE_SECTORS && filesystemStartWriteBack()) filesystemFinishWriteBack();
+	if(writeCacheCount == WRITE_CACHE_SECTORS)
 	{
-		// Something went wrong
-		if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemWriteNextSector(): ERROR: Cannot write to LUN image!\r\n"));
-		f_close(&filesystemState.fileObject);
-		return false;
+		if(!filesystemFlushWriteCache())
+		{
+			// Something went wrong
+			if(debugFlag_filesystem) debugString_P(PSTR("File system: filesystemAcquireWriteSector(): ERROR: Cannot write to LUN image!\r\n"));
+			return NULL;
+		}
 	}
 	
 	// Exit with success
-	return true;
+	writeAcquiredSlot = WRITE_CACHE_SLOT(writeCacheCount);
+	return writeCacheBuffer[writeAcquiredSlot];
+}
+
+// Function to add the sector filled through filesystemAcquireWriteSector() to the
+// write-back cache and move to the next sector
+// Note: A complete rewrite of a cached sector that is not being written back replaces
+// the older copy (the new slot is left free).  Otherwise the new slot is added after
+// the older copy, and as the cache is written back oldest first the newer copy wins.
+void filesystemReleaseWriteSector(void)
+{
+	uint32_t position;
+	uint32_t slot;
+	
+	if(!lunOpenFlag || writeAcquiredSlot == WRITE_CACHE_SECTORS) return;
+	
+	for(position = writeCacheDraining ; position < writeCacheCount ; position++)
+	{
+		slot = WRITE_CACHE_SLOT(position);
+		if(writeCacheSector[slot] == writeNextSector && writeCacheLunNumber[slot] == lunOpenNumber) break;
+	}
+	
+	if(position < writeCacheCount) memcpy(writeCacheBuffer[slot], writeCacheBuffer[writeAcquiredSlot], SECTOR_SIZE);
+	else
+	{
+		writeCacheLunNumber[writeAcquiredSlot] = lunOpenNumber;
+		writeCacheSector[writeAcquiredSlot] = writeNextSector;
+		writeCacheCount++;
+	}
+	
+	writeAcquiredSlot = WRITE_CACHE_SECTORS;
+	writeNextSector++;
+	writeCacheTick = HAL_GetTick();
+	
+	// Keep the card busy with the oldest sectors while the host sends the next ones
+	filesystemServiceWriteCache();
 }
 
 // Function to close a LUN for writing
@@ -1393,13 +1890,142 @@ bool filesystemCloseLunForWrite(void)
 		return false;
 	}
 	
-	// Close the open file object
-	f_close(&filesystemState.fileObject);
+	// The written data stays in the write-back cache (and the LUN image file stays open
+	// until the LUN is stopped).  A sector acquired but not released is discarded.
 	lunOpenFlag = false;
+	writeAcquiredSlot = WRITE_CACHE_SECTORS;
 	if (debugFlag_filesystem) debugString_P(PSTR("File system: filesystemCloseLunForWrite(): Completed\r\n"));
 	return false;
 }
 
+// Function to return the number of sectors the next filesystemAcquireWriteSector() will write
+// to the card (0 unless the write-back cache is full)
+uint32_t filesystemWriteSectorsPending(void)
+{
+	if(!lunOpenFlag || writeCacheCount < WRITE_CACHE_SECTORS) return 0;
+	
+	// Room is made by the background write-back (or by writing the cache)
+	if(writeCacheDraining != 0) return writeCacheDraining;
+	return writeCacheCount;
+}
+
+// Function to return the number of sectors filesystemFlushWriteCache() will write to the card
+uint32_t filesystemFlushSectorsPending(void)
+{
+	return writeCacheCount;
+}
+
+// Function to check if any of the specified LUN sectors are in the write-back cache
+bool filesystemWriteCacheOverlaps(uint8_t lunNumber, uint32_t startSector, uint32_t numberOfSectors)
+{
+	uint32_t position;
+	uint32_t slot;
+	
+	for(position = 0 ; position < writeCacheCount ; position++)
+	{
+		slot = WRITE_CACHE_SLOT(position);
+		if(writeCacheLunNumber[slot] == lunNumber && writeCacheSector[slot] >= startSector &&
+			writeCacheSector[slot] < startSector + numberOfSectors) return true;
+	}
+	
+	return false;
+}
+
+// Function to write a run of adjacent sectors to a LUN image
+static bool filesystemWriteLunSectors(uint8_t lunNumber, uint32_t startSector, uint8_t *buffer, uint32_t numberOfSectors)
+{
+	uint32_t startCycles = latencyNow();
+	DRESULT diskResult;
+	
+	TRACE(TRACE_SD_WRITE_START, filesystemState.fsLunBaseSector[lunNumber] + startSector, numberOfSectors, 0);
+	
+	// Contiguous LUN image?
+	if(filesystemState.fsLunBaseSector[lunNumber] != 0)
+	{
+		// Write directly to the physical sectors
+		diskResult = disk_write(filesystemState.fsObject.drv, buffer, filesystemState.fsLunBaseSector[lunNumber] + startSector, numberOfSectors);
+		latencyRecord(LATENCY_HISTOGRAM_SD_WRITE, latencyNow() - startCycles);
+		TRACE(TRACE_SD_WRITE_DONE, diskResult, 0, 0);
+		return diskResult == RES_OK;
+	}
+	
+	// Move to the correct point in the DAT file and write the sectors
+	filesystemState.fsResult = f_lseek(&filesystemState.fsLunFileObject[lunNumber], (FSIZE_t)startSector * SECTOR_SIZE);
+	if(filesystemState.fsResult == FR_OK)
+		filesystemState.fsResult = f_write(&filesystemState.fsLunFileObject[lunNumber], buffer, numberOfSectors * SECTOR_SIZE, &filesystemState.fsCounter);
+	latencyRecord(LATENCY_HISTOGRAM_SD_WRITE, latencyNow() - startCycles);
+	TRACE(TRACE_SD_WRITE_DONE, filesystemState.fsResult, 0, 0);
+	
+	if(filesystemState.fsResult != FR_OK || filesystemState.fsCounter != numberOfSectors * SECTOR_SIZE) return false;
+	return true;
+}
+
+// Function to write the contents of the write-back cache to the LUN images
+// Note: Returns false if this or any earlier (idle) write-back failed
+bool filesystemFlushWriteCache(void)
+{
+	uint32_t position = 0;
+	uint32_t slot;
+	uint32_t runLength;
+	uint8_t lunNumber;
+	uint8_t syncMask = 0;
+	bool errorFlag;
+	
+	// Wait for the background write-back (its failure is reported below)
+	filesystemFinishWriteBack();
+	errorFlag = writeCacheErrorFlag;
+	
+	if(writeCacheCount != 0 && debugFlag_filesystem) debugStringInt32_P(PSTR("File system: filesystemFlushWriteCache(): Writing back cached sectors = "), writeCacheCount, true);
+	
+	while(position < writeCacheCount)
+	{
+		slot = WRITE_CACHE_SLOT(position);
+		lunNumber = writeCacheLunNumber[slot];
+		
+		// Find the run of adjacent sectors held in consecutive slots
+		runLength = filesystemWriteCacheRun(position);
+		
+		// Write the run to the LUN image
+		if(!filesystemState.fsLunStatus[lunNumber] || !filesystemWriteLunSectors(lunNumber, writeCacheSector[slot], writeCacheBuffer[slot], runLength))
+		{
+			if(debugFlag_filesystem) debugStringInt16_P(PSTR("File system: filesystemFlushWriteCache(): ERROR: Cannot write to LUN image for LUN #"), lunNumber, true);
+			errorFlag = true;
+		}
+		else if(filesystemState.fsLunBaseSector[lunNumber] == 0) syncMask |= (1 << lunNumber);
+		
+		position += runLength;
+	}
+	
+	// Flush the FatFs written LUN images to the card
+	// Note: Writes to a contiguous LUN image go straight to the card and leave nothing to flush
+	for(lunNumber = 0 ; lunNumber < 8 ; lunNumber++)
+	{
+		if(syncMask & (1 << lunNumber)) f_sync(&filesystemState.fsLunFileObject[lunNumber]);
+	}
+	
+	writeCacheFirst = 0;
+	writeCacheCount = 0;
+	writeCacheErrorFlag = false;
+	return !errorFlag;
+}
+
+// Function to write back the cache once no sectors have been written for WRITE_CACHE_IDLE_MS
+// (called from the main loop)
+void filesystemFlushIdleWriteCache(void)
+{
+	// Nothing cached, or a LUN is being read or written?
+	if(writeCacheCount == 0 || lunOpenFlag) return;
+	
+	// Collect a completed background write-back
+	filesystemServiceWriteCache();
+	
+	if((HAL_GetTick() - writeCacheTick) >= WRITE_CACHE_IDLE_MS)
+	{
+		// A failure is reported by the next explicit flush
+		if(!filesystemFlushWriteCache()) writeCacheErrorFlag = true;
+	}
+}
+
 
 // Functions for FAT Transfer support --------------
 
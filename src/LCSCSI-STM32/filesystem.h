@@ -2,16 +2,33 @@
 
 #define SECTOR_SIZE				512
 
-// Read/Write sector buffer (must be 256 bytes minimum)
-// Testing shows that this is optimal when it matches the sector size of
-// the SD card (which is 512 bytes).
+// Number of sectors held in each of the two read-ahead windows
+// Sequential reads are served from the windows and each refill is a single
+// multi-sector read from the SD card; the next window is read in the background
+// while the current one is sent to the host.
+#define SECTOR_BUFFER_SECTORS	8
 
-#define SECTOR_BUFFER_SIZE		SECTOR_SIZE
+// Size of each read-ahead window in bytes
+#define SECTOR_BUFFER_SIZE		(SECTOR_SIZE * SECTOR_BUFFER_SECTORS)
 
 
-// Calculate the length of the sector buffer in 256 byte sectors
+// Length of each read-ahead window in SECTOR_SIZE (512 byte) sectors
 #define SECTOR_BUFFER_LENGTH	(SECTOR_BUFFER_SIZE / SECTOR_SIZE)
 
+// Number of sectors held in the write-back cache (a ring of slots)
+// Once WRITE_CACHE_DRAIN_SECTORS are cached the oldest run is written to the card in
+// the background while the host keeps sending; the host only waits when the ring is
+// full.  The rest is written back on SYNCHRONIZE CACHE, host reset, LUN stop and after
+// WRITE_CACHE_IDLE_MS without any writes.
+#define WRITE_CACHE_SECTORS		16
+#define WRITE_CACHE_DRAIN_SECTORS	(WRITE_CACHE_SECTORS / 2)
+#define WRITE_CACHE_IDLE_MS		250
+
+// Size of the FatFs cluster link map kept for each started LUN image (in DWORDs)
+// A table of 2 + (2 * fragments) entries is required; images with more fragments
+// than fit are accessed without fast seek.
+#define LUN_LINKMAP_SIZE		32
+
 // External prototypes
 void filesystemInitialise(void);
 void filesystemReset(void);
@@ -24,7 +41,9 @@ uint8_t filesystemGetLunDirectory(void);
 
 bool filesystemSetLunStatus(uint8_t lunNumber, bool lunStatus);
 bool filesystemReadLunStatus(uint8_t lunNumber);
+uint32_t filesystemGetLunSectorCount(uint8_t lunNumber);
 bool filesystemTestLunStatus(uint8_t lunNumber);
+bool filesystemReadCardBusMode(uint32_t busMode[3]);
 void filesystemReadLunUserCode(uint8_t lunNumber, uint8_t userCode[5]);
 
 bool filesystemCheckLunDirectory(uint8_t lunDirectory);
@@ -42,11 +61,23 @@ bool filesystemWriteLunDescriptor(uint8_t lunNumber, uint8_t buffer[]);
 bool filesystemFormatLun(uint8_t lunNumber, uint8_t dataPattern);
 
 bool filesystemOpenLunForRead(uint8_t lunNumber, uint32_t startSector, uint32_t requiredNumberOfSectors);
-bool filesystemReadNextSector(uint8_t buffer[]);
+uint8_t *filesystemAcquireReadSector(void);
+void filesystemReleaseReadSector(void);
+uint32_t filesystemReadSectorsPending(void);
 bool filesystemCloseLunForRead(void);
 bool filesystemOpenLunForWrite(uint8_t lunNumber, uint32_t startSector, uint32_t requiredNumberOfSectors);
-bool filesystemWriteNextSector(uint8_t buffer[]);
+uint8_t *filesystemAcquireWriteSector(void);
+void filesystemReleaseWriteSector(void);
+uint32_t filesystemWriteSectorsPending(void);
+uint32_t filesystemFlushSectorsPending(void);
 bool filesystemCloseLunForWrite(void);
+bool filesystemWriteCacheOverlaps(uint8_t lunNumber, uint32_t startSector, uint32_t numberOfSectors);
+bool filesystemFlushWriteCache(void);
+void filesystemFlushIdleWriteCache(void);
+
+#ifdef FILESYSTEM_BENCHMARK
+void filesystemBenchmarkCard(void);
+#endif
 
 bool filesystemSetFatDirectory(uint8_t *buffer);
 bool filesystemGetFatFileInfo(uint32_t fileNumber, uint8_t *buffer);
@@ -6,7 +6,10 @@
 // Local includes
 #include "debug.h"
 #include "hostadapter.h"
+#include "latency.h"
+#include "trace.h"
 #include "tm_stm32_gpio.h"
+#include "tm_stm32_delay.h"
 
 
 
@@ -19,20 +22,132 @@
 // Globals for the interrupt service routines
 volatile bool nrstFlag = false;
 
+// SCSI signal pin map
+//
+// Generates the accessors for each signal from its port and pin definitions so that
+// every handshake step compiles to a single BSRR store or IDR test (all SCSI signals
+// are inverted logic: asserted = low)
+#define SCSI_SIGNAL(name, port, pin) \
+	static inline __attribute__((always_inline)) void signal##name##Assert(void) { (port)->BSRR = (uint32_t)(pin) << 16; } \
+	static inline __attribute__((always_inline)) void signal##name##Release(void) { (port)->BSRR = (uint32_t)(pin); } \
+	static inline __attribute__((always_inline)) bool signal##name##Asserted(void) { return ((port)->IDR & (pin)) == 0; }
+
+SCSI_SIGNAL(Bsy, SCSI_BSY_GPIO_Port, SCSI_BSY_Pin)
+SCSI_SIGNAL(Req, SCSI_REQ_GPIO_Port, SCSI_REQ_Pin)
+SCSI_SIGNAL(Io, SCSI_I_O_GPIO_Port, SCSI_I_O_Pin)
+SCSI_SIGNAL(Atn, SCSI_ATN_Port, SCSI_ATN_Pin)
+SCSI_SIGNAL(Sel, SCSI_SEL_GPIO_Port, SCSI_SEL_Pin)
+SCSI_SIGNAL(Ack, SCSI_ACK_GPIO_Port, SCSI_ACK_Pin)
+
+// Wait for the host to assert ACK (or signal a reset)
+static inline __attribute__((always_inline)) void signalAckWait(void)
+{
+	while (!signalAckAsserted() && !nrstFlag);
+}
+
+// Wait for the host to release ACK (or signal a reset)
+static inline __attribute__((always_inline)) void signalAckReleaseWait(void)
+{
+	while (signalAckAsserted() && !nrstFlag);
+}
+
+// Block transfer engines
+//
+// Both engines move data phase bytes with DMA2 on TIM1 requests (DMA1, which serves
+// the other timers, can not access the GPIO ports on the F401).  The REQ edges are
+// written to the GPIOC BSRR by DMA as REQ is not a timer pin.  ACK (PC7) is TIM3_CH2
+// and reaches TIM1 through the TIM3 trigger output (TIM1 ITR2).
+//
+// Asynchronous: every ACK edge resets TIM3, which clocks TIM1 (ARR = 1).  ACK asserted
+// (CC1/CC2 match) moves the next byte to or from the databus then releases REQ; ACK
+// released (update) asserts REQ for the next byte.  The CPU only starts the block
+// and waits for it to finish, so interrupts stay enabled.
+//
+// Synchronous: REQ pulses are generated by TIM1 at the negotiated period (CC1 moves
+// the next byte to the databus, CC2 asserts REQ and the update releases it).  ACK
+// edges clock TIM3 so the number of outstanding REQs can be kept within the
+// negotiated offset.  TIM1 runs in one-pulse mode with the repetition counter set, so
+// each burst of REQ pulses stops by itself.  This is used for data in only.
+//
+// Data out always uses the asynchronous engine, even when synchronous transfers were
+// negotiated.  A synchronous initiator only holds the data for a short time after
+// asserting ACK, so each byte must be latched by the ACK edge itself; on the F401 only
+// the TIM1 requests reach DMA2 and ACK is not a TIM1 input, so the ACK-clocked engine
+// is the only hardware latch available.  It keeps one REQ outstanding (REQ is held
+// until ACK is asserted), which is within any agreed offset.
+#define DMA_TIMER_CHANNEL		DMA_CHANNEL_6				// TIM1 requests are on DMA2 channel 6
+
+uint8_t syncPeriod = 0;		// Negotiated period (SDTR units of 4nS)
+uint8_t syncOffset = 0;		// Negotiated offset (0 = asynchronous transfers)
+static uint16_t syncPeriodTicks;
+static uint32_t syncTimerClock;		// TIM1 clock in Hz (set from the clock tree by hostadapterInitialise())
+
+// Databus image of a data in block (the bus is inverted logic)
+static uint8_t dmaBuffer[512];
+
+// Asynchronous DMA block in progress
+static uint8_t *dmaDataBuffer;		// Data out destination (NULL for data in)
+static uint16_t dmaLength;
+
+// GPIOC BSRR words for the REQ edges (REQ is inverted logic)
+static const uint32_t dmaRequestAssert = (uint32_t)SCSI_REQ_Pin << 16;
+static const uint32_t dmaRequestRelease = SCSI_REQ_Pin;
+
+static void hostadapterDmaInitialise(void);
+static uint16_t hostadapterSyncSend(const uint8_t *dataBuffer, uint16_t length);
+
 // Timeout counter (used when interrupts are not available to ensure
 // DMA read and writes do not hang the AVR waiting for host response
 // Note: This is an unsigned 32 bit integer and should therefore be
 // smaller than 4,294,967,295
 #define TOC_MAX 100000
 
+// Selection detection
+//
+// SEL is attached to an EXTI interrupt.  The interrupt waits for the initiator to
+// release BSY, lets the databus settle and latches the ID mask.  If our ID is in the
+// mask BSY is asserted at once (well within the 200uS selection abort time) and the
+// selection is handed to the SCSI emulation.  Delays are counted in core clock cycles
+// with the DWT cycle counter, derived from the core clock.
+#define SELECTION_SETTLE_CYCLES	(SystemCoreClock / 2000000)		// Bus settle delay plus two deskew delays (500nS)
+#define SELECTION_BSY_CYCLES	(SystemCoreClock / 5000)		// Longest wait for the initiator to release BSY (200uS)
+
+static uint8_t selectionId = 1;				// Target ID to respond to
+static volatile bool selectionFlag = false;	// Selection latched by the interrupt
+static volatile uint8_t selectionMask;		// Databus ID mask latched with the selection
+
+// Bus phase controller
+//
+// The MSG, C/D and I/O signals (all on GPIOC, inverted logic) for each information
+// transfer phase as a single BSRR write, indexed by (MSG << 2) | (C/D << 1) | I/O
+#define PHASE_BSRR(message, commandNotData, inputNotOutput) \
+	(((message) ? (uint32_t)SCSI_MSG_Pin << 16 : SCSI_MSG_Pin) | \
+	((commandNotData) ? (uint32_t)SCSI_C_D_Pin << 16 : SCSI_C_D_Pin) | \
+	((inputNotOutput) ? (uint32_t)SCSI_I_O_Pin << 16 : SCSI_I_O_Pin))
+
+static const uint32_t phaseSignals[8] =
+{
+	PHASE_BSRR(0, 0, 0), PHASE_BSRR(0, 0, 1), PHASE_BSRR(0, 1, 0), PHASE_BSRR(0, 1, 1),
+	PHASE_BSRR(1, 0, 0), PHASE_BSRR(1, 0, 1), PHASE_BSRR(1, 1, 0), PHASE_BSRR(1, 1, 1)
+};
+
+// Databus (PB0-7) mode bits: input or general purpose output
+#define DATABUS_MODER_MASK		0x0000FFFF
+#define DATABUS_MODER_OUTPUT	0x00005555
+
+// Phase currently on the bus (PHASE_UNKNOWN after the signals or the databus direction
+// are changed directly)
+#define PHASE_UNKNOWN			0xFF
+static uint8_t currentPhase = PHASE_UNKNOWN;
+
 // Initialise the host adapter hardware (called on a cold-start of the AVR)
 void hostadapterInitialise(void)
 {
 	// Initialise the host adapter input/output pins
 
-	// Set the host adapter databus to input
-	hostadapterDatabusInput();
-	
+	// Set the host adapter databus to input (open-drain when switched to output)
+	TM_GPIO_Init(DATABUS_PORT, GPIO_Pin_0 | GPIO_Pin_1 | GPIO_Pin_2 | GPIO_Pin_3 | GPIO_Pin_4 | GPIO_Pin_5 | GPIO_Pin_6 | GPIO_Pin_7, TM_GPIO_Mode_IN, TM_GPIO_OType_OD, TM_GPIO_PuPd_NOPULL, TM_GPIO_Speed_High);
+	currentPhase = PHASE_UNKNOWN;
 		
 	// Configure the status byte output pins to output
 	//STATUS_NMSG_DDR |= STATUS_NMSG;  // Output
@@ -104,6 +219,13 @@ void hostadapterInitialise(void)
 	if (TM_EXTI_Attach(GPIOA, GPIO_Pin_0, TM_EXTI_Trigger_Falling) != TM_EXTI_Result_Ok) {
 		
 	}
+	
+	// SEL (the selection delays are timed with the DWT cycle counter)
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	if (TM_EXTI_Attach(SCSI_SEL_GPIO_Port, SCSI_SEL_Pin, TM_EXTI_Trigger_Falling) != TM_EXTI_Result_Ok) {
+		
+	}
 //	// CONF
 //	if (TM_EXTI_Attach(GPIOA, GPIO_Pin_1, TM_EXTI_Trigger_Falling) != TM_EXTI_Result_Ok) {
 //		
@@ -112,6 +234,43 @@ void hostadapterInitialise(void)
 	
 	TM_GPIO_SetPinHigh(SCSI_RST_GPIO_Port, SCSI_RST_Pin);
 	
+	// TIM1 runs from the APB2 timer clock, which is twice PCLK2 unless the APB2 prescaler is 1
+	syncTimerClock = HAL_RCC_GetPCLK2Freq();
+	if((RCC->CFGR & RCC_CFGR_PPRE2) != RCC_CFGR_PPRE2_DIV1) syncTimerClock *= 2;
+	
+	// Set up the block transfer engines (transfers start asynchronous)
+	hostadapterDmaInitialise();
+}
+
+// Answer a selection (called from the SEL interrupt)
+static void hostadapterSelectionInterrupt(void)
+{
+	uint32_t startCycles = DWT->CYCCNT;
+	uint8_t mask;
+	
+	// Ignore SEL while we own the bus (our own SEL during reselection) or a selection is
+	// still waiting to be processed
+	if ((SCSI_BSY_GPIO_Port->ODR & SCSI_BSY_Pin) == 0 || selectionFlag) return;
+	
+	// The initiator releases BSY after asserting SEL (following arbitration)
+	while (signalBsyAsserted())
+	{
+		if (!signalSelAsserted() || (DWT->CYCCNT - startCycles) >= SELECTION_BSY_CYCLES) return;
+	}
+	
+	// Wait for the databus to settle then latch the ID mask
+	startCycles = DWT->CYCCNT;
+	while ((DWT->CYCCNT - startCycles) < SELECTION_SETTLE_CYCLES);
+	mask = ~(DATABUS_PORT->IDR & 0xFF);
+	
+	// Not for us (or SEL went away)?  The SCSI emulation treats the bus as busy.
+	if (!(mask & (1 << selectionId)) || !signalSelAsserted()) return;
+	
+	// Respond with BSY
+	signalBsyAssert();
+	TRACE(TRACE_HOST_SELECTION, mask, 0, 0);
+	selectionMask = mask;
+	selectionFlag = true;
 }
 
 void TM_EXTI_Handler(uint16_t GPIO_Pin) {
@@ -119,6 +278,11 @@ void TM_EXTI_Handler(uint16_t GPIO_Pin) {
 	if (GPIO_Pin == GPIO_Pin_0) {
 		nrstFlag = true;
 	}
+	
+	// Sel
+	if (GPIO_Pin == SCSI_SEL_Pin) {
+		hostadapterSelectionInterrupt();
+	}
     
 	// Conf
 	
@@ -194,7 +358,11 @@ void hostadapterReset(void)
 //	STATUS_CND_PORT  |= STATUS_CND;
 
 	TM_GPIO_SetPinHigh(GPIOC, SCSI_MSG_Pin | SCSI_BSY_Pin | SCSI_REQ_Pin | SCSI_I_O_Pin | SCSI_C_D_Pin);
+	TRACE(TRACE_HOST_RESET, 0, 0, 0);
 	
+	// Synchronous transfer agreements and pending selections are cleared by a reset
+	hostadapterSetSyncTransfer(0, 0);
+	selectionFlag = false;
 }
 
 
@@ -207,9 +375,9 @@ inline void hostadapterDatabusInput(void)
 	// Turn off weak pull-ups
 	//DATABUS_PORT->PUPDR &= 0xFFFF0000;
 	
-	TM_GPIO_Init(DATABUS_PORT, GPIO_Pin_0 | GPIO_Pin_1 | GPIO_Pin_2 | GPIO_Pin_3 | GPIO_Pin_4 | GPIO_Pin_5 | GPIO_Pin_6 | GPIO_Pin_7, TM_GPIO_Mode_IN, TM_GPIO_OType_OD, TM_GPIO_PuPd_NOPULL, TM_GPIO_Speed_High);
-	
-	
+	// The output type, pull-ups and speed are set once by hostadapterInitialise()
+	DATABUS_PORT->MODER &= ~DATABUS_MODER_MASK;
+	currentPhase = PHASE_UNKNOWN;
 }
 
 // Set the databus direction to output
@@ -220,7 +388,8 @@ inline void hostadapterDatabusOutput(void)
 	// Set the databus direction to output
 	//DATABUS_PORT->MODER |= 0x00005555;
 	
-	TM_GPIO_Init(DATABUS_PORT, GPIO_Pin_0 | GPIO_Pin_1 | GPIO_Pin_2 | GPIO_Pin_3 | GPIO_Pin_4 | GPIO_Pin_5 | GPIO_Pin_6 | GPIO_Pin_7, TM_GPIO_Mode_OUT, TM_GPIO_OType_OD, TM_GPIO_PuPd_NOPULL, TM_GPIO_Speed_High);
+	DATABUS_PORT->MODER = (DATABUS_PORT->MODER & ~DATABUS_MODER_MASK) | DATABUS_MODER_OUTPUT;
+	currentPhase = PHASE_UNKNOWN;
 }
 
 // Read a byte from the databus (directly)
@@ -242,43 +411,53 @@ inline void hostadapterWritedatabus(uint8_t databusValue)
 inline uint8_t hostadapterReadByte(void)
 {
 	uint8_t databusValue = 0;
+	uint32_t requestCycles;
 
 	// Set the REQuest signal
 	//SCSI_REQ_GPIO_Port->ODR &= ~STATUS_NREQ;  // REQ = 0 (active)
-	TM_GPIO_SetPinLow(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);
+	signalReqAssert();
+	requestCycles = latencyNow();
 	
 	// Wait for ACKnowledge
 	//while(((SCSI_ACK_GPIO_Port->IDR & NACK) != 0) && nrstFlag == false);
-	while((TM_GPIO_GetInputPinValue(SCSI_ACK_GPIO_Port, SCSI_ACK_Pin) != 0) && nrstFlag == false);
+	signalAckWait();
+	requestCycles = latencyNow() - requestCycles;
 	
 	// Clear the REQuest signal
 	//SCSI_REQ_GPIO_Port->ODR |= STATUS_NREQ;  // REQ = 1 (inactive)
-	TM_GPIO_SetPinHigh(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);
+	signalReqRelease();
 	
 	// Read the databus value
 	databusValue = ~(DATABUS_PORT->IDR & 0xff); 
 	
+	latencyRecord(LATENCY_HISTOGRAM_ACK_WAIT, requestCycles);
 	return databusValue;
 }
 
 // Function to write a byte to the host (using REQ/ACK)
 inline void hostadapterWriteByte(uint8_t databusValue)
 {
+	uint32_t requestCycles;
+	
 	// Write the byte of data to the databus
 	DATABUS_PORT->ODR = ~databusValue;
 	
 	// Set the REQuest signal
 	//STATUS_NREQ_PORT &= ~STATUS_NREQ;  // REQ = 0 (active)
-	TM_GPIO_SetPinLow(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);
+	signalReqAssert();
+	requestCycles = latencyNow();
 	
 	// Wait for ACKnowledge
 	//while(((NACK_PIN & NACK) != 0) && nrstFlag == false);
 	//while(((SCSI_ACK_GPIO_Port->IDR & NACK) != 0) && nrstFlag == false);
-	while((TM_GPIO_GetInputPinValue(SCSI_ACK_GPIO_Port, SCSI_ACK_Pin) != 0) && nrstFlag == false);
+	signalAckWait();
+	requestCycles = latencyNow() - requestCycles;
 	
 	// Clear the REQuest signal
 	//SCSI_REQ_GPIO_Port->ODR |= STATUS_NREQ;   // REQ = 1 (inactive)
-	TM_GPIO_SetPinHigh(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);
+	signalReqRelease();
+	
+	latencyRecord(LATENCY_HISTOGRAM_ACK_WAIT, requestCycles);
 }
 
 // Function to write the host reset flag
@@ -297,25 +476,25 @@ bool hostadapterReadResetFlag(void)
 // Note: all SCSI signals are inverted logic
 void hostadapterWriteDataPhaseFlags(bool message, bool commandNotData, bool inputNotOutput)
 {
-	if (message) TM_GPIO_SetPinLow(SCSI_MSG_GPIO_Port, SCSI_MSG_Pin); // SCSI_MSG_GPIO_Port->IDR &= ~STATUS_NMSG;  // MSG = active
-	else TM_GPIO_SetPinHigh(SCSI_MSG_GPIO_Port, SCSI_MSG_Pin);   // MSG = inactive
+	uint8_t phase = (message << 2) | (commandNotData << 1) | inputNotOutput;
 	
-	if(commandNotData) TM_GPIO_SetPinLow(SCSI_C_D_GPIO_Port, SCSI_C_D_Pin);   // SCSI_C_D_GPIO_Port->IDR &= ~STATUS_CND;  //  CD = active
-	else TM_GPIO_SetPinHigh(SCSI_C_D_GPIO_Port, SCSI_C_D_Pin);   //  CD = inactive
+	// Nothing to do if the bus is already in the phase
+	if (phase == currentPhase) return;
 	
-	if(inputNotOutput)
+	if (inputNotOutput)
 	{
-		//SCSI_I_O_GPIO_Port->ODR &= ~STATUS_INO;  //  IO = active
-		TM_GPIO_SetPinLow(SCSI_I_O_GPIO_Port, SCSI_I_O_Pin); 
-		hostadapterDatabusOutput();
+		// Assert I/O before driving the databus
+		SCSI_MSG_GPIO_Port->BSRR = phaseSignals[phase];
+		DATABUS_PORT->MODER = (DATABUS_PORT->MODER & ~DATABUS_MODER_MASK) | DATABUS_MODER_OUTPUT;
 	}
 	else
 	{
-		//SCSI_I_O_GPIO_Port->ODR |= STATUS_INO;   //  IO = inactive
-		TM_GPIO_SetPinHigh(SCSI_I_O_GPIO_Port, SCSI_I_O_Pin); 
-		hostadapterDatabusInput();
+		// Release the databus before releasing I/O
+		DATABUS_PORT->MODER &= ~DATABUS_MODER_MASK;
+		SCSI_MSG_GPIO_Port->BSRR = phaseSignals[phase];
 	}
-
+	
+	currentPhase = phase;
 }
 
 
@@ -323,18 +502,15 @@ void hostadapterWriteDataPhaseFlags(bool message, bool commandNotData, bool inpu
 // Note: all SCSI signals are inverted logic
 void hostadapterWriteBusyFlag(bool flagState)
 {
-//	if (flagState) TM_GPIO_SetPinHigh(SCSI_BSY_GPIO_Port, SCSI_BSY_Pin); // SCSI_BSY_GPIO_Port->IDR &= ~STATUS_NBSY;  // BSY = inactive
-//	else TM_GPIO_SetPinLow(SCSI_BSY_GPIO_Port, SCSI_BSY_Pin); //SCSI_BSY_GPIO_Port->ODR |= STATUS_NBSY;   // BSY = active
-	if(flagState) TM_GPIO_SetPinLow(SCSI_BSY_GPIO_Port, SCSI_BSY_Pin);  // SCSI_BSY_GPIO_Port->IDR &= ~STATUS_NBSY;  // BSY = inactive
-   else TM_GPIO_SetPinHigh(SCSI_BSY_GPIO_Port, SCSI_BSY_Pin); //SCSI_BSY_GPIO_Port->ODR |= STATUS_NBSY;   // BSY = acti
+//	if (flagState) signalBsyRelease(); // SCSI_BSY_GPIO_Port->IDR &= ~STATUS_NBSY;  // BSY = inactive
+//	else signalBsyAssert(); //SCSI_BSY_GPIO_Port->ODR |= STATUS_NBSY;   // BSY = active
+	if(flagState) signalBsyAssert();  // SCSI_BSY_GPIO_Port->IDR &= ~STATUS_NBSY;  // BSY = inactive
+   else signalBsyRelease(); //SCSI_BSY_GPIO_Port->ODR |= STATUS_NBSY;   // BSY = acti
 }
 
 bool hostadapterReadBusyFlag(void)
 {
-	if (TM_GPIO_GetInputPinValue(SCSI_BSY_GPIO_Port, SCSI_BSY_Pin) != 0) return false;
-	
-	return true;
-	
+	return signalBsyAsserted();
 }
 
 
@@ -342,10 +518,10 @@ bool hostadapterReadBusyFlag(void)
 // Note: all SCSI signals are inverted logic
 void hostadapterWriteRequestFlag(bool flagState)
 {
-	//if (flagState) TM_GPIO_SetPinHigh(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);  // SCSI_REQ_GPIO_Port->IDR &= ~STATUS_NREQ;  // REQ = inactive
-	//else TM_GPIO_SetPinLow(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);  //SCSI_REQ_GPIO_Port->ODR |= STATUS_NREQ;   // REQ = active
-	if(flagState) TM_GPIO_SetPinLow(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);   // SCSI_REQ_GPIO_Port->IDR &= ~STATUS_NREQ;  // REQ = inactive
-	else TM_GPIO_SetPinHigh(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);   //SCSI_REQ_GPIO_Port->ODR |= STATUS_NREQ;   // REQ = active
+	//if (flagState) signalReqRelease();  // SCSI_REQ_GPIO_Port->IDR &= ~STATUS_NREQ;  // REQ = inactive
+	//else signalReqAssert();  //SCSI_REQ_GPIO_Port->ODR |= STATUS_NREQ;   // REQ = active
+	if(flagState) signalReqAssert();   // SCSI_REQ_GPIO_Port->IDR &= ~STATUS_NREQ;  // REQ = inactive
+	else signalReqRelease();   //SCSI_REQ_GPIO_Port->ODR |= STATUS_NREQ;   // REQ = active
 }
 
 // Function to read the state of the host select flag
@@ -354,7 +530,123 @@ bool hostadapterReadSelectFlag(void)
 {
 	//if ((SCSI_SEL_GPIO_Port->IDR & NSEL) != 0) return false;
 	
-	if(TM_GPIO_GetInputPinValue(SCSI_SEL_GPIO_Port, SCSI_SEL_Pin) != 0) return false;
+	return signalSelAsserted();
+}
+
+// Set the target ID answered by the selection interrupt
+void hostadapterSetSelectionId(uint8_t targetId)
+{
+	selectionId = targetId;
+}
+
+// Returns true if the selection interrupt has selected us (BSY is already asserted)
+bool hostadapterReadSelectionFlag(void)
+{
+	return selectionFlag;
+}
+
+// Returns the ID mask latched with the selection and clears the selection (0 if there
+// is no selection)
+uint8_t hostadapterReadSelectionMask(void)
+{
+	uint8_t mask;
+	
+	if (!selectionFlag) return 0;
+	mask = selectionMask;
+	selectionFlag = false;
+	
+	return mask;
+}
+
+// Function to read the state of the host attention flag
+// Note: all SCSI signals are inverted logic
+bool hostadapterReadAttentionFlag(void)
+{
+	return signalAtnAsserted();
+}
+
+// Function to write the select flag (only driven by the target during reselection)
+// Note: all SCSI signals are inverted logic
+void hostadapterWriteSelectFlag(bool flagState)
+{
+	if(flagState)
+	{
+		TM_GPIO_Init(SCSI_SEL_GPIO_Port, SCSI_SEL_Pin, TM_GPIO_Mode_OUT, TM_GPIO_OType_OD, TM_GPIO_PuPd_NOPULL, TM_GPIO_Speed_High);
+		signalSelAssert();  // SEL = active
+	}
+	else
+	{
+		signalSelRelease();  // SEL = inactive
+		TM_GPIO_Init(SCSI_SEL_GPIO_Port, SCSI_SEL_Pin, TM_GPIO_Mode_IN, TM_GPIO_OType_OD, TM_GPIO_PuPd_NOPULL, TM_GPIO_Speed_High);
+	}
+}
+
+// Function to arbitrate for the bus and reselect an initiator (after a disconnect)
+// Returns false if the bus could not be won or the initiator did not respond within
+// the selection timeout (or the host signalled reset)
+bool hostadapterReselect(uint8_t targetId, uint8_t initiatorId)
+{
+	uint32_t timerBegin = HAL_GetTick();
+	
+	// Arbitration phase
+	while(1)
+	{
+		// Wait for bus free (BSY and SEL inactive)
+		while(hostadapterReadBusyFlag() || hostadapterReadSelectFlag())
+		{
+			if(nrstFlag || (HAL_GetTick() - timerBegin) >= 250) return false;
+			
+			// Being selected by an initiator?  Give up so the selection can be answered
+			if(selectionFlag) return false;
+		}
+		
+		// Assert BSY and our ID then wait for the arbitration delay (2.4uS)
+		hostadapterWriteBusyFlag(true);
+		hostadapterDatabusOutput();
+		hostadapterWritedatabus(1 << targetId);
+		Delay(3);
+		
+		// Selected just before arbitration?  BSY now belongs to the selection.
+		if(selectionFlag)
+		{
+			hostadapterDatabusInput();
+			return false;
+		}
+		
+		// Won the arbitration? (no higher ID on the databus)
+		if((hostadapterReadDatabus() & (uint8_t)(0xFF << (targetId + 1))) == 0) break;
+		
+		// Lost - release the bus and try again
+		hostadapterDatabusInput();
+		hostadapterWriteBusyFlag(false);
+		if(nrstFlag || (HAL_GetTick() - timerBegin) >= 250) return false;
+	}
+	
+	// Reselection phase: assert SEL, then I/O and both IDs, then release BSY
+	hostadapterWriteSelectFlag(true);
+	Delay(2);  // Bus clear and bus settle delay (1.2uS)
+	signalIoAssert();
+	hostadapterWritedatabus((1 << targetId) | (1 << initiatorId));
+	Delay(1);
+	hostadapterWriteBusyFlag(false);
+	
+	// Wait for the initiator to respond with BSY (selection timeout is 250mS)
+	timerBegin = HAL_GetTick();
+	while(!hostadapterReadBusyFlag())
+	{
+		if(nrstFlag || (HAL_GetTick() - timerBegin) >= 250)
+		{
+			// No response - release the bus
+			hostadapterWriteSelectFlag(false);
+			signalIoRelease();
+			hostadapterDatabusInput();
+			return false;
+		}
+	}
+	
+	// Take over BSY from the initiator and release SEL
+	hostadapterWriteBusyFlag(true);
+	hostadapterWriteSelectFlag(false);
 	
 	return true;
 }
@@ -366,84 +658,456 @@ bool hostadapterConnectedToExternalBus(void)
 	return true;  // External bus
 }
 
-// Host DMA transfer functions ----------------------------------------------------------
+// Host data transfer functions --------------------------------------------------------
+
+// Transfers shorter than this are moved by the CPU (the DMA engine set up costs more
+// than the handshakes); longer transfers are split into DMA blocks of up to 512 bytes
+#define TRANSFER_DMA_MINIMUM	64
+#define TRANSFER_DMA_BLOCK		sizeof(dmaBuffer)
+
+// Handshake one byte to the host (data in), waiting for ACK to be released so that the
+// next REQ is not mistaken as acknowledged
+#define TRANSFER_IN_BYTE(value) \
+	DATABUS_PORT->ODR = ~(value); signalReqAssert(); signalAckWait(); signalReqRelease(); signalAckReleaseWait()
+
+// Handshake one byte from the host (data out)
+#define TRANSFER_OUT_BYTE(destination) \
+	signalReqAssert(); signalAckWait(); (destination) = ~DATABUS_PORT->IDR; signalReqRelease(); signalAckReleaseWait()
 
-// Host reads data from SCSI device using DMA transfer (reads a 256 byte block)
-// Returns number of bytes transferred (for debug in case of DMA failure)
-uint16_t hostadapterPerformReadDMA(uint8_t *dataBuffer)
+// Send bytes to the host with the CPU (4 handshakes per loop)
+static uint16_t hostadapterTransferInBytes(const uint8_t *dataBuffer, uint16_t length)
 {
 	uint16_t currentByte = 0;
-	uint32_t timeoutCounter = 0;
+	
+	while (length - currentByte >= 4 && !nrstFlag)
+	{
+		TRANSFER_IN_BYTE(dataBuffer[currentByte]);
+		TRANSFER_IN_BYTE(dataBuffer[currentByte + 1]);
+		TRANSFER_IN_BYTE(dataBuffer[currentByte + 2]);
+		TRANSFER_IN_BYTE(dataBuffer[currentByte + 3]);
+		currentByte += 4;
+	}
+	
+	while (currentByte < length && !nrstFlag)
+	{
+		TRANSFER_IN_BYTE(dataBuffer[currentByte]);
+		currentByte++;
+	}
+	
+	return currentByte;
+}
 
-	// Loop to write bytes (unless a reset condition is detected)
-	while(currentByte < 256 && timeoutCounter != TOC_MAX)
+// Receive bytes from the host with the CPU (4 handshakes per loop)
+static uint16_t hostadapterTransferOutBytes(uint8_t *dataBuffer, uint16_t length)
+{
+	uint16_t currentByte = 0;
+	
+	while (length - currentByte >= 4 && !nrstFlag)
+	{
+		TRANSFER_OUT_BYTE(dataBuffer[currentByte]);
+		TRANSFER_OUT_BYTE(dataBuffer[currentByte + 1]);
+		TRANSFER_OUT_BYTE(dataBuffer[currentByte + 2]);
+		TRANSFER_OUT_BYTE(dataBuffer[currentByte + 3]);
+		currentByte += 4;
+	}
+	
+	while (currentByte < length && !nrstFlag)
 	{
-		// Write the current byte to the databus and point to the next byte
-		DATABUS_PORT->ODR = ~dataBuffer[currentByte++];
+		TRANSFER_OUT_BYTE(dataBuffer[currentByte]);
+		currentByte++;
+	}
+	
+	return currentByte;
+}
 
-		// Set the REQuest signal
-		//STATUS_NREQ_PORT &= ~STATUS_NREQ;  // REQ = 0 (active)
-		//SCSI_REQ_GPIO_Port->ODR &= ~STATUS_NREQ;   // REQ = 0 (active)
-		TM_GPIO_SetPinLow(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);
-		
-		// Wait for ACKnowledge
-		timeoutCounter = 0;  // Reset timeout counter
+// Send data to the host (data in phase, any length)
+// Returns the number of bytes transferred (less than the length if the host reset)
+uint16_t hostadapterTransferIn(const uint8_t *dataBuffer, uint16_t length)
+{
+	uint16_t currentByte = 0;
+	uint16_t blockLength;
+	uint16_t transferred;
+	
+	TRACE(TRACE_HOST_TRANSFER_IN, length, syncOffset, 0);
+	
+	while (currentByte < length && !nrstFlag)
+	{
+		blockLength = length - currentByte;
+		if (blockLength > TRANSFER_DMA_BLOCK) blockLength = TRANSFER_DMA_BLOCK;
 		
-		//while((SCSI_ACK_GPIO_Port->IDR & NACK) != 0)
-		while(TM_GPIO_GetInputPinValue(SCSI_ACK_GPIO_Port, SCSI_ACK_Pin) != 0)
+		// Use the synchronous transfer engine if the initiator negotiated it, otherwise
+		// short replies (and short tails) are handshaked by the CPU
+		if (syncOffset != 0) transferred = hostadapterSyncSend(dataBuffer + currentByte, blockLength);
+		else if (blockLength < TRANSFER_DMA_MINIMUM) transferred = hostadapterTransferInBytes(dataBuffer + currentByte, blockLength);
+		else
 		{
-			if (++timeoutCounter == TOC_MAX)
-			{
-				// Set the host reset flag and quit
-				nrstFlag = true;
-				return currentByte - 1;
-			}
+			hostadapterStartReadDMA(dataBuffer + currentByte, blockLength);
+			transferred = hostadapterFinishDMA();
 		}
 		
-		// Clear the REQuest signal
-		//STATUS_NREQ_PORT |= STATUS_NREQ;  // REQ = 1 (inactive)
-		//SCSI_REQ_GPIO_Port->ODR |= STATUS_NREQ;   // REQ = 1 (inactive)
-		TM_GPIO_SetPinHigh(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);
+		currentByte += transferred;
+		if (transferred != blockLength) break;
 	}
 	
-	return currentByte - 1;
+	TRACE(TRACE_HOST_TRANSFER_DONE, currentByte, 0, 0);
+	return currentByte;
 }
 
-// Host writes data to SCSI device using DMA transfer (writes a 256 byte block)
-// Returns number of bytes transferred (for debug in case of DMA failure)
-uint16_t hostadapterPerformWriteDMA(uint8_t *dataBuffer)
+// Receive data from the host (data out phase, any length)
+// Returns the number of bytes transferred (less than the length if the host reset)
+uint16_t hostadapterTransferOut(uint8_t *dataBuffer, uint16_t length)
 {
 	uint16_t currentByte = 0;
-	uint32_t timeoutCounter = 0;
-
-	// Loop to read bytes (unless a reset condition is detected)
-	while(currentByte < 256 && timeoutCounter != TOC_MAX)
+	uint16_t blockLength;
+	uint16_t transferred;
+	
+	TRACE(TRACE_HOST_TRANSFER_OUT, length, syncOffset, 0);
+	
+	while (currentByte < length && !nrstFlag)
 	{
-		// Set the REQuest signal
-		//SCSI_REQ_GPIO_Port->ODR &= ~STATUS_NREQ;   // REQ = 0 (active)
-		TM_GPIO_SetPinLow(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);
+		blockLength = length - currentByte;
+		if (blockLength > TRANSFER_DMA_BLOCK) blockLength = TRANSFER_DMA_BLOCK;
 		
-		// Wait for ACKnowledge
-		timeoutCounter = 0;  // Reset timeout counter
+		// Data out is always ACK-clocked.  Short blocks are handshaked by the CPU unless
+		// synchronous transfers were negotiated (the CPU can not latch the data within
+		// the synchronous hold time, so every block goes to the DMA engine).
+		if (blockLength < TRANSFER_DMA_MINIMUM && syncOffset == 0) transferred = hostadapterTransferOutBytes(dataBuffer + currentByte, blockLength);
+		else
+		{
+			hostadapterStartWriteDMA(dataBuffer + currentByte, blockLength);
+			transferred = hostadapterFinishDMA();
+		}
 		
-		//while((SCSI_ACK_GPIO_Port->IDR & NACK) != 0)
-		while(TM_GPIO_GetInputPinValue(SCSI_ACK_GPIO_Port, SCSI_ACK_Pin) != 0)
+		currentByte += transferred;
+		if (transferred != blockLength) break;
+	}
+	
+	TRACE(TRACE_HOST_TRANSFER_DONE, currentByte, 0, 0);
+	return currentByte;
+}
+
+// Block transfer engine functions -----------------------------------------------------
+
+// Set up the timers, DMA streams and pins used by the block transfer engines
+static void hostadapterDmaInitialise(void)
+{
+	RCC->APB2ENR |= RCC_APB2ENR_TIM1EN;
+	RCC->APB1ENR |= RCC_APB1ENR_TIM3EN;
+	RCC->AHB1ENR |= RCC_AHB1ENR_DMA2EN;
+	
+	// ACK (PC7) is the TIM3 channel 2 input.  The pin is still read through the IDR by
+	// the byte handshakes.
+	TM_GPIO_InitAlternate(SCSI_ACK_GPIO_Port, SCSI_ACK_Pin, TM_GPIO_OType_OD, TM_GPIO_PuPd_NOPULL, TM_GPIO_Speed_High, GPIO_AF2_TIM3);
+	TIM3->CR1 = 0;
+	TIM3->CCMR1 = TIM_CCMR1_CC2S_0 | TIM_CCMR1_IC2F_0;	// CC2 is input, mapped to TI2 (filtered over 2 clocks)
+	TIM3->CR2 = 0;										// TRGO is the counter reset (one pulse per ACK edge)
+	TIM3->ARR = 0xFFFF;
+	TIM3->CR1 = TIM_CR1_CEN;
+	
+	TIM1->CR1 = 0;
+	TIM1->PSC = 0;
+	
+	hostadapterSetSyncTransfer(0, 0);
+}
+
+// Set the synchronous transfer agreement for the connected initiator
+// (offset 0 selects asynchronous transfers)
+void hostadapterSetSyncTransfer(uint8_t period, uint8_t offset)
+{
+	syncPeriod = period;
+	syncOffset = offset;
+	
+	// Timer ticks per REQ period (the period is in units of 4nS)
+	// (rounded up so the REQ period is never shorter than the agreed one)
+	syncPeriodTicks = ((uint64_t)period * 4 * syncTimerClock + 999999999) / 1000000000;
+}
+
+// Configure a DMA2 stream for a TIM1 request between memory and a GPIO register
+static void hostadapterDmaStream(DMA_Stream_TypeDef *stream, volatile uint32_t *gpioRegister, const void *memory, uint16_t length, uint32_t mode)
+{
+	stream->CR = 0;
+	while (stream->CR & DMA_SxCR_EN);
+	
+	stream->PAR = (uint32_t)gpioRegister;
+	stream->M0AR = (uint32_t)memory;
+	stream->NDTR = length;
+	stream->FCR = 0;  // Direct mode
+	stream->CR = DMA_TIMER_CHANNEL | mode;
+}
+
+// Stop the timer requests and the DMA streams and release REQ
+static void hostadapterDmaStop(void)
+{
+	TIM1->CR1 &= ~TIM_CR1_CEN;
+	TIM1->DIER = 0;
+	DMA2_Stream1->CR = 0;
+	DMA2_Stream2->CR = 0;
+	DMA2_Stream5->CR = 0;
+	signalReqRelease();
+	
+	// Clear the stream flags
+	DMA2->LIFCR = 0x0F7D0F7D;
+	DMA2->HIFCR = 0x0F7D0F7D;
+}
+
+// Start an asynchronous block transfer (the first REQ is asserted by the caller)
+static void hostadapterDmaStart(volatile uint32_t *dataRegister, void *memory, uint32_t dataMode)
+{
+	// Every ACK edge (both edges of TI2FP2) resets TIM3, pulsing its trigger output
+	TIM3->CCER = TIM_CCER_CC2P | TIM_CCER_CC2NP;
+	TIM3->SMCR = TIM_SMCR_TS_2 | TIM_SMCR_TS_1 | TIM_SMCR_SMS_2;
+	
+	// TIM1 counts the ACK edges from ITR2: 1 on ACK asserted (CC1, CC2), 0 on ACK released (update)
+	TIM1->CR1 = 0;
+	TIM1->SMCR = TIM_SMCR_TS_1 | TIM_SMCR_SMS_2 | TIM_SMCR_SMS_1 | TIM_SMCR_SMS_0;
+	TIM1->ARR = 1;
+	TIM1->CCR1 = 1;
+	TIM1->CCR2 = 1;
+	TIM1->RCR = 0;
+	TIM1->EGR = TIM_EGR_UG;  // Clear the counter and the repetition counter left by a synchronous burst
+	TIM1->SR = 0;
+	
+	// The data stream has priority over the REQ release on the ACK asserted edge
+	// (data in starts with the second byte, the first is placed on the bus by the caller)
+	hostadapterDmaStream(DMA2_Stream1, dataRegister, memory, dmaDataBuffer != NULL ? dmaLength : dmaLength - 1, DMA_SxCR_MINC | DMA_SxCR_PL | dataMode);
+	if (DMA2_Stream1->NDTR != 0) DMA2_Stream1->CR |= DMA_SxCR_EN;
+	hostadapterDmaStream(DMA2_Stream2, &SCSI_REQ_GPIO_Port->BSRR, &dmaRequestRelease, 1, DMA_SxCR_CIRC | DMA_SxCR_DIR_0 | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1);
+	hostadapterDmaStream(DMA2_Stream5, &SCSI_REQ_GPIO_Port->BSRR, &dmaRequestAssert, dmaLength - 1, DMA_SxCR_DIR_0 | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1);
+	DMA2_Stream2->CR |= DMA_SxCR_EN;
+	if (dmaLength > 1) DMA2_Stream5->CR |= DMA_SxCR_EN;
+	
+	TIM1->DIER = TIM_DIER_CC1DE | TIM_DIER_CC2DE | TIM_DIER_UDE;
+	TIM1->CR1 = TIM_CR1_CEN;
+}
+
+// Start sending a block to the host (data in) using the ACK-clocked DMA engine
+// The block is sent while the caller continues; call hostadapterFinishDMA() before the
+// next bus phase
+void hostadapterStartReadDMA(const uint8_t *dataBuffer, uint16_t length)
+{
+	uint16_t currentByte;
+	
+	// The databus is inverted logic
+	for (currentByte = 0; currentByte < length; currentByte++) dmaBuffer[currentByte] = ~dataBuffer[currentByte];
+	
+	dmaDataBuffer = NULL;
+	dmaLength = length;
+	hostadapterDmaStart((volatile uint32_t *)&DATABUS_PORT->ODR, &dmaBuffer[1], DMA_SxCR_DIR_0);
+	
+	// Place the first byte on the bus and request the transfer
+	DATABUS_PORT->ODR = dmaBuffer[0];
+	signalReqAssert();
+}
+
+// Start receiving a block from the host (data out) using the ACK-clocked DMA engine
+// The block is only valid after hostadapterFinishDMA() returns
+void hostadapterStartWriteDMA(uint8_t *dataBuffer, uint16_t length)
+{
+	dmaDataBuffer = dataBuffer;
+	dmaLength = length;
+	hostadapterDmaStart((volatile uint32_t *)&DATABUS_PORT->IDR, dataBuffer, 0);
+	
+	// Request the first byte
+	signalReqAssert();
+}
+
+// Returns true while an asynchronous DMA block transfer is in progress
+// Note: The block is complete when the last REQ has been asserted, released by the
+// last ACK and the host has released ACK
+bool hostadapterDMABusy(void)
+{
+	if (DMA2_Stream5->NDTR != 0) return true;
+	if (!(SCSI_REQ_GPIO_Port->ODR & SCSI_REQ_Pin)) return true;
+	return signalAckAsserted();
+}
+
+// Wait for the asynchronous DMA block transfer to finish
+// Returns the number of bytes transferred
+uint16_t hostadapterFinishDMA(void)
+{
+	uint16_t lastRemaining = 0xFFFF;
+	uint16_t remaining;
+	uint16_t transferred;
+	uint32_t timeoutCounter = 0;
+	
+	while (hostadapterDMABusy())
+	{
+		// The timeout restarts whenever the host acknowledges another byte
+		remaining = DMA2_Stream5->NDTR;
+		if (remaining != lastRemaining)
 		{
-			if (++timeoutCounter == TOC_MAX)
-			{
-				// Set the host reset flag and quit
-				nrstFlag = true;
-				return currentByte;
-			}
+			lastRemaining = remaining;
+			timeoutCounter = 0;
 		}
 		
-		// Read the current byte from the databus and point to the next byte
-		dataBuffer[currentByte++] = ~DATABUS_PORT->IDR;
+		if (++timeoutCounter == TOC_MAX || nrstFlag)
+		{
+			// Set the host reset flag and quit
+			nrstFlag = true;
+			break;
+		}
+	}
+	
+	hostadapterDmaStop();
+	transferred = dmaLength - DMA2_Stream1->NDTR - (dmaDataBuffer != NULL ? 0 : 1);
+	if (nrstFlag) return transferred;
+	
+	// Data out bytes were captured from the (inverted logic) databus
+	if (dmaDataBuffer != NULL)
+	{
+		for (transferred = 0; transferred < dmaLength; transferred++) dmaDataBuffer[transferred] = ~dmaDataBuffer[transferred];
+	}
+	
+	return dmaLength;
+}
+
+// Set the timers for a burst of synchronous REQ pulses
+static void hostadapterSyncStart(void)
+{
+	// ACK edges clock TIM3 on the falling (asserting) edge
+	TIM3->SMCR = 0;
+	TIM3->CCER = TIM_CCER_CC2P;
+	TIM3->SMCR = TIM_SMCR_TS_2 | TIM_SMCR_TS_1 |			// Trigger is TI2FP2...
+		TIM_SMCR_SMS_2 | TIM_SMCR_SMS_1 | TIM_SMCR_SMS_0;	// ...clocking the counter (external clock mode 1)
+	
+	// TIM1 runs from the internal clock in one-pulse mode, updating only on overflow so
+	// the repetition counter can be loaded without a spurious DMA request.  Data is placed
+	// on the bus at the start of the period, REQ is asserted half way through and
+	// released at the end (giving the setup and hold times).
+	TIM1->CR1 = TIM_CR1_OPM | TIM_CR1_URS;
+	TIM1->SMCR = 0;
+	TIM1->ARR = syncPeriodTicks - 1;
+	TIM1->CCR1 = 1;
+	TIM1->CCR2 = syncPeriodTicks / 2;
+}
+
+// Start a burst of REQ pulses
+static void hostadapterSyncBurst(uint16_t pulses)
+{
+	TIM1->RCR = pulses - 1;
+	TIM1->EGR = TIM_EGR_UG;  // Load the repetition counter
+	TIM1->CR1 |= TIM_CR1_CEN;
+}
+
+// Send a block to the host using synchronous transfers
+// Returns the number of bytes transferred
+static uint16_t hostadapterSyncSend(const uint8_t *dataBuffer, uint16_t length)
+{
+	uint16_t ackBase;
+	uint16_t acknowledged = 0;
+	uint16_t sent = 0;
+	uint16_t burst;
+	uint32_t timeoutCounter = 0;
+	uint16_t currentByte;
+	
+	// The databus is inverted logic
+	for (currentByte = 0; currentByte < length; currentByte++) dmaBuffer[currentByte] = ~dataBuffer[currentByte];
+	
+	hostadapterSyncStart();
+	ackBase = TIM3->CNT;
+	hostadapterDmaStream(DMA2_Stream1, (volatile uint32_t *)&DATABUS_PORT->ODR, dmaBuffer, length, DMA_SxCR_MINC | DMA_SxCR_DIR_0);
+	hostadapterDmaStream(DMA2_Stream2, &SCSI_REQ_GPIO_Port->BSRR, &dmaRequestAssert, 1, DMA_SxCR_CIRC | DMA_SxCR_DIR_0 | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1);
+	hostadapterDmaStream(DMA2_Stream5, &SCSI_REQ_GPIO_Port->BSRR, &dmaRequestRelease, 1, DMA_SxCR_CIRC | DMA_SxCR_DIR_0 | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1);
+	DMA2_Stream1->CR |= DMA_SxCR_EN;
+	DMA2_Stream2->CR |= DMA_SxCR_EN;
+	DMA2_Stream5->CR |= DMA_SxCR_EN;
+	TIM1->DIER = TIM_DIER_CC1DE | TIM_DIER_CC2DE | TIM_DIER_UDE;
+	
+	while (acknowledged < length)
+	{
+		acknowledged = (uint16_t)(TIM3->CNT - ackBase);
 		
-		// Clear the REQuest signal
-		//SCSI_REQ_GPIO_Port->ODR |= STATUS_NREQ;   // REQ = 1 (inactive)
-		TM_GPIO_SetPinHigh(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);
+		// Send the next burst when the previous one is complete, keeping the number of
+		// unacknowledged REQs within the offset
+		if (!(TIM1->CR1 & TIM_CR1_CEN) && sent < length && sent - acknowledged < syncOffset)
+		{
+			burst = syncOffset - (sent - acknowledged);
+			if (burst > length - sent) burst = length - sent;
+			hostadapterSyncBurst(burst);
+			sent += burst;
+			timeoutCounter = 0;
+		}
+		
+		if (++timeoutCounter == TOC_MAX || nrstFlag)
+		{
+			// Set the host reset flag and quit
+			nrstFlag = true;
+			break;
+		}
 	}
 	
-	return currentByte - 1;
+	// Wait for the last REQ pulse to finish before the streams are stopped (the last
+	// ACK can arrive before the burst has released REQ)
+	while ((TIM1->CR1 & TIM_CR1_CEN) && !nrstFlag);
+	
+	hostadapterDmaStop();
+	return acknowledged;
+}
+
+#ifdef HOSTADAPTER_BENCHMARK
+// Handshake benchmark --------------------------------------------------------------------
+//
+// Measures the CPU side of the REQ/ACK handshake with the DWT cycle counter.  ACK is
+// held asserted by driving PC7 low so that every wait completes at once; the bus must
+// be disconnected while the benchmark runs.
+
+#define BENCHMARK_BYTES		512
+
+// Previous handshake (TM GPIO macros with the pins normalised to 0/1), kept for comparison
+static void __attribute__((noinline)) hostadapterBenchmarkLegacyByte(uint8_t databusValue)
+{
+	DATABUS_PORT->ODR = ~databusValue;
+	TM_GPIO_SetPinLow(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);
+	while((TM_GPIO_GetInputPinValue(SCSI_ACK_GPIO_Port, SCSI_ACK_Pin) != 0) && nrstFlag == false);
+	TM_GPIO_SetPinHigh(SCSI_REQ_GPIO_Port, SCSI_REQ_Pin);
+}
+
+// Show the cycles per byte and the resulting transfer rate
+static void hostadapterBenchmarkReport(const char *name, uint32_t cycles)
+{
+	debugString_P((char *)name);
+	debugStringInt32_P(PSTR(" cycles/byte (x100) = "), cycles * 100 / BENCHMARK_BYTES, false);
+	debugStringInt32_P(PSTR(", bytes/s = "), (uint32_t)((uint64_t)SystemCoreClock * BENCHMARK_BYTES / cycles), true);
+}
+
+// Run the handshake benchmark (called once at start-up)
+void hostadapterBenchmarkHandshake(void)
+{
+	uint32_t moder = SCSI_ACK_GPIO_Port->MODER;
+	uint32_t startCycles;
+	uint16_t currentByte;
+	
+	// Hold ACK asserted (open-drain output low)
+	SCSI_ACK_GPIO_Port->BSRR = (uint32_t)SCSI_ACK_Pin << 16;
+	SCSI_ACK_GPIO_Port->MODER = (moder & ~(3UL << (7 * 2))) | (1UL << (7 * 2));
+	hostadapterDatabusOutput();
+	
+	startCycles = DWT->CYCCNT;
+	for (currentByte = 0; currentByte < BENCHMARK_BYTES; currentByte++) hostadapterBenchmarkLegacyByte(dmaBuffer[currentByte]);
+	hostadapterBenchmarkReport(PSTR("Handshake: legacy TM GPIO byte"), DWT->CYCCNT - startCycles);
+	
+	startCycles = DWT->CYCCNT;
+	for (currentByte = 0; currentByte < BENCHMARK_BYTES; currentByte++) hostadapterWriteByte(dmaBuffer[currentByte]);
+	hostadapterBenchmarkReport(PSTR("Handshake: hostadapterWriteByte"), DWT->CYCCNT - startCycles);
+	
+	startCycles = DWT->CYCCNT;
+	for (currentByte = 0; currentByte < BENCHMARK_BYTES; currentByte++) dmaBuffer[currentByte] = hostadapterReadByte();
+	hostadapterBenchmarkReport(PSTR("Handshake: hostadapterReadByte"), DWT->CYCCNT - startCycles);
+	
+	// Inlined handshake primitives
+	startCycles = DWT->CYCCNT;
+	for (currentByte = 0; currentByte < BENCHMARK_BYTES; currentByte++)
+	{
+		DATABUS_PORT->ODR = ~dmaBuffer[currentByte];
+		signalReqAssert();
+		signalAckWait();
+		signalReqRelease();
+	}
+	hostadapterBenchmarkReport(PSTR("Handshake: inlined primitives"), DWT->CYCCNT - startCycles);
+	
+	// Release ACK and the databus
+	SCSI_ACK_GPIO_Port->MODER = moder;
+	SCSI_ACK_GPIO_Port->BSRR = SCSI_ACK_Pin;
+	hostadapterDatabusInput();
 }
+#endif
@@ -126,6 +126,12 @@
 
 #define DATABUS_PORT			GPIOB
 
+// Synchronous transfer limits offered in SDTR negotiation
+// The period is in SDTR units of 4nS (50 = 200nS, 5 Mbytes/sec) and the offset is the
+// maximum number of REQ pulses sent ahead of the initiator's ACKs
+#define SYNC_MIN_PERIOD			50
+#define SYNC_MAX_OFFSET			8
+
 
 // Function prototypes
 void hostadapterInitialise(void);
@@ -140,8 +146,16 @@ void hostadapterDatabusOutput(void);
 uint8_t hostadapterReadByte(void);
 void hostadapterWriteByte(uint8_t databusValue);
 
-uint16_t hostadapterPerformReadDMA(uint8_t *dataBuffer);
-uint16_t hostadapterPerformWriteDMA(uint8_t *dataBuffer);
+uint16_t hostadapterTransferIn(const uint8_t *dataBuffer, uint16_t length);
+uint16_t hostadapterTransferOut(uint8_t *dataBuffer, uint16_t length);
+void hostadapterStartReadDMA(const uint8_t *dataBuffer, uint16_t length);
+void hostadapterStartWriteDMA(uint8_t *dataBuffer, uint16_t length);
+bool hostadapterDMABusy(void);
+uint16_t hostadapterFinishDMA(void);
+
+#ifdef HOSTADAPTER_BENCHMARK
+void hostadapterBenchmarkHandshake(void);
+#endif
 
 bool hostadapterConnectedToExternalBus(void);
 
@@ -152,5 +166,13 @@ void hostadapterWriteDataPhaseFlags(bool message, bool commandNotData, bool inpu
 void hostadapterWriteBusyFlag(bool flagState);
 void hostadapterWriteRequestFlag(bool flagState);
 bool hostadapterReadSelectFlag(void);
+void hostadapterSetSelectionId(uint8_t targetId);
+bool hostadapterReadSelectionFlag(void);
+uint8_t hostadapterReadSelectionMask(void);
 bool hostadapterReadBusyFlag(void);
+bool hostadapterReadAttentionFlag(void);
+void hostadapterWriteSelectFlag(bool flagState);
+bool hostadapterReselect(uint8_t targetId, uint8_t initiatorId);
+
+void hostadapterSetSyncTransfer(uint8_t period, uint8_t offset);
 
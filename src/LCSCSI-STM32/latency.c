@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "latency.h"
+
+// Latency histograms (read by the READ LATENCY vendor command)
+static uint32_t latencyHistogram[LATENCY_HISTOGRAMS][LATENCY_BUCKETS];
+
+// Opcode of each opcode histogram slot
+static uint8_t latencyOpcode[LATENCY_OPCODE_SLOTS];
+static uint16_t latencyOpcodeSlots;		// Bit n = slot n in use
+
+// Timestamps of the command on the bus
+static struct latencyStampsStruct latencyCurrent;
+
+// Clear the histograms
+void latencyClear(void)
+{
+	memset(latencyHistogram, 0, sizeof(latencyHistogram));
+	latencyOpcodeSlots = 0;
+}
+
+// Count an interval in a histogram
+void latencyRecord(uint8_t histogram, uint32_t cycles)
+{
+	uint8_t bucket = 0;
+
+	if (cycles != 0) bucket = 31 - __builtin_clz(cycles);
+	latencyHistogram[histogram][bucket]++;
+}
+
+// Stamp the current command (the selection stamp starts a new command)
+void latencyStamp(uint8_t stamp)
+{
+	if (stamp == LATENCY_STAMP_SELECTION) latencyCurrent.valid = 0;
+
+	latencyCurrent.cycles[stamp] = latencyNow();
+	latencyCurrent.valid |= 1 << stamp;
+}
+
+// Stamp the current command unless it has already been stamped (first data phase)
+void latencyStampOnce(uint8_t stamp)
+{
+	if (!(latencyCurrent.valid & (1 << stamp))) latencyStamp(stamp);
+}
+
+// Save the timestamps of a command that is queued
+void latencySaveStamps(struct latencyStampsStruct *stamps)
+{
+	*stamps = latencyCurrent;
+}
+
+// Restore the timestamps of a queued command when it is dispatched
+void latencyRestoreStamps(const struct latencyStampsStruct *stamps)
+{
+	latencyCurrent = *stamps;
+}
+
+// Find (or allocate) the histogram slot of an opcode
+static uint8_t latencyOpcodeSlot(uint8_t opcode)
+{
+	uint8_t slot;
+
+	for (slot = 0; slot < LATENCY_OPCODE_SLOTS; slot++)
+	{
+		if (!(latencyOpcodeSlots & (1 << slot)))
+		{
+			latencyOpcode[slot] = opcode;
+			latencyOpcodeSlots |= 1 << slot;
+			return slot;
+		}
+		if (latencyOpcode[slot] == opcode) return slot;
+	}
+
+	return LATENCY_OPCODE_SLOTS - 1;
+}
+
+// Count the intervals of a command that has reached bus free
+void latencyCommandComplete(uint8_t opcode, uint8_t lunNumber)
+{
+	uint32_t busFree = latencyNow();
+	uint32_t *cycles = latencyCurrent.cycles;
+	uint8_t valid = latencyCurrent.valid;
+	uint32_t dataEnd;
+
+	latencyCurrent.valid = 0;
+	if (!(valid & (1 << LATENCY_STAMP_SELECTION))) return;
+
+	latencyRecord(LATENCY_HISTOGRAM_OPCODE + latencyOpcodeSlot(opcode), busFree - cycles[LATENCY_STAMP_SELECTION]);
+	latencyRecord(LATENCY_HISTOGRAM_LUN + (lunNumber & 0x07), busFree - cycles[LATENCY_STAMP_SELECTION]);
+
+	if (!(valid & (1 << LATENCY_STAMP_COMMAND)) || !(valid & (1 << LATENCY_STAMP_STATUS))) return;
+	latencyRecord(LATENCY_HISTOGRAM_COMMAND, cycles[LATENCY_STAMP_COMMAND] - cycles[LATENCY_STAMP_SELECTION]);
+
+	// Commands without a data phase only count the set up (command to status)
+	if (valid & (1 << LATENCY_STAMP_DATA_FIRST))
+	{
+		dataEnd = (valid & (1 << LATENCY_STAMP_DATA_LAST)) ? cycles[LATENCY_STAMP_DATA_LAST] : cycles[LATENCY_STAMP_STATUS];
+		latencyRecord(LATENCY_HISTOGRAM_SETUP, cycles[LATENCY_STAMP_DATA_FIRST] - cycles[LATENCY_STAMP_COMMAND]);
+		latencyRecord(LATENCY_HISTOGRAM_DATA, dataEnd - cycles[LATENCY_STAMP_DATA_FIRST]);
+		latencyRecord(LATENCY_HISTOGRAM_STATUS, cycles[LATENCY_STAMP_STATUS] - dataEnd);
+	}
+	else latencyRecord(LATENCY_HISTOGRAM_SETUP, cycles[LATENCY_STAMP_STATUS] - cycles[LATENCY_STAMP_COMMAND]);
+}
+
+// Return a byte of the latency report
+static uint8_t latencyReportByte(uint16_t offset)
+{
+	uint32_t value;
+
+	if (offset >= LATENCY_REPORT_HEADER)
+	{
+		offset -= LATENCY_REPORT_HEADER;
+		value = latencyHistogram[offset / (LATENCY_BUCKETS * 4)][(offset / 4) % LATENCY_BUCKETS];
+		return (uint8_t)(value >> (24 - (offset % 4) * 8));
+	}
+
+	if (offset >= 12 && offset < 12 + LATENCY_OPCODE_SLOTS) return latencyOpcode[offset - 12];
+
+	switch (offset)
+	{
+		case 0: return LATENCY_REPORT_FORMAT;
+		case 1: return LATENCY_HISTOGRAMS;
+		case 2: return LATENCY_BUCKETS;
+		case 3: return LATENCY_OPCODE_SLOTS;
+		case 4: return (uint8_t)(SystemCoreClock >> 24);
+		case 5: return (uint8_t)(SystemCoreClock >> 16);
+		case 6: return (uint8_t)(SystemCoreClock >> 8);
+		case 7: return (uint8_t)SystemCoreClock;
+		case 8: return (uint8_t)(latencyOpcodeSlots >> 8);
+		case 9: return (uint8_t)latencyOpcodeSlots;
+	}
+
+	return 0;
+}
+
+// Copy part of the latency report to a buffer
+void latencyReadReport(uint8_t *buffer, uint16_t offset, uint16_t length)
+{
+	uint16_t byteCounter;
+
+	for (byteCounter = 0; byteCounter < length; byteCounter++)
+	{
+		buffer[byteCounter] = (offset + byteCounter < LATENCY_REPORT_LENGTH) ? latencyReportByte(offset + byteCounter) : 0;
+	}
+}
@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "stm32f4xx.h"
+
+#pragma once
+// Command latency histograms
+//
+// Intervals are measured with the DWT cycle counter and counted in log2 buckets:
+// bucket n counts the intervals of 2^n to 2^(n+1)-1 cycles (bucket 0 also counts 0).
+
+#define LATENCY_BUCKETS				32
+#define LATENCY_OPCODE_SLOTS		16		// Opcodes tracked (in order of first use; the last slot is shared once full)
+
+// Histograms
+#define LATENCY_HISTOGRAM_OPCODE	0									// Selection to bus free, per opcode slot
+#define LATENCY_HISTOGRAM_LUN		(LATENCY_HISTOGRAM_OPCODE + LATENCY_OPCODE_SLOTS)	// Selection to bus free, per LUN
+#define LATENCY_HISTOGRAM_COMMAND	(LATENCY_HISTOGRAM_LUN + 8)			// Selection to the end of the command phase
+#define LATENCY_HISTOGRAM_SETUP		(LATENCY_HISTOGRAM_COMMAND + 1)		// End of the command phase to the first data byte (or status)
+#define LATENCY_HISTOGRAM_DATA		(LATENCY_HISTOGRAM_COMMAND + 2)		// First to last data byte
+#define LATENCY_HISTOGRAM_STATUS	(LATENCY_HISTOGRAM_COMMAND + 3)		// Last data byte to status
+#define LATENCY_HISTOGRAM_SD_READ	(LATENCY_HISTOGRAM_COMMAND + 4)		// SD card read (start to completion)
+#define LATENCY_HISTOGRAM_SD_WRITE	(LATENCY_HISTOGRAM_COMMAND + 5)		// SD card write (start to completion)
+#define LATENCY_HISTOGRAM_ACK_WAIT	(LATENCY_HISTOGRAM_COMMAND + 6)		// REQ to ACK for bytes handshaked by the CPU
+#define LATENCY_HISTOGRAMS			(LATENCY_HISTOGRAM_COMMAND + 7)
+
+// Command timestamps (in order on the bus)
+#define LATENCY_STAMP_SELECTION		0
+#define LATENCY_STAMP_COMMAND		1	// End of the command phase
+#define LATENCY_STAMP_DATA_FIRST	2	// First data phase
+#define LATENCY_STAMP_DATA_LAST		3	// End of the last data phase
+#define LATENCY_STAMP_STATUS		4
+#define LATENCY_STAMPS				5
+
+// Report returned by the READ LATENCY vendor command (all values big-endian)
+//   0      Report format (LATENCY_REPORT_FORMAT)
+//   1      Number of histograms
+//   2      Buckets per histogram
+//   3      Opcode slots
+//   4-7    Cycle counter clock (Hz)
+//   8-9    Opcode slots in use (bit n = slot n)
+//   10-11  Reserved
+//   12-27  Opcode of each slot
+//   28-31  Reserved
+//   32-    Histograms (32-bit counts, histogram by histogram)
+#define LATENCY_REPORT_FORMAT		1
+#define LATENCY_REPORT_HEADER		32
+#define LATENCY_REPORT_LENGTH		(LATENCY_REPORT_HEADER + LATENCY_HISTOGRAMS * LATENCY_BUCKETS * 4)
+
+// Timestamps of the command on the bus (a queued command keeps its selection and
+// command phase timestamps while it waits)
+struct latencyStampsStruct
+{
+	uint32_t cycles[LATENCY_STAMPS];
+	uint8_t valid;		// Bit n = cycles[n] has been stamped
+};
+
+// Current cycle count
+static inline uint32_t latencyNow(void)
+{
+	return DWT->CYCCNT;
+}
+
+void latencyClear(void);
+void latencyRecord(uint8_t histogram, uint32_t cycles);
+void latencyStamp(uint8_t stamp);
+void latencyStampOnce(uint8_t stamp);
+void latencySaveStamps(struct latencyStampsStruct *stamps);
+void latencyRestoreStamps(const struct latencyStampsStruct *stamps);
+void latencyCommandComplete(uint8_t opcode, uint8_t lunNumber);
+void latencyReadReport(uint8_t *buffer, uint16_t offset, uint16_t length);
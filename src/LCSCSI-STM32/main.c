@@ -64,13 +64,26 @@ int main(void) {
 	
 	TM_USART_Init(USART2, TM_USART_PinsPack_1, 115200);
 	
+	// Send the debug output by DMA from here on
+	debugInitialise();
+	
 		
 	// Initialise the host adapter interface
 	hostadapterInitialise();
 	
+#ifdef HOSTADAPTER_BENCHMARK
+	// Measure the REQ/ACK handshake (the bus must be disconnected)
+	hostadapterBenchmarkHandshake();
+#endif
+	
 	// Initialise the SD Card and FAT file system functions
 	filesystemInitialise();
 	
+#ifdef FILESYSTEM_BENCHMARK
+	// Measure the card transfer rate for 1, 8 and 64 block runs
+	filesystemBenchmarkCard();
+#endif
+	
 	// Initialise the SCSI emulation
 	scsiInitialise();
 	
@@ -83,6 +96,9 @@ int main(void) {
 		// Process the SCSI emulation
 		scsiProcessEmulation();
 		
+		// Write back the file system write cache once the host stops writing
+		filesystemFlushIdleWriteCache();
+		
 		if (oldValue != (uint8_t)GPIOC->IDR)
 		{
 			debugString("Status\r\n");
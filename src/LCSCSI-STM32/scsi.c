@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "tm_stm32_general.h"
 #include "tm_stm32_delay.h"
@@ -8,6 +9,8 @@
 #include "scsi.h"
 #include "filesystem.h"
 #include "debug.h"
+#include "latency.h"
+#include "trace.h"
 
 
 
@@ -21,8 +24,9 @@ uint8_t targetId = 1;
 bool selFlag;
 
 
-// Global SCSI sector buffer (256 bytes)
-uint8_t scsiSectorBuffer[256];
+// Global SCSI sector buffer (descriptors, defect lists and short replies)
+// Note: READ and WRITE blocks are transferred in place from/to the file system's buffers
+uint8_t scsiSectorBuffer[SECTOR_SIZE];
 
 // REQUEST SENSE command error reporting structure
 struct requestSenseDataStruct
@@ -34,6 +38,42 @@ struct requestSenseDataStruct
 	uint32_t logicalBlockAddress;
 } requestSenseData[8];
 
+// Tagged command queue entry
+struct scsiQueueEntryStruct
+{
+	bool valid;
+	bool started;					// Initiator has been reselected for the command
+	bool suspended;					// Reselection failed part way through (resumed before other commands)
+	bool tagged;					// Untagged commands are only queued when they are suspended
+	uint8_t tagType;				// Queue tag message (SIMPLE, HEAD OF QUEUE or ORDERED)
+	uint8_t tag;
+	uint8_t initiatorId;
+	uint8_t lunNumber;
+	uint32_t sequence;				// Order of arrival
+	
+	uint8_t data[12];				// CDB
+	uint8_t length;
+	
+	uint32_t logicalBlockAddress;	// Block range (SCSI_FLAG_QUEUED commands only)
+	uint32_t numberOfBlocks;
+	uint32_t blocksTransferred;		// Blocks moved before the command was suspended (resumed from here)
+	bool statusPending;				// Suspended before the status phase (only the status is left to send)
+	uint8_t status;
+	
+	struct latencyStampsStruct latency;	// Timestamps of the connection that queued the command
+};
+
+// Per-LUN tagged command queues
+struct scsiQueueEntryStruct scsiQueue[8][SCSI_QUEUE_DEPTH];
+uint8_t scsiQueueCount;				// Number of queued commands (all LUNs)
+uint32_t scsiQueueSequence;			// Arrival counter
+uint32_t scsiQueueNextBlock[8];		// Block following the last dispatched transfer (elevator position)
+uint8_t scsiQueueLastLun;			// LUN of the last dispatched command (LUNs are served round robin)
+
+// Synchronous transfer agreements (per initiator, set by SDTR messages)
+uint8_t scsiSyncPeriod[8];
+uint8_t scsiSyncOffset[8];			// 0 = asynchronous
+
 // Global structure for storing SCSI CDBs
 struct commandDataBlockStruct
 {
@@ -45,6 +85,16 @@ struct commandDataBlockStruct
 	
 	uint8_t targetLUN; // Target lun, set by IDENTIFY message.
 	
+	uint8_t initiatorId;		// Initiator SCSI ID (0xFF if the initiator did not identify itself)
+	bool identified;			// Target LUN was set by an IDENTIFY message
+	bool disconnectPrivilege;	// Initiator allows the target to disconnect
+	bool connected;				// Target is connected to the initiator (holding BSY)
+	
+	bool tagged;				// Command was sent with a queue tag message
+	uint8_t tagType;
+	uint8_t tag;
+	struct scsiQueueEntryStruct *queueEntry;	// Queue entry of a dispatched queued command
+	
 	uint8_t status;
 	uint8_t message;
 } commandDataBlock;
@@ -58,16 +108,18 @@ static uint8_t StandardResponse[] =
 	  // device type modifier
 	0x02,
 	  // Complies with ANSI SCSI-2.
-	0x01,
-	  // Response format is compatible with the old CCS format.
+	0x02,
+	  // Response format is SCSI-2 (needed for the byte 7 capability flags)
 	0x1f,
 	  // standard length.
 	0,
 	0,
 	  // Reserved
-	0x08 // Enable linked commands
+	0x10 | 0x08 | 0x02 // Enable synchronous transfers, linked commands and tagged command queueing
 };
 
+// Vendor (8), product (16) and revision (4) identification following the standard response
+static const char InquiryIdentification[] = "LC-SCSI " "SD Card Disk    " "1.0 ";
 
 static const uint8_t SupportedVitalPages[] =
 {
@@ -77,7 +129,7 @@ static const uint8_t SupportedVitalPages[] =
 	  // Page Code
 	0x00,
 	  // Reserved
-	0x04,
+	0x05,
 	  // Page length
 	0x00,
 	  // Support "Supported vital product data pages"
@@ -85,9 +137,17 @@ static const uint8_t SupportedVitalPages[] =
 	  // Support "Unit serial number page"
 	0x81,
 	  // Support "Implemented operating definition page"
-	0x82 // Support "ASCII Implemented operating definition page"
+	0x82,
+	  // Support "ASCII Implemented operating definition page"
+	0xC0 // Support the vendor "SD card interface" page
 };
 
+// Length of the vendor SD card interface page (0xC0)
+// Byte 4 is the bus width in bits (0 = not reported), byte 5 the bus mode flags
+// (bit 0 = high speed, bit 1 = a faster mode failed the start-up probe) and
+// bytes 6-9 the bus clock in kHz (MSB first).
+#define CARD_INTERFACE_PAGE_LENGTH	10
+
 static const uint8_t UnitSerialNumber[] =
 {
 	0x00,
@@ -157,6 +217,62 @@ static const uint8_t AscImpOperatingDefinition[] =
 // Global for storing the current SCSI emulation state
 uint8_t scsiState;
 
+// Current information transfer phase (to time the data phases)
+static uint8_t scsiTransferPhase = ITPHASE_DATAOUT;
+
+// SCSI command table (indexed by CDB byte 0)
+// Each entry gives the CDB length, data phase direction, preamble flags and the command
+// handler.  Opcodes without a handler are rejected as invalid commands.
+static const struct scsiCommandStruct scsiCommandTable[256] =
+{
+	// Group 0 commands
+	[0x00] = { 6,	SCSI_DIRECTION_NONE,	SCSI_FLAG_STARTED_LUN,		scsiCommandTestUnitReady },
+	[0x01] = { 6,	SCSI_DIRECTION_NONE,	SCSI_FLAG_STARTED_LUN,		scsiCommandRezeroUnit },
+	[0x03] = { 6,	SCSI_DIRECTION_IN,		SCSI_FLAG_NO_MEDIUM,		scsiCommandRequestSense },
+	[0x04] = { 6,	SCSI_DIRECTION_OUT,		0,							scsiCommandFormat },
+	[0x08] = { 6,	SCSI_DIRECTION_IN,		SCSI_FLAG_AUTOSTART_LUN | SCSI_FLAG_QUEUED,	scsiCommandRead6 },
+	[0x0A] = { 6,	SCSI_DIRECTION_OUT,		SCSI_FLAG_AUTOSTART_LUN | SCSI_FLAG_QUEUED,	scsiCommandWrite6 },
+	[0x0B] = { 6,	SCSI_DIRECTION_NONE,	SCSI_FLAG_STARTED_LUN,		scsiCommandSeek },
+	[0x0F] = { 6,	SCSI_DIRECTION_IN,		SCSI_FLAG_STARTED_LUN,		scsiCommandTranslate },
+	[0x12] = { 6,	SCSI_DIRECTION_IN,		SCSI_FLAG_NO_MEDIUM,		scsiCommandInquiry },
+	[0x15] = { 6,	SCSI_DIRECTION_OUT,		0,							scsiCommandModeSelect },
+	[0x1A] = { 6,	SCSI_DIRECTION_IN,		0,							scsiCommandModeSense },
+	[0x1B] = { 6,	SCSI_DIRECTION_NONE,	0,							scsiCommandStartStop },
+	
+	// Group 1 commands
+	[0x25] = { 10,	SCSI_DIRECTION_IN,		SCSI_FLAG_AUTOSTART_LUN,	scsiCommandReadCapacity },
+	[0x28] = { 10,	SCSI_DIRECTION_IN,		SCSI_FLAG_AUTOSTART_LUN | SCSI_FLAG_QUEUED,	scsiCommandRead10 },
+	[0x2A] = { 10,	SCSI_DIRECTION_OUT,		SCSI_FLAG_AUTOSTART_LUN | SCSI_FLAG_QUEUED,	scsiCommandWrite10 },
+	[0x2F] = { 10,	SCSI_DIRECTION_NONE,	SCSI_FLAG_STARTED_LUN,		scsiCommandVerify },
+	[0x35] = { 10,	SCSI_DIRECTION_NONE,	SCSI_FLAG_STARTED_LUN,		scsiCommandSynchronizeCache },
+	
+	// Group 6 LV-DOS commands (SCSI_FLAG_LVDOS)
+	//[0xCA] = { 6,	SCSI_DIRECTION_OUT,		SCSI_FLAG_LVDOS,			scsiWriteFCode },
+	//[0xC8] = { 6,	SCSI_DIRECTION_IN,		SCSI_FLAG_LVDOS,			scsiReadFCode },
+	
+	// Group 6 BeebSCSI commands
+	//[0xD0] = { 6,	SCSI_DIRECTION_IN,		0,							scsiBeebScsiSense },
+	//[0xD1] = { 6,	SCSI_DIRECTION_OUT,		0,							scsiBeebScsiSelect },
+	//[0xD2] = { 6,	SCSI_DIRECTION_OUT,		0,							scsiBeebScsiFatPath },
+	//[0xD3] = { 6,	SCSI_DIRECTION_IN,		0,							scsiBeebScsiFatInfo },
+	//[0xD4] = { 6,	SCSI_DIRECTION_IN,		0,							scsiBeebScsiFatRead },
+	
+	// Group 6 LC-SCSI commands
+	[0xD8] = { 6,	SCSI_DIRECTION_IN,		SCSI_FLAG_NO_MEDIUM,		scsiCommandReadLatency },
+	[0xD9] = { 6,	SCSI_DIRECTION_IN,		SCSI_FLAG_NO_MEDIUM,		scsiCommandReadTrace },
+};
+
+// Function to pack the nexus of the current command for the trace
+// (opcode | LUN << 8 | tag << 16 | tagged << 24)
+static inline uint32_t scsiTraceNexus(void)
+{
+	return (uint32_t)commandDataBlock.data[0] | ((uint32_t)commandDataBlock.targetLUN << 8) |
+		((uint32_t)commandDataBlock.tag << 16) | ((uint32_t)commandDataBlock.tagged << 24);
+}
+
+// CDB length of each command group (used for unsupported commands)
+static const uint8_t scsiGroupLength[8] = { 6, 10, 10, 6, 6, 12, 6, 6 };
+
 // Global for the emulation mode (fixed or removable drive)
 // Note: The fixed mode emulates SCSI-1 compliant hard drives for the Beeb
 // The removable mode emulates the Laser Video Disc Player (LV-DOS) for Domesday
@@ -191,8 +307,13 @@ void scsiInitialise(void)
 		requestSenseData[lunNumber].errorClass = 0x00;
 		requestSenseData[lunNumber].errorCode = 0x00;
 		requestSenseData[lunNumber].logicalBlockAddress = 0x00;
+		
+		scsiQueueClear(lunNumber, 0xFF);
 	}
 	
+	// Answer selections of our target ID
+	hostadapterSetSelectionId(targetId);
+	
 	// Set the initial SCSI emulation state
 	scsiState = SCSI_BUSFREE;
 }
@@ -234,7 +355,14 @@ void scsiReset(void)
 		requestSenseData[lunNumber].errorClass = 0x00;
 		requestSenseData[lunNumber].errorCode = 0x00;
 		requestSenseData[lunNumber].logicalBlockAddress = 0x00;
+		
+		// Queued commands and synchronous transfer agreements are cleared by a reset
+		scsiQueueClear(lunNumber, 0xFF);
+		scsiSyncPeriod[lunNumber] = 0;
+		scsiSyncOffset[lunNumber] = 0;
 	}
+	commandDataBlock.queueEntry = NULL;
+	TRACE(TRACE_SCSI_RESET, 0, 0, 0);
 	
 	// Ensure the SCSI bus phase is BUS FREE
 	scsiState = SCSI_BUSFREE;
@@ -252,18 +380,21 @@ void scsiProcessEmulation(void)
 	case SCSI_BUSFREE :
 		
 		selFlag = 0;
-		if (hostadapterReadSelectFlag()) {
-			scsiState = SCSI_SELECT;
+		if (hostadapterReadSelectionFlag()) {
+			// Selected (the SEL interrupt has already asserted BSY)
+			scsiState = scsiCommandSelect();
 		}
 		else if (hostadapterReadBusyFlag())
 			scsiState = SCSI_BUSBUSY;
+		else if (scsiQueueCount != 0)
+			scsiState = scsiQueueDispatch();
 		else {
 			//scsiState = scsiEmulationBusFree();
 		}
 		
 		break;
 	case SCSI_BUSBUSY:
-		if (hostadapterReadSelectFlag() || selFlag)
+		if (hostadapterReadSelectionFlag())
 		{
 			scsiState = scsiCommandSelect(); 			
 		}
@@ -276,6 +407,10 @@ void scsiProcessEmulation(void)
 		scsiState = scsiCommandSelect();
 		break;
 	
+	case SCSI_MESSAGEOUT:
+		scsiState = scsiEmulationMessageOut();
+		break;
+	
 	case SCSI_COMMAND:
 		scsiState = scsiEmulationCommand();
 		break;
@@ -288,88 +423,6 @@ void scsiProcessEmulation(void)
 		scsiState = scsiEmulationMessage();
 		break;
 
-		// Handle SCSI commands:
-		case SCSI_TESTUNITREADY :
-		scsiState = scsiCommandTestUnitReady();
-		break;
-		
-	case SCSI_REZEROUNIT:
-		scsiState = scsiCommandRezeroUnit();
-		break;
-		
-	case SCSI_REQUESTSENSE:
-		scsiState = scsiCommandRequestSense();
-		break;
-		
-	case SCSI_FORMAT:
-		scsiState = scsiCommandFormat();
-		break;
-		
-	case SCSI_READ6:
-		scsiState = scsiCommandRead6();
-		break;
-		
-	case SCSI_WRITE6:
-		scsiState = scsiCommandWrite6();
-		break;
-		
-	case SCSI_SEEK:
-		scsiState = scsiCommandSeek();
-		break;
-		
-	case SCSI_TRANSLATE:
-		scsiState = scsiCommandTranslate();
-		break;
-		
-	case SCSI_MODESELECT:
-		scsiState = scsiCommandModeSelect();
-		break;
-		
-	case SCSI_MODESENSE:
-		scsiState = scsiCommandModeSense();
-		break;
-		
-	case SCSI_STARTSTOP:
-		scsiState = scsiCommandStartStop();
-		break;
-		
-	case SCSI_VERIFY:
-		scsiState = scsiCommandVerify();
-		break;
-	case SCSI_INQUIRY:
-		scsiState = scsiCommandInquiry();
-		break;
-		
-//		// Handle LV-DOS specific group 6 commands
-//		case SCSI_WRITE_FCODE :
-//		scsiState = scsiWriteFCode();
-//		break;
-//		
-//	case SCSI_READ_FCODE:
-//		scsiState = scsiReadFCode();
-//		break;
-//		
-//		// Handle BeebSCSI specific group 6 commands
-//		case SCSI_BEEBSCSI_SENSE :
-//		scsiState = scsiBeebScsiSense();
-//		break;
-//		
-//	case SCSI_BEEBSCSI_SELECT:
-//		scsiState = scsiBeebScsiSelect();
-//		break;
-//		
-//	case SCSI_BEEBSCSI_FATPATH:
-//		scsiState = scsiBeebScsiFatPath();
-//		break;
-//		
-//	case SCSI_BEEBSCSI_FATINFO:
-//		scsiState = scsiBeebScsiFatInfo();
-//		break;
-//		
-//	case SCSI_BEEBSCSI_FATREAD:
-//		scsiState = scsiBeebScsiFatRead();
-//		break;
-//		
 	default:
 		if (debugFlag_scsiState) debugString_P(PSTR("SCSI State: ERROR: Invalid SCSI state!\r\n"));
 	}
@@ -395,6 +448,15 @@ void scsiInformationTransferPhase(uint8_t transferPhase)
 	// 1	1	0	Message out phase
 	// 1	1	1	Message in phase
 	
+	// Time the data phases of the connected command (the released bus is left in data out)
+	if (commandDataBlock.connected)
+	{
+		if (transferPhase == ITPHASE_DATAIN || transferPhase == ITPHASE_DATAOUT) latencyStampOnce(LATENCY_STAMP_DATA_FIRST);
+		else if (scsiTransferPhase == ITPHASE_DATAIN || scsiTransferPhase == ITPHASE_DATAOUT) latencyStamp(LATENCY_STAMP_DATA_LAST);
+		TRACE(TRACE_SCSI_PHASE, transferPhase, 0, 0);
+	}
+	scsiTransferPhase = transferPhase;
+	
 	switch(transferPhase)
 	{
 	case ITPHASE_DATAOUT:
@@ -473,8 +535,10 @@ uint8_t scsiEmulationBusFree(void)
 }
 
 // SCSI Command state
+// Note: The CDB is read from the host then either queued (tagged commands) or executed
 uint8_t scsiEmulationCommand(void)
 {
+	const struct scsiCommandStruct *command;
 	uint8_t commandDataBlockPointer = 0;
 	
 	if (debugFlag_scsiState) debugString_P(PSTR("SCSI State: Command phase\r\n"));
@@ -488,26 +552,12 @@ uint8_t scsiEmulationCommand(void)
 	// Decode the CDB 1st byte
 	commandDataBlock.group = (commandDataBlock.data[0] & 0xE0) >> 5;
 	commandDataBlock.opCode = (commandDataBlock.data[0] & 0x1F);
+	command = &scsiCommandTable[commandDataBlock.data[0]];
 	
-	// Set the length of the CDB based on the command group
-	switch(commandDataBlock.group)
-	{
-	case 0:
-		commandDataBlock.length = 6;
-		break;
-		
-	case 1:
-		commandDataBlock.length = 10;
-		break;
-		
-	case 6:
-		commandDataBlock.length = 6;
-		break;
-		
-	default:
-		if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: ERROR: BAD command group received\r\n"));
-		break;
-	}
+	// Set the length of the CDB (from the command table, or the command group for
+	// unsupported commands)
+	if (command->length != 0) commandDataBlock.length = command->length;
+	else commandDataBlock.length = scsiGroupLength[commandDataBlock.group];
 	
 	// Show CDB byte 0 decode
 	if(debugFlag_scsiCommands) 
@@ -539,123 +589,102 @@ uint8_t scsiEmulationCommand(void)
 		commandDataBlockPointer++;
 	}
 	if (debugFlag_scsiCommands) debugString_P(PSTR("\r\n"));
+	latencyStamp(LATENCY_STAMP_COMMAND);
 	
-	// Decode the target LUN
-	commandDataBlock.targetLUN = (commandDataBlock.data[1] & 0xE0) >> 5;
+	// Decode the target LUN (unless the initiator sent an IDENTIFY message)
+	if (!commandDataBlock.identified) commandDataBlock.targetLUN = (commandDataBlock.data[1] & 0xE0) >> 5;
+	TRACE(TRACE_SCSI_COMMAND, scsiTraceNexus(),
+		((uint32_t)commandDataBlock.data[1] << 24) | ((uint32_t)commandDataBlock.data[2] << 16) | ((uint32_t)commandDataBlock.data[3] << 8) | commandDataBlock.data[4],
+		((uint32_t)commandDataBlock.data[5] << 24) | ((uint32_t)commandDataBlock.data[6] << 16) | ((uint32_t)commandDataBlock.data[7] << 8) | commandDataBlock.data[8]);
 	
-	// Transition to command based on received opCode (group 0 commands)
-	if(commandDataBlock.group == 0)
+	if (command->handler != NULL)
 	{
-		// Select group 0 command type
-		switch(commandDataBlock.opCode)
+		// Tagged block transfers are queued (and the bus released) if the initiator allows
+		// disconnects.  Other tagged commands are queued behind any queued commands.
+		if (commandDataBlock.tagged && commandDataBlock.disconnectPrivilege &&
+			((command->flags & SCSI_FLAG_QUEUED) || scsiQueueLength(commandDataBlock.targetLUN) != 0))
+			return scsiQueueCommand();
+		
+		// Untagged commands that access the medium must wait for the queued commands
+		if (scsiQueueLength(commandDataBlock.targetLUN) != 0 && !(command->flags & SCSI_FLAG_NO_MEDIUM))
 		{
-		case 0x00:
-			return SCSI_TESTUNITREADY;
-			break;
-			
-		case 0x01:
-			return SCSI_REZEROUNIT;
-			break;
-			
-		case 0x03:
-			return SCSI_REQUESTSENSE;
-			break;
-			
-		case 0x04:
-			return SCSI_FORMAT;
-			break;
-			
-		case 0x08:
-			return SCSI_READ6;
-			break;
-			
-		case 0x0A:
-			return SCSI_WRITE6;
-			break;
-			
-		case 0x0B:
-			return SCSI_SEEK;
-			break;
-		case 0x12:
-			return SCSI_INQUIRY;
-			break;
-		case 0x0F:
-			return SCSI_TRANSLATE;
-			break;
-			
-		case 0x15:
-			return SCSI_MODESELECT;
-			break;
-			
-		case 0x1A:
-			return SCSI_MODESENSE;
-			break;
-			
-		case 0x1B:
-			return SCSI_STARTSTOP;
-			break;
+			if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Untagged command with queued commands, returning BUSY\r\n"));
+			commandDataBlock.status = 0x08;  // 0x08 = Busy
+			commandDataBlock.message = 0x00;
+			return SCSI_STATUS;
 		}
 	}
 	
-	// Transition to command based on received opCode (group 1 commands)
-	if(commandDataBlock.group == 1)
+	// Execute the command
+	return scsiExecuteCommand();
+}
+
+// Function to execute the command in the CDB buffer
+// Note: The command is looked up in the command table, the shared preamble (LUN checks
+// and default status) is applied and the command handler is called directly.
+uint8_t scsiExecuteCommand(void)
+{
+	const struct scsiCommandStruct *command = &scsiCommandTable[commandDataBlock.data[0]];
+	
+	// Unrecognized command received?
+	if (command->handler == NULL || ((command->flags & SCSI_FLAG_LVDOS) && emulationMode != LVDOS_EMULATION))
+	{
+		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: ERROR: BAD opcode received\r\n"));
+		scsiCommandError(0x02, 0x20);  // Class 02 error code, 20 Invalid command
+		return SCSI_STATUS;
+	}
+	
+	// Default to successful command in status and message
+	commandDataBlock.status = 0x00;  // 0x00 = Good
+	commandDataBlock.message = 0x00;
+	
+	// Make sure the target LUN is started (if required by the command)
+	if ((command->flags & (SCSI_FLAG_STARTED_LUN | SCSI_FLAG_AUTOSTART_LUN)) && !filesystemReadLunStatus(commandDataBlock.targetLUN))
 	{
-		// Select group 1 command type
-		switch(commandDataBlock.opCode)
+		if (command->flags & SCSI_FLAG_AUTOSTART_LUN)
 		{
-		case 0x0F:
-			return SCSI_VERIFY;
-			break;
+			// Target LUN is not started.  If the LUN is present, then start it, otherwise
+			// return an error.  Note: The original Adaptec SCSI host adapter would always
+			// auto-start a LUN if it was present, so we duplicate that behavior here even 
+			// though it is 'more correct' (according to the specs) to return with error
+			if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Attempting to Auto-Start LUN (as it is currently STOPped)\r\n"));
+			
+			// Auto-start the LUN
+			if(!filesystemSetLunStatus(commandDataBlock.targetLUN, true))
+			{
+				// Could not start LUN... return with error status
+				if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Could not auto-start LUN #"), commandDataBlock.targetLUN, true);
+				scsiCommandError(0x02, 0x1C);  // Class 02 error code, 1C Bad format
+				return SCSI_STATUS;
+			}
+			
+			if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Requested LUN has been auto-started\r\n"));
+		}
+		else
+		{
+			// LUN unavailable... return with error status
+			if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Unavailable LUN #"), commandDataBlock.targetLUN, true);
+			scsiCommandError(0x00, 0x02);  // Class 00 error code, 02 Unit not ready
+			return SCSI_STATUS;
 		}
 	}
 	
-	// Transition to command based on received opCode (group 6 LV-DOS commands)
-	if(commandDataBlock.group == 6 && emulationMode == LVDOS_EMULATION)
-	{
-//		// Select group 6 command type
-//		switch(commandDataBlock.opCode)
-//		{
-//		case 0x0A:
-//			return SCSI_WRITE_FCODE;
-//			break;
-//			
-//		case 0x08:
-//			return SCSI_READ_FCODE;
-//			break;
-//		}
-	}
-	
-	// Transition to command based on received opCode (group 6 BeebSCSI commands)
-	if(commandDataBlock.group == 6)
-	{
-//		// Select group 6 command type
-//		switch(commandDataBlock.opCode)
-//		{
-//		case 0x10:
-//			return SCSI_BEEBSCSI_SENSE;
-//			break;
-//			
-//		case 0x11:
-//			return SCSI_BEEBSCSI_SELECT;
-//			break;
-//			
-//		case 0x12:
-//			return SCSI_BEEBSCSI_FATPATH;
-//			break;
-//			
-//		case 0x13:
-//			return SCSI_BEEBSCSI_FATINFO;
-//			break;
-//			
-//		case 0x14:
-//			return SCSI_BEEBSCSI_FATREAD;
-//			break;
-//		}
-	}
-
-	// Unrecognized command received!
-	if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: ERROR: BAD opcode received - transitioning to bus free\r\n"));
-	return SCSI_BUSFREE;
+	// Execute the command
+	return command->handler();
+}
+
+// Function to set the status and request sense data for a failed command
+void scsiCommandError(uint8_t errorClass, uint8_t errorCode)
+{
+	commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
+	commandDataBlock.message = 0x00;
+	
+	// Set request sense error globals
+	requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
+	requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
+	requestSenseData[commandDataBlock.targetLUN].errorClass = errorClass;
+	requestSenseData[commandDataBlock.targetLUN].errorCode = errorCode;
+	requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
 }
 
 // SCSI status state
@@ -663,8 +692,19 @@ uint8_t scsiEmulationStatus(void)
 {
 	if (debugFlag_scsiState) debugStringInt16_P(PSTR("SCSI State: Status.  Status byte = "), commandDataBlock.status, true);
 	
+	// Reconnect to the initiator (queued command that failed before its data phase, or
+	// a command that disconnected to write the cache).  If that fails the command is
+	// suspended and its status sent once any selection that got in first has been served.
+	if(!commandDataBlock.connected && !scsiReselect())
+	{
+		scsiQueueSuspendStatus();
+		return SCSI_BUSFREE;
+	}
+	
 	// Set signals to indicate status state on the bus
 	scsiInformationTransferPhase(ITPHASE_STATUS);
+	latencyStamp(LATENCY_STAMP_STATUS);
+	TRACE(TRACE_SCSI_STATUS, commandDataBlock.status, 0, 0);
 	
 	// Write the status byte to the host
 	hostadapterWriteByte(commandDataBlock.status);
@@ -684,130 +724,615 @@ uint8_t scsiEmulationMessage(void)
 	// Write the message byte to the host
 	hostadapterWriteByte(commandDataBlock.message);
 	
+	// Release the bus
+	scsiReleaseBus();
+	latencyCommandComplete(commandDataBlock.data[0], commandDataBlock.targetLUN);
+	TRACE(TRACE_SCSI_COMPLETE, scsiTraceNexus(), commandDataBlock.status, 0);
+	
+	// Remove a completed queued command from the queue
+	if(commandDataBlock.queueEntry != NULL)
+	{
+		commandDataBlock.queueEntry->valid = false;
+		scsiQueueCount--;
+		commandDataBlock.queueEntry = NULL;
+	}
+	
 	// Transition to the bus free state (command is complete)
 	return SCSI_BUSFREE;
 }
 
-// SCSI command execution functions -----------------------------------------------------
-
-// SCSI Command (0x00) TestUnitReady
-//
-// Adaptec ACB-4000 Manual notes:
-// The TEST UNIT READY command verifies that the drive is powered on
-// and the DRIVE READY line is true. Once the drive is re-zeroed,
-// with no errors, this command will check to see that the drive is
-// ready to write and read data. Drive write fault condition is also
-// checked.
-uint8_t scsiCommandTestUnitReady(void)
+// SCSI message out state
+// Note: Entered when the initiator asserts ATN during selection; messages are read
+// until the initiator releases ATN
+uint8_t scsiEmulationMessageOut(void)
 {
-	if (debugFlag_scsiCommands)
-	{
-		debugString_P(PSTR("SCSI Commands: TESTUNITREADY command (0x00) received\r\n"));
-		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, true);
-	}
+	uint8_t message;
+	uint8_t extendedMessage[4];
+	uint8_t extendedLength;
+	uint8_t byteCounter;
+	bool sdtrSent = false;
 	
-	// Check to see if the requested LUN is started
-	if(filesystemReadLunStatus(commandDataBlock.targetLUN))
-	{
-		// Indicate successful command in status and message
-		commandDataBlock.status = 0x00;  // 0x00 = Good
-		commandDataBlock.message = 0x00;
-	}
-	else
+	if (debugFlag_scsiState) debugString_P(PSTR("SCSI State: Message Out\r\n"));
+	
+	// Set signals to indicate message out state on the bus
+	scsiInformationTransferPhase(ITPHASE_MESSAGEOUT);
+	
+	while(hostadapterReadAttentionFlag())
 	{
-		// Indicate unsuccessful command in status and message
-		if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Unavailable LUN #"), commandDataBlock.targetLUN, true);
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Failed
-		commandDataBlock.message = 0x00;
+		// Read the message byte from the host
+		message = hostadapterReadByte();
+		if(hostadapterReadResetFlag()) return SCSI_BUSFREE;
 		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x02;  // Unit not ready
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+		if (debugFlag_scsiState) debugStringInt16_P(PSTR("SCSI State: Message Out.  Message byte = "), message, true);
 		
-		return SCSI_STATUS;
+		if(message & MESSAGE_IDENTIFY)
+		{
+			// IDENTIFY: select the target LUN and note the disconnect privilege
+			commandDataBlock.targetLUN = message & 0x07;
+			commandDataBlock.identified = true;
+			commandDataBlock.disconnectPrivilege = (message & MESSAGE_IDENTIFY_DISCONNECT) && commandDataBlock.initiatorId != 0xFF;
+		}
+		else if(message >= MESSAGE_SIMPLE_QUEUE_TAG && message <= MESSAGE_ORDERED_QUEUE_TAG)
+		{
+			// Queue tag message (the tag follows)
+			commandDataBlock.tagType = message;
+			commandDataBlock.tag = hostadapterReadByte();
+			commandDataBlock.tagged = true;
+		}
+		else if(message == MESSAGE_ABORT || message == MESSAGE_ABORT_TAG || message == MESSAGE_CLEAR_QUEUE ||
+			message == MESSAGE_BUS_DEVICE_RESET)
+		{
+			// Abort the command(s) (or reset the target) and go to the bus free state
+			if(message == MESSAGE_ABORT && commandDataBlock.identified)
+				scsiQueueClear(commandDataBlock.targetLUN, commandDataBlock.initiatorId);
+			if(message == MESSAGE_CLEAR_QUEUE && commandDataBlock.identified)
+				scsiQueueClear(commandDataBlock.targetLUN, 0xFF);
+			if(message == MESSAGE_ABORT_TAG && commandDataBlock.tagged)
+				scsiQueueAbortTag(commandDataBlock.targetLUN, commandDataBlock.initiatorId, commandDataBlock.tag);
+			
+			scsiReleaseBus();
+			if(message == MESSAGE_BUS_DEVICE_RESET) hostadapterWriteResetFlag(true);
+			return SCSI_BUSFREE;
+		}
+		else if(message == MESSAGE_EXTENDED)
+		{
+			// Read the extended message (only the first bytes of a long message are kept)
+			extendedLength = hostadapterReadByte();
+			for (byteCounter = 0; byteCounter < extendedLength; byteCounter++)
+			{
+				message = hostadapterReadByte();
+				if (byteCounter < sizeof(extendedMessage)) extendedMessage[byteCounter] = message;
+			}
+			if(hostadapterReadResetFlag()) return SCSI_BUSFREE;
+			
+			scsiInformationTransferPhase(ITPHASE_MESSAGEIN);
+			if(extendedLength == 3 && extendedMessage[0] == EXTENDED_SDTR)
+			{
+				// SDTR: agree to the slower period and the smaller offset then reply with the agreement
+				if (extendedMessage[1] < SYNC_MIN_PERIOD) extendedMessage[1] = SYNC_MIN_PERIOD;
+				if (extendedMessage[2] > SYNC_MAX_OFFSET) extendedMessage[2] = SYNC_MAX_OFFSET;
+				scsiSetSyncTransfer(extendedMessage[1], extendedMessage[2]);
+				sdtrSent = true;
+				
+				if (debugFlag_scsiState)
+				{
+					debugStringInt16_P(PSTR("SCSI State: SDTR period (4nS units) = "), extendedMessage[1], true);
+					debugStringInt16_P(PSTR("SCSI State: SDTR offset = "), extendedMessage[2], true);
+				}
+				
+				hostadapterWriteByte(MESSAGE_EXTENDED);
+				hostadapterWriteByte(3);
+				hostadapterWriteByte(EXTENDED_SDTR);
+				hostadapterWriteByte(extendedMessage[1]);
+				hostadapterWriteByte(extendedMessage[2]);
+			}
+			else
+			{
+				// WDTR and other extended messages are not supported (the bus stays 8-bit)
+				hostadapterWriteByte(MESSAGE_MESSAGE_REJECT);
+			}
+			scsiInformationTransferPhase(ITPHASE_MESSAGEOUT);
+		}
+		else if(message == MESSAGE_MESSAGE_REJECT)
+		{
+			// The initiator rejected our SDTR reply: fall back to asynchronous transfers
+			if(sdtrSent) scsiSetSyncTransfer(0, 0);
+			sdtrSent = false;
+		}
+		else if(message != MESSAGE_NOP)
+		{
+			// Unsupported message: reply with MESSAGE REJECT
+			scsiInformationTransferPhase(ITPHASE_MESSAGEIN);
+			hostadapterWriteByte(MESSAGE_MESSAGE_REJECT);
+			scsiInformationTransferPhase(ITPHASE_MESSAGEOUT);
+		}
 	}
 	
-	return SCSI_STATUS;
+	// Transition to the command state
+	return SCSI_COMMAND;
 }
 
-// SCSI Command (0x01) ReZero Unit
-//
-// Only used by removable media in the LV-DOS emulation mode
-//
-// VP415 LVDP Manual notes:
-// Displays the logical picture zero of the volume that is accessed through
-// the logic unit number <>f the command. If successful, the status
-// returned is 0x00; otherwise the status returned is 0x02.
-uint8_t scsiCommandRezeroUnit(void)
+// Function to release BSY and the phase signals at the end of a bus connection
+void scsiReleaseBus(void)
 {
-	if (debugFlag_scsiCommands)
+	commandDataBlock.connected = false;
+	hostadapterWriteBusyFlag(false);
+	scsiInformationTransferPhase(ITPHASE_DATAOUT);
+	TRACE(TRACE_SCSI_BUS_FREE, scsiTraceNexus(), 0, 0);
+}
+
+// Function to disconnect from the bus during a long storage operation
+// Note: The caller must check commandDataBlock.disconnectPrivilege and call
+// scsiReselect() before the next information transfer phase
+void scsiDisconnect(void)
+{
+	if (debugFlag_scsiState) debugString_P(PSTR("SCSI State: Disconnecting\r\n"));
+	
+	// Save the data pointer then disconnect
+	scsiInformationTransferPhase(ITPHASE_MESSAGEIN);
+	hostadapterWriteByte(MESSAGE_SAVE_DATA_POINTER);
+	hostadapterWriteByte(MESSAGE_DISCONNECT);
+	
+	scsiReleaseBus();
+}
+
+// Function to reselect the initiator after a disconnect
+// Returns false if the initiator did not respond (the bus is free)
+bool scsiReselect(void)
+{
+	if (debugFlag_scsiState) debugStringInt16_P(PSTR("SCSI State: Reselecting host ID "), commandDataBlock.initiatorId, true);
+	
+	if(!hostadapterReselect(targetId, commandDataBlock.initiatorId))
 	{
-		debugString_P(PSTR("SCSI Commands: REZEROUNIT command (0x01) received\r\n"));
-		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, true);
+		if (debugFlag_scsiState) debugString_P(PSTR("SCSI State: ERROR: Reselection failed\r\n"));
+		scsiReleaseBus();
+		return false;
 	}
 	
-	// Check to see if the requested LUN is started
-	if(filesystemReadLunStatus(commandDataBlock.targetLUN))
+	commandDataBlock.connected = true;
+	TRACE(TRACE_SCSI_RESELECTED, commandDataBlock.initiatorId, 0, 0);
+	if(commandDataBlock.queueEntry != NULL) commandDataBlock.queueEntry->started = true;
+	scsiApplySyncTransfer();
+	
+	// Identify the reconnecting LUN (and the queue tag) then restore the pointers
+	scsiInformationTransferPhase(ITPHASE_MESSAGEIN);
+	hostadapterWriteByte(MESSAGE_IDENTIFY | commandDataBlock.targetLUN);
+	if(commandDataBlock.tagged)
 	{
-		// Indicate successful command in status and message
-		commandDataBlock.status = 0x00;  // 0x00 = Good
-		commandDataBlock.message = 0x00;
+		hostadapterWriteByte(MESSAGE_SIMPLE_QUEUE_TAG);
+		hostadapterWriteByte(commandDataBlock.tag);
 	}
-	else
+	hostadapterWriteByte(MESSAGE_RESTORE_POINTERS);
+	
+	return !hostadapterReadResetFlag();
+}
+
+// Function to record the synchronous transfer agreement with the connected initiator
+// Note: Old hosts that do not send their ID get the agreement for the current
+// connection only
+void scsiSetSyncTransfer(uint8_t period, uint8_t offset)
+{
+	if(commandDataBlock.initiatorId != 0xFF)
 	{
-		// Indicate unsuccessful command in status and message
-		if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Unavailable LUN #"), commandDataBlock.targetLUN, true);
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Failed
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x02;  // Unit not ready
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
-		
-		return SCSI_STATUS;
+		scsiSyncPeriod[commandDataBlock.initiatorId] = period;
+		scsiSyncOffset[commandDataBlock.initiatorId] = offset;
 	}
-	
-	return SCSI_STATUS;
+	hostadapterSetSyncTransfer(period, offset);
 }
 
-// SCSI Command (0x03) RequestSense
-//
-// Adaptec ACB-4000 Manual notes:
-// The REQUEST SENSE (03 hex) command is the command that gives the
-// most detailed description of status from the controller. This
-// command is needed whenever a CHECK STATUS is found in the
-// COMPLETION STATUS BYTE. If the CHECK BIT is set after a command,
-// a REQUEST SENSE must follow in order to read status and clear the
-// check condition.
-//
-// Note: This command is used by the host after another command returns
-// a 'bad' status (0x02).  It is a request for a more detailed error code.
-// If the command is incorrectly handled it will cause ADFS to hang...
-uint8_t scsiCommandRequestSense(void)
+// Function to set the host adapter to the transfer mode agreed with the connected initiator
+// (asynchronous until the initiator negotiates)
+void scsiApplySyncTransfer(void)
 {
-	uint8_t numberOfSenseBytes;
-	uint8_t responseByte = 0;
+	if(commandDataBlock.initiatorId == 0xFF) hostadapterSetSyncTransfer(0, 0);
+	else hostadapterSetSyncTransfer(scsiSyncPeriod[commandDataBlock.initiatorId], scsiSyncOffset[commandDataBlock.initiatorId]);
+}
 
-	if (debugFlag_scsiCommands)
+// Tagged command queue functions -------------------------------------------------------------
+
+// Function to queue the tagged command in the CDB buffer and disconnect from the bus
+uint8_t scsiQueueCommand(void)
+{
+	const struct scsiCommandStruct *command = &scsiCommandTable[commandDataBlock.data[0]];
+	struct scsiQueueEntryStruct *entry = NULL;
+	uint8_t entryNumber;
+	
+	// Find a free queue entry for the LUN
+	for(entryNumber = 0; entryNumber < SCSI_QUEUE_DEPTH; entryNumber++)
 	{
-		debugString_P(PSTR("SCSI Commands: REQUESTSENSE command (0x03) received\r\n"));
-		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, true);
+		if(!scsiQueue[commandDataBlock.targetLUN][entryNumber].valid)
+		{
+			entry = &scsiQueue[commandDataBlock.targetLUN][entryNumber];
+			break;
+		}
 	}
 	
-	// Since this command provides additional error information, it is available even if the
-	// LUN is unavailable (no LUN image on file system).
-	
-	// Get the requested number of sense bytes
-	numberOfSenseBytes = commandDataBlock.data[4];
+	if(entry == NULL)
+	{
+		if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Queue full for LUN #"), commandDataBlock.targetLUN, true);
+		commandDataBlock.status = 0x28;  // 0x28 = Queue full
+		commandDataBlock.message = 0x00;
+		return SCSI_STATUS;
+	}
 	
-	// The ACB-4000 manual (section 5.5.1) states that, if the number of sense bytes
-	// is less than 4, it should default to four bytes
+	entry->valid = true;
+	entry->started = false;
+	entry->suspended = false;
+	entry->tagged = true;
+	entry->tagType = commandDataBlock.tagType;
+	entry->tag = commandDataBlock.tag;
+	entry->initiatorId = commandDataBlock.initiatorId;
+	entry->lunNumber = commandDataBlock.targetLUN;
+	entry->sequence = scsiQueueSequence++;
+	memcpy(entry->data, commandDataBlock.data, commandDataBlock.length);
+	entry->length = commandDataBlock.length;
+	latencySaveStamps(&entry->latency);
+	
+	// Only block transfers can be reordered; other commands keep their place in the queue
+	entry->logicalBlockAddress = 0;
+	entry->numberOfBlocks = 0;
+	entry->blocksTransferred = 0;
+	entry->statusPending = false;
+	if(command->flags & SCSI_FLAG_QUEUED)
+	{
+		if(commandDataBlock.group == 0)
+		{
+			entry->logicalBlockAddress = (((uint32_t)entry->data[1] & 0x1F) << 16) | ((uint32_t)entry->data[2] << 8) | (uint32_t)entry->data[3];
+			entry->numberOfBlocks = entry->data[4];
+			if(entry->numberOfBlocks == 0) entry->numberOfBlocks = 256;
+		}
+		else
+		{
+			entry->logicalBlockAddress = ((uint32_t)entry->data[2] << 24) | ((uint32_t)entry->data[3] << 16) |
+				((uint32_t)entry->data[4] << 8) | (uint32_t)entry->data[5];
+			entry->numberOfBlocks = ((uint32_t)entry->data[7] << 8) | (uint32_t)entry->data[8];
+		}
+	}
+	else if(entry->tagType == MESSAGE_SIMPLE_QUEUE_TAG) entry->tagType = MESSAGE_ORDERED_QUEUE_TAG;
+	
+	scsiQueueCount++;
+	TRACE(TRACE_SCSI_QUEUED, scsiTraceNexus(), scsiQueueCount, 0);
+	if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Queued command with tag "), entry->tag, true);
+	
+	// Disconnect until the command is dispatched
+	scsiDisconnect();
+	return SCSI_BUSFREE;
+}
+
+// Function to keep the connected command in the queue when its reselection fails
+// (another initiator selected us first, or the initiator did not respond) so that it is
+// resumed once the bus is free again.  Untagged commands are given a queue entry; there is
+// always a free one as untagged commands that access the medium are refused while the
+// LUN has queued commands.
+// Returns the queue entry (NULL if the command could not be kept)
+static struct scsiQueueEntryStruct *scsiQueueSuspend(void)
+{
+	struct scsiQueueEntryStruct *entry = commandDataBlock.queueEntry;
+	uint8_t entryNumber;
+	
+	// A reset clears the queue
+	if(hostadapterReadResetFlag()) return NULL;
+	
+	if(entry == NULL)
+	{
+		for(entryNumber = 0; entryNumber < SCSI_QUEUE_DEPTH; entryNumber++)
+		{
+			if(!scsiQueue[commandDataBlock.targetLUN][entryNumber].valid)
+			{
+				entry = &scsiQueue[commandDataBlock.targetLUN][entryNumber];
+				break;
+			}
+		}
+		
+		if(entry == NULL)
+		{
+			if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Queue full, can not suspend command for LUN #"), commandDataBlock.targetLUN, true);
+			return NULL;
+		}
+		
+		// The untagged command is ORDERED so no later tagged command can pass it
+		entry->valid = true;
+		entry->started = true;
+		entry->tagged = false;
+		entry->tagType = MESSAGE_ORDERED_QUEUE_TAG;
+		entry->tag = 0;
+		entry->initiatorId = commandDataBlock.initiatorId;
+		entry->lunNumber = commandDataBlock.targetLUN;
+		entry->sequence = scsiQueueSequence++;
+		memcpy(entry->data, commandDataBlock.data, commandDataBlock.length);
+		entry->length = commandDataBlock.length;
+		entry->logicalBlockAddress = 0;
+		entry->numberOfBlocks = 0;
+		entry->blocksTransferred = 0;
+		entry->statusPending = false;
+		scsiQueueCount++;
+		commandDataBlock.queueEntry = entry;
+	}
+	
+	entry->suspended = true;
+	latencySaveStamps(&entry->latency);
+	TRACE(TRACE_SCSI_QUEUED, scsiTraceNexus(), scsiQueueCount, 0);
+	
+	return entry;
+}
+
+// Function to suspend a block transfer whose reselection failed (it is resumed from the
+// first block not yet transferred)
+void scsiQueueSuspendCommand(uint32_t blocksTransferred)
+{
+	struct scsiQueueEntryStruct *entry = scsiQueueSuspend();
+	
+	if(entry == NULL) return;
+	entry->blocksTransferred = blocksTransferred;
+	if(debugFlag_scsiCommands) debugStringInt32_P(PSTR("SCSI Commands: Suspended command after block #"), blocksTransferred, true);
+}
+
+// Function to suspend a command whose reselection for the status phase failed (only the
+// status is sent when it is resumed)
+void scsiQueueSuspendStatus(void)
+{
+	struct scsiQueueEntryStruct *entry = scsiQueueSuspend();
+	
+	if(entry == NULL) return;
+	entry->statusPending = true;
+	entry->status = commandDataBlock.status;
+	if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Suspended command before status "), commandDataBlock.status, true);
+}
+
+// Function to choose the next queued command for a LUN
+// Suspended commands go first, then HEAD OF QUEUE commands.  SIMPLE commands are served
+// in ascending block order (from the end of the last transfer, wrapping to the lowest
+// block) but never pass an ORDERED command, which is dispatched once all the commands
+// before it are complete.
+static struct scsiQueueEntryStruct *scsiQueueSelectEntry(uint8_t lunNumber)
+{
+	struct scsiQueueEntryStruct *entry;
+	struct scsiQueueEntryStruct *head = NULL;
+	struct scsiQueueEntryStruct *barrier = NULL;
+	struct scsiQueueEntryStruct *ahead = NULL;
+	struct scsiQueueEntryStruct *lowest = NULL;
+	uint8_t entryNumber;
+	
+	for(entryNumber = 0; entryNumber < SCSI_QUEUE_DEPTH; entryNumber++)
+	{
+		entry = &scsiQueue[lunNumber][entryNumber];
+		if(!entry->valid) continue;
+		
+		// The initiator is waiting part way through a suspended command
+		if(entry->suspended) return entry;
+		
+		if(entry->tagType == MESSAGE_HEAD_OF_QUEUE_TAG && (head == NULL || entry->sequence < head->sequence)) head = entry;
+		if(entry->tagType == MESSAGE_ORDERED_QUEUE_TAG && (barrier == NULL || entry->sequence < barrier->sequence)) barrier = entry;
+	}
+	if(head != NULL) return head;
+	
+	for(entryNumber = 0; entryNumber < SCSI_QUEUE_DEPTH; entryNumber++)
+	{
+		entry = &scsiQueue[lunNumber][entryNumber];
+		if(!entry->valid || entry->tagType != MESSAGE_SIMPLE_QUEUE_TAG) continue;
+		if(barrier != NULL && entry->sequence > barrier->sequence) continue;
+		
+		if(entry->logicalBlockAddress >= scsiQueueNextBlock[lunNumber] &&
+			(ahead == NULL || entry->logicalBlockAddress < ahead->logicalBlockAddress)) ahead = entry;
+		if(lowest == NULL || entry->logicalBlockAddress < lowest->logicalBlockAddress) lowest = entry;
+	}
+	
+	if(ahead != NULL) return ahead;
+	if(lowest != NULL) return lowest;
+	return barrier;
+}
+
+// Function to dispatch the next queued command (called when the bus is free)
+// The command runs disconnected: the handler reselects the initiator when it is ready
+// for the data phase (so the first card access overlaps with the free bus)
+uint8_t scsiQueueDispatch(void)
+{
+	struct scsiQueueEntryStruct *entry = NULL;
+	uint8_t lunCount;
+	uint8_t lunNumber = scsiQueueLastLun;
+	
+	for(lunCount = 0; lunCount < 8 && entry == NULL; lunCount++)
+	{
+		lunNumber = (lunNumber + 1) & 0x07;
+		entry = scsiQueueSelectEntry(lunNumber);
+	}
+	if(entry == NULL) return SCSI_BUSFREE;
+	
+	if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Dispatching queued command with tag "), entry->tag, true);
+	scsiQueueLastLun = lunNumber;
+	if(entry->tagged) scsiQueueNextBlock[lunNumber] = entry->logicalBlockAddress + entry->numberOfBlocks;
+	
+	// Restore the nexus and the CDB of the queued command
+	memcpy(commandDataBlock.data, entry->data, entry->length);
+	commandDataBlock.length = entry->length;
+	commandDataBlock.group = (entry->data[0] & 0xE0) >> 5;
+	commandDataBlock.opCode = (entry->data[0] & 0x1F);
+	commandDataBlock.targetLUN = entry->lunNumber;
+	commandDataBlock.initiatorId = entry->initiatorId;
+	commandDataBlock.identified = true;
+	commandDataBlock.disconnectPrivilege = true;
+	commandDataBlock.connected = false;
+	commandDataBlock.tagged = entry->tagged;
+	commandDataBlock.tagType = entry->tagType;
+	commandDataBlock.tag = entry->tag;
+	commandDataBlock.queueEntry = entry;
+	latencyRestoreStamps(&entry->latency);
+	TRACE(TRACE_SCSI_DISPATCH, scsiTraceNexus(), 0, 0);
+	
+	// Only the status is left to send (the status phase reselects the initiator)
+	if(entry->statusPending)
+	{
+		commandDataBlock.status = entry->status;
+		commandDataBlock.message = 0x00;
+		return SCSI_STATUS;
+	}
+	
+	// A command whose connection was lost part way through without being suspended can
+	// not be restarted, so it is ended with CHECK CONDITION
+	if(entry->started && !entry->suspended)
+	{
+		if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Ending interrupted queued command with tag "), entry->tag, true);
+		scsiCommandError(0x00, 0x04);  // Class 00 error code, 04 Drive not ready
+		return SCSI_STATUS;
+	}
+	
+	// Only the block transfers can start disconnected
+	if(!(scsiCommandTable[entry->data[0]].flags & SCSI_FLAG_QUEUED) && !scsiReselect()) return SCSI_BUSFREE;
+	
+	return scsiExecuteCommand();
+}
+
+// Function to return the number of queued commands for a LUN
+uint8_t scsiQueueLength(uint8_t lunNumber)
+{
+	uint8_t entryNumber;
+	uint8_t length = 0;
+	
+	if(scsiQueueCount == 0) return 0;
+	
+	for(entryNumber = 0; entryNumber < SCSI_QUEUE_DEPTH; entryNumber++)
+		if(scsiQueue[lunNumber][entryNumber].valid) length++;
+	
+	return length;
+}
+
+// Function to return the number of blocks read by queued SIMPLE READ commands that
+// continue contiguously from the specified block (so they can be merged into one card read)
+uint32_t scsiQueueAdjacentBlocks(uint8_t lunNumber, uint32_t logicalBlockAddress)
+{
+	struct scsiQueueEntryStruct *entry;
+	uint32_t blocks = 0;
+	uint32_t lunSizeInBlocks = filesystemGetLunSectorCount(lunNumber);
+	uint8_t entryNumber;
+	bool found = true;
+	
+	while(found && scsiQueueCount != 0)
+	{
+		found = false;
+		for(entryNumber = 0; entryNumber < SCSI_QUEUE_DEPTH; entryNumber++)
+		{
+			entry = &scsiQueue[lunNumber][entryNumber];
+			if(!entry->valid || entry->started || entry->tagType != MESSAGE_SIMPLE_QUEUE_TAG) continue;
+			if(scsiCommandTable[entry->data[0]].direction != SCSI_DIRECTION_IN) continue;
+			if(entry->logicalBlockAddress != logicalBlockAddress + blocks) continue;
+			if(entry->numberOfBlocks == 0 || entry->numberOfBlocks > lunSizeInBlocks - (logicalBlockAddress + blocks)) continue;
+			
+			blocks += entry->numberOfBlocks;
+			found = true;
+			break;
+		}
+	}
+	
+	return blocks;
+}
+
+// Function to remove the queued commands of an initiator (0xFF for all initiators) for a LUN
+void scsiQueueClear(uint8_t lunNumber, uint8_t initiatorId)
+{
+	uint8_t entryNumber;
+	
+	for(entryNumber = 0; entryNumber < SCSI_QUEUE_DEPTH; entryNumber++)
+	{
+		if(!scsiQueue[lunNumber][entryNumber].valid) continue;
+		if(initiatorId != 0xFF && scsiQueue[lunNumber][entryNumber].initiatorId != initiatorId) continue;
+		
+		scsiQueue[lunNumber][entryNumber].valid = false;
+		scsiQueueCount--;
+	}
+	
+	if(commandDataBlock.queueEntry != NULL && !commandDataBlock.queueEntry->valid) commandDataBlock.queueEntry = NULL;
+}
+
+// Function to remove a single queued command
+void scsiQueueAbortTag(uint8_t lunNumber, uint8_t initiatorId, uint8_t tag)
+{
+	uint8_t entryNumber;
+	
+	for(entryNumber = 0; entryNumber < SCSI_QUEUE_DEPTH; entryNumber++)
+	{
+		if(!scsiQueue[lunNumber][entryNumber].valid || !scsiQueue[lunNumber][entryNumber].tagged) continue;
+		if(scsiQueue[lunNumber][entryNumber].initiatorId != initiatorId || scsiQueue[lunNumber][entryNumber].tag != tag) continue;
+		
+		scsiQueue[lunNumber][entryNumber].valid = false;
+		scsiQueueCount--;
+	}
+}
+
+// SCSI command execution functions -----------------------------------------------------
+
+// SCSI Command (0x00) TestUnitReady
+//
+// Adaptec ACB-4000 Manual notes:
+// The TEST UNIT READY command verifies that the drive is powered on
+// and the DRIVE READY line is true. Once the drive is re-zeroed,
+// with no errors, this command will check to see that the drive is
+// ready to write and read data. Drive write fault condition is also
+// checked.
+uint8_t scsiCommandTestUnitReady(void)
+{
+	if (debugFlag_scsiCommands)
+	{
+		debugString_P(PSTR("SCSI Commands: TESTUNITREADY command (0x00) received\r\n"));
+		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, true);
+	}
+	
+	// The command table ensures the LUN is started, so there is nothing more to check
+	return SCSI_STATUS;
+}
+
+// SCSI Command (0x01) ReZero Unit
+//
+// Only used by removable media in the LV-DOS emulation mode
+//
+// VP415 LVDP Manual notes:
+// Displays the logical picture zero of the volume that is accessed through
+// the logic unit number <>f the command. If successful, the status
+// returned is 0x00; otherwise the status returned is 0x02.
+uint8_t scsiCommandRezeroUnit(void)
+{
+	if (debugFlag_scsiCommands)
+	{
+		debugString_P(PSTR("SCSI Commands: REZEROUNIT command (0x01) received\r\n"));
+		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, true);
+	}
+	
+	// The command table ensures the LUN is started, so there is nothing more to check
+	return SCSI_STATUS;
+}
+
+// SCSI Command (0x03) RequestSense
+//
+// Adaptec ACB-4000 Manual notes:
+// The REQUEST SENSE (03 hex) command is the command that gives the
+// most detailed description of status from the controller. This
+// command is needed whenever a CHECK STATUS is found in the
+// COMPLETION STATUS BYTE. If the CHECK BIT is set after a command,
+// a REQUEST SENSE must follow in order to read status and clear the
+// check condition.
+//
+// Note: This command is used by the host after another command returns
+// a 'bad' status (0x02).  It is a request for a more detailed error code.
+// If the command is incorrectly handled it will cause ADFS to hang...
+uint8_t scsiCommandRequestSense(void)
+{
+	uint8_t numberOfSenseBytes;
+	uint8_t responseByte = 0;
+	uint8_t senseBytes[4] = { 0x00, 0x00, 0x00, 0x00 };
+
+	if (debugFlag_scsiCommands)
+	{
+		debugString_P(PSTR("SCSI Commands: REQUESTSENSE command (0x03) received\r\n"));
+		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, true);
+	}
+	
+	// Since this command provides additional error information, it is available even if the
+	// LUN is unavailable (no LUN image on file system).
+	
+	// Get the requested number of sense bytes
+	numberOfSenseBytes = commandDataBlock.data[4];
+	
+	// The ACB-4000 manual (section 5.5.1) states that, if the number of sense bytes
+	// is less than 4, it should default to four bytes
 	if(numberOfSenseBytes < 4) numberOfSenseBytes = 4;
 	
 	// Note: The ACB-4000 manual is a little confusing around the subject of the
@@ -822,10 +1347,6 @@ uint8_t scsiCommandRequestSense(void)
 	if(requestSenseData[commandDataBlock.targetLUN].errorFlag == false)
 	{
 		if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: No error flagged\r\n"));
-		hostadapterWriteByte(0x00);
-		hostadapterWriteByte(0x00);
-		hostadapterWriteByte(0x00);
-		hostadapterWriteByte(0x00);
 	}
 	else
 	{
@@ -835,12 +1356,16 @@ uint8_t scsiCommandRequestSense(void)
 		responseByte += (requestSenseData[commandDataBlock.targetLUN].errorClass & 0x7) << 4;  // set error class field
 		responseByte += (requestSenseData[commandDataBlock.targetLUN].errorCode & 0x0F);  // set error code field
 		
-		hostadapterWriteByte(responseByte);
-		hostadapterWriteByte((uint8_t)((requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress & 0x1F0000) >> 16));
-		hostadapterWriteByte((uint8_t)((requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress & 0x00FF00) >> 8));
-		hostadapterWriteByte((uint8_t)((requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress & 0x0000FF)));
+		senseBytes[0] = responseByte;
+		senseBytes[1] = (uint8_t)((requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress & 0x1F0000) >> 16);
+		senseBytes[2] = (uint8_t)((requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress & 0x00FF00) >> 8);
+		senseBytes[3] = (uint8_t)((requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress & 0x0000FF));
 	}
 	
+	// Only the 4 ACB-4000 sense bytes are available, so longer requests are truncated
+	if (numberOfSenseBytes > sizeof(senseBytes)) numberOfSenseBytes = sizeof(senseBytes);
+	hostadapterTransferIn(senseBytes, numberOfSenseBytes);
+	
 	// Clear the request sense error reporting globals
 	requestSenseData[commandDataBlock.targetLUN].errorFlag = false;
 	requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
@@ -871,8 +1396,6 @@ uint8_t scsiCommandRequestSense(void)
 // by using the TRANSLATE with the SEARCH DATA NOT EQUAL command.
 uint8_t scsiCommandFormat(void)
 {
-	uint8_t byteCounter;
-	
 	// Format unit command parameters:
 	uint8_t formatOptions;
 	uint8_t dataPattern;
@@ -897,15 +1420,7 @@ uint8_t scsiCommandFormat(void)
 		{
 			// Could not create LUN image... return with error status
 			if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: ERROR: Could not create new LUN image for LUN #"), commandDataBlock.targetLUN, true);
-			commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-			commandDataBlock.message = 0x00;
-			
-			// Set request sense error globals
-			requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-			requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-			requestSenseData[commandDataBlock.targetLUN].errorClass = 0x02;  // Class 02 error code
-			requestSenseData[commandDataBlock.targetLUN].errorCode = 0x1C;  // Unformatted or Bad format
-			requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+			scsiCommandError(0x02, 0x1C);  // Class 02 error code, 1C Unformatted or Bad format
 			
 			// The LUN is in an unknown state... Stop the LUN
 			filesystemSetLunStatus(commandDataBlock.targetLUN, false);
@@ -954,8 +1469,7 @@ uint8_t scsiCommandFormat(void)
 		
 		// Read the defect list header
 		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Defect list header:\r\n"));
-		for (byteCounter = 0; byteCounter < 4; byteCounter++)
-			scsiSectorBuffer[byteCounter] = hostadapterReadByte();
+		hostadapterTransferOut(scsiSectorBuffer, 4);
 		
 		defectListLength = (((uint32_t)scsiSectorBuffer[2] << 8) + (uint32_t)scsiSectorBuffer[3]) / 8;
 		if (debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands:   Length = "), defectListLength, true);
@@ -964,8 +1478,7 @@ uint8_t scsiCommandFormat(void)
 		for(defectListRecords = 0 ; defectListRecords < defectListLength ; defectListRecords++)
 		{
 			// Read the defect data
-			for(byteCounter = 0 ; byteCounter < 8 ; byteCounter++)
-			scsiSectorBuffer[byteCounter] = hostadapterReadByte();
+			hostadapterTransferOut(scsiSectorBuffer, 8);
 			
 			// Output defect to debug
 			if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Defect #"), defectListRecords, true);
@@ -987,15 +1500,7 @@ uint8_t scsiCommandFormat(void)
 		// Formatting failed...
 		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Format failed\r\n"));
 		
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x02;  // Class 02 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x1C;  // 1C Bad format
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+		scsiCommandError(0x02, 0x1C);  // Class 02 error code, 1C Bad format
 		
 		// The LUN is in an unknown state... Flag the LUN as unavailable
 		filesystemSetLunStatus(commandDataBlock.targetLUN, false);
@@ -1038,9 +1543,6 @@ uint8_t scsiCommandRead6(void)
 {
 	uint32_t logicalBlockAddress = 0;
 	uint32_t numberOfBlocks = 0;
-	uint32_t currentBlock = 0;
-	
-	uint16_t bytesTransferred = 0;
 	
 	if (debugFlag_scsiCommands)
 	{
@@ -1048,37 +1550,7 @@ uint8_t scsiCommandRead6(void)
 		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, false);
 	}
 	
-	// Make sure the target LUN is started
-	if(!filesystemReadLunStatus(commandDataBlock.targetLUN))
-	{
-		// Target LUN is not started.  If the LUN is present, then start it, otherwise
-		// return an error.  Note: The original Adaptec SCSI host adapter would always
-		// auto-start a LUN if it was present, so we duplicate that behavior here even 
-		// though it is 'more correct' (according to the specs) to return with error
-		
-		// Is the requested LUN available?
-		if(debugFlag_scsiCommands) debugString_P(PSTR("\r\nSCSI Commands: Attempting to Auto-Start LUN (as it is currently STOPped)\r\n"));
-		
-		// Auto-start the LUN
-		if(!filesystemSetLunStatus(commandDataBlock.targetLUN, true))
-		{
-			// Could not start LUN... return with error status
-			if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Could not auto-start LUN #"), commandDataBlock.targetLUN, true);
-			commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-			commandDataBlock.message = 0x00;
-			
-			// Set request sense error globals
-			requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-			requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-			requestSenseData[commandDataBlock.targetLUN].errorClass = 0x02;  // Class 02 error code
-			requestSenseData[commandDataBlock.targetLUN].errorCode = 0x1C;  // 1C Bad format
-			requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
-			
-			return SCSI_STATUS;
-		}
-		
-		if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Requested LUN has been auto-started\r\n"));
-	}
+	// Note: The command table auto-starts the target LUN
 	
 	// Get the starting logical block address from the CDB
 	logicalBlockAddress = (((uint32_t)commandDataBlock.data[1] & 0x1F) << 16) |
@@ -1093,23 +1565,87 @@ uint8_t scsiCommandRead6(void)
 	if(debugFlag_scsiCommands) debugStringInt32_P(PSTR(", LBA = "), logicalBlockAddress, false);
 	if (debugFlag_scsiCommands) debugStringInt32_P(PSTR(", Blocks = "), numberOfBlocks, true);
 	
-	// Set up the control signals ready for the data in phase
-	scsiInformationTransferPhase(ITPHASE_DATAIN);
+	// Check the requested blocks are inside the LUN image
+	if(!scsiCheckBlockRange(logicalBlockAddress, numberOfBlocks)) return SCSI_STATUS;
+	
+	// Transfer the blocks
+	return scsiReadBlocks(logicalBlockAddress, numberOfBlocks);
+}
+
+// SCSI Command (0x0A) Write6
+//
+// Adaptec ACB-4000 Manual notes:
+// The WRITE command is used to write data from the host to the
+// disk.
+//
+// A COMPLETION STATUS may give a check condition that leads to the
+// possible errors of: Bad argument, all class 00 errors,
+// ID ECC error, ID address mark not found, seek error and record
+// not found, plus others.
+//
+// The controller now expects 255 blocks of data from the host
+// adapter to follow. These will be written onto the disk, starting
+// at logical block 0 and continuing to 254.
+uint8_t scsiCommandWrite6(void)
+{
+	uint32_t logicalBlockAddress = 0;
+	uint32_t numberOfBlocks = 0;
+	
+	if (debugFlag_scsiCommands)
+	{
+		debugString_P(PSTR("SCSI Commands: WRITE command (0x0A) received\r\n"));
+		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, false);
+	}
+	
+	// Note: The command table auto-starts the target LUN
+	
+	// Get the starting logical block address from the CDB
+	logicalBlockAddress = (((uint32_t)commandDataBlock.data[1] & 0x1F) << 16) |
+	((uint32_t)commandDataBlock.data[2] << 8) |
+	((uint32_t)commandDataBlock.data[3]);
+	
+	// Get the requested number of blocks from the CDB
+	numberOfBlocks = (uint32_t)commandDataBlock.data[4];
+	if (numberOfBlocks == 0) numberOfBlocks = 256;  // 0 = 256 blocks according to the SCSI specification
 	
-	// Open the required LUN image for reading
-	if(!filesystemOpenLunForRead(commandDataBlock.targetLUN, logicalBlockAddress, numberOfBlocks))
+	// Show the command debug information
+	if(debugFlag_scsiCommands)
+	{
+		debugStringInt32_P(PSTR(", LBA = "), logicalBlockAddress, false);
+		debugStringInt32_P(PSTR(", Blocks = "), numberOfBlocks, true);	
+	}
+	
+	// Check the requested blocks are inside the LUN image
+	if(!scsiCheckBlockRange(logicalBlockAddress, numberOfBlocks)) return SCSI_STATUS;
+	
+	// Transfer the blocks
+	return scsiWriteBlocks(logicalBlockAddress, numberOfBlocks, false);
+}
+
+// Function to transfer blocks from a LUN image to the host (READ(6) and READ(10))
+// Note: The transfer is streamed block by block, so there is no limit on the number of blocks
+uint8_t scsiReadBlocks(uint32_t logicalBlockAddress, uint32_t numberOfBlocks)
+{
+	uint32_t currentBlock = 0;
+	uint8_t *sector;
+	
+	uint16_t bytesTransferred = 0;
+	
+	// Set up the control signals ready for the data in phase (a queued command is
+	// dispatched disconnected and reselects once the first block is read)
+	if(commandDataBlock.connected) scsiInformationTransferPhase(ITPHASE_DATAIN);
+	
+	// A suspended command resumes from the first block the initiator has not received
+	if(commandDataBlock.queueEntry != NULL) currentBlock = commandDataBlock.queueEntry->blocksTransferred;
+	
+	// Open the required LUN image for reading (including any adjacent queued reads, so
+	// the read-ahead is not cut short at the end of this command)
+	if(!filesystemOpenLunForRead(commandDataBlock.targetLUN, logicalBlockAddress + currentBlock,
+		numberOfBlocks - currentBlock + scsiQueueAdjacentBlocks(commandDataBlock.targetLUN, logicalBlockAddress + numberOfBlocks)))
 	{
 		// Opening the LUN image failed... try to recover with a little grace...
 		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: ERROR: Open LUN image failed!\r\n"));
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x04;  // Drive not ready
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+		scsiCommandError(0x00, 0x04);  // Class 00 error code, 04 Drive not ready
 		
 		// The LUN is in an unknown state... Stop the LUN
 		filesystemCloseLunForRead();
@@ -1120,23 +1656,33 @@ uint8_t scsiCommandRead6(void)
 
 	// Transfer the requested blocks from the LUN image to the host
 	if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Transferring requested blocks to the host...\r\n"));
-	for (currentBlock = 0; currentBlock < numberOfBlocks; currentBlock++)
+	for (; currentBlock < numberOfBlocks; currentBlock++)
 	{
-
+		// Disconnect from the bus while the card is busy (if allowed by the initiator)
+		if(commandDataBlock.connected && commandDataBlock.disconnectPrivilege && filesystemReadSectorsPending() >= SCSI_DISCONNECT_SECTORS)
+			scsiDisconnect();
+		
+		sector = filesystemAcquireReadSector();
+		
+		// Reconnect for the data in phase (if that fails the command is kept and resumed
+		// from this block once any selection that got in first has been served)
+		if(!commandDataBlock.connected)
+		{
+			if(!scsiReselect())
+			{
+				filesystemCloseLunForRead();
+				scsiQueueSuspendCommand(currentBlock);
+				return SCSI_BUSFREE;
+			}
+			scsiInformationTransferPhase(ITPHASE_DATAIN);
+		}
+		
 		// Read the requested block from the LUN image
-		if(!filesystemReadNextSector(scsiSectorBuffer))
+		if(sector == NULL)
 		{
 			// Reading from the LUN image failed... try to recover with a little grace...
 			if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: ERROR: Could not read next sector from LUN image!\r\n"));
-			commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-			commandDataBlock.message = 0x00;
-			
-			// Set request sense error globals
-			requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-			requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-			requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-			requestSenseData[commandDataBlock.targetLUN].errorCode = 0x04;  // Drive not ready
-			requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+			scsiCommandError(0x00, 0x04);  // Class 00 error code, 04 Drive not ready
 			
 			// The LUN is in an unknown state... Stop the LUN
 			filesystemCloseLunForRead();
@@ -1145,20 +1691,13 @@ uint8_t scsiCommandRead6(void)
 			return SCSI_STATUS;
 		}
 		
-		// Send the data to the host
-		//cli();
-		__disable_irq();
-		
-		bytesTransferred = hostadapterPerformReadDMA(scsiSectorBuffer);
-		
-		__enable_irq();
-	
+		// Send the data to the host (straight from the read-ahead window)
+		bytesTransferred = hostadapterTransferIn(sector, SECTOR_SIZE);
+		filesystemReleaseReadSector();
 		
 		// Check for a host reset condition
 		if(hostadapterReadResetFlag())
 		{
-			//sei();
-			__enable_irq();
 			if (debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Read DMA interrupted by host reset at byte #"), bytesTransferred, true);
 			
 			// Close the currently open LUN image
@@ -1178,7 +1717,7 @@ uint8_t scsiCommandRead6(void)
 			if (debugFlag_scsiBlocks)
 			{
 				debugStringInt32_P(PSTR("Hex dump for block #"), currentBlock, true);
-				debugSectorBufferHex(scsiSectorBuffer, 256);
+				debugSectorBufferHex(sector, 256);
 			}
 		}
 	}
@@ -1190,105 +1729,41 @@ uint8_t scsiCommandRead6(void)
 	// Indicate successful transfer in status and message
 	commandDataBlock.status = 0x00;  // 0x00 = Good
 	commandDataBlock.message = 0x00;
-	if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Read6 command successful\r\n"));
+	if (debugFlag_scsiCommands) debugStringInt8Hex_P(PSTR("SCSI Commands: READ command successful, opcode = "), commandDataBlock.data[0], true);
 	
 	// Transition to the successful state
 	return SCSI_STATUS;
 }
 
-// SCSI Command (0x0A) Write6
-//
-// Adaptec ACB-4000 Manual notes:
-// The WRITE command is used to write data from the host to the
-// disk.
-//
-// A COMPLETION STATUS may give a check condition that leads to the
-// possible errors of: Bad argument, all class 00 errors,
-// ID ECC error, ID address mark not found, seek error and record
-// not found, plus others.
-//
-// The controller now expects 255 blocks of data from the host
-// adapter to follow. These will be written onto the disk, starting
-// at logical block 0 and continuing to 254.
-uint8_t scsiCommandWrite6(void)
+// Function to transfer blocks from the host to a LUN image (WRITE(6) and WRITE(10))
+// Note: The transfer is streamed block by block, so there is no limit on the number of blocks.
+// The blocks go into the write-back cache, which is drained to the card while the host
+// is still sending; without write caching (or with FUA) the status waits for the card.
+uint8_t scsiWriteBlocks(uint32_t logicalBlockAddress, uint32_t numberOfBlocks, bool forceUnitAccess)
 {
-	uint32_t logicalBlockAddress = 0;
-	uint32_t numberOfBlocks = 0;
 	uint32_t currentBlock = 0;
+	uint8_t *sector;
 	
 	uint16_t bytesTransferred = 0;
 	
-	if (debugFlag_scsiCommands)
-	{
-		debugString_P(PSTR("SCSI Commands: WRITE command (0x0A) received\r\n"));
-		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, false);
-	}
+	// A suspended command resumes from the first block the initiator has not sent
+	if(commandDataBlock.queueEntry != NULL) currentBlock = commandDataBlock.queueEntry->blocksTransferred;
 	
-	// Make sure the target LUN is started
-	if(!filesystemReadLunStatus(commandDataBlock.targetLUN))
+	// Reconnect to the initiator (queued command) then set up the control signals
+	// ready for the data out phase
+	if(!commandDataBlock.connected && !scsiReselect())
 	{
-		// Target LUN is not started.  If the LUN is present, then start it, otherwise
-		// return an error.  Note: The original Adaptec SCSI host adapter would always
-		// auto-start a LUN if it was present, so we duplicate that behavior here even
-		// though it is 'more correct' (according to the specs) to return with error
-		
-		// Is the requested LUN available?
-		if(debugFlag_scsiCommands) debugString_P(PSTR("\r\nSCSI Commands: Attempting to Auto-Start LUN (as it is currently STOPped)\r\n"));
-		
-		// Auto-start the LUN
-		if(!filesystemSetLunStatus(commandDataBlock.targetLUN, true))
-		{
-			// Could not start LUN... return with error status
-			if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Could not auto-start LUN #"), commandDataBlock.targetLUN, true);
-			commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-			commandDataBlock.message = 0x00;
-			
-			// Set request sense error globals
-			requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-			requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-			requestSenseData[commandDataBlock.targetLUN].errorClass = 0x02;  // Class 02 error code
-			requestSenseData[commandDataBlock.targetLUN].errorCode = 0x1C;  // 1C Bad format
-			requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
-			
-			return SCSI_STATUS;
-		}
-		
-		if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Requested LUN has been auto-started\r\n"));
+		scsiQueueSuspendCommand(currentBlock);
+		return SCSI_BUSFREE;
 	}
-	
-	// Get the starting logical block address from the CDB
-	logicalBlockAddress = (((uint32_t)commandDataBlock.data[1] & 0x1F) << 16) |
-	((uint32_t)commandDataBlock.data[2] << 8) |
-	((uint32_t)commandDataBlock.data[3]);
-	
-	// Get the requested number of blocks from the CDB
-	numberOfBlocks = (uint32_t)commandDataBlock.data[4];
-	if (numberOfBlocks == 0) numberOfBlocks = 256;  // 0 = 256 blocks according to the SCSI specification
-	
-	// Show the command debug information
-	if(debugFlag_scsiCommands)
-	{
-		debugStringInt32_P(PSTR(", LBA = "), logicalBlockAddress, false);
-		debugStringInt32_P(PSTR(", Blocks = "), numberOfBlocks, true);	
-	}
-	
-	// Set up the control signals ready for the data out phase
 	scsiInformationTransferPhase(ITPHASE_DATAOUT);
 	
 	// Open the required LUN image for writing
-	if(!filesystemOpenLunForWrite(commandDataBlock.targetLUN, logicalBlockAddress, numberOfBlocks))
+	if(!filesystemOpenLunForWrite(commandDataBlock.targetLUN, logicalBlockAddress + currentBlock, numberOfBlocks - currentBlock))
 	{
 		// Opening the LUN image failed... try to recover with a little grace...
 		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Command: ERROR: Could not open LUN image for writing!\r\n"));
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x04;  // Drive not ready
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+		scsiCommandError(0x00, 0x04);  // Class 00 error code, 04 Drive not ready
 		
 		// The LUN is in an unknown state... Stop the LUN
 		filesystemCloseLunForWrite();
@@ -1299,40 +1774,34 @@ uint8_t scsiCommandWrite6(void)
 	
 	// Transfer the requested blocks from the host to the LUN image
 	if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Transferring requested blocks from the host...\r\n"));
-	for (currentBlock = 0; currentBlock < numberOfBlocks; currentBlock++)
+	for (; currentBlock < numberOfBlocks; currentBlock++)
 	{
-		// Get the data from the host
-		//cli();
-		__disable_irq();
-		bytesTransferred = hostadapterPerformWriteDMA(scsiSectorBuffer);
-		//sei();
-		__enable_irq();
+		// Disconnect from the bus while the card is busy making room in the write-back
+		// cache (if allowed by the initiator)
+		if(commandDataBlock.disconnectPrivilege && filesystemWriteSectorsPending() >= SCSI_DISCONNECT_SECTORS)
+			scsiDisconnect();
 		
-		// Check for a host reset condition
-		if(hostadapterReadResetFlag())
+		sector = filesystemAcquireWriteSector();
+		
+		// Reconnect for the rest of the data out phase (if that fails the command is kept
+		// and resumed from this block once any selection that got in first has been served)
+		if(!commandDataBlock.connected)
 		{
-			if (debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Write DMA interrupted by host reset at byte #"), bytesTransferred, true);
-			
-			// Close the currently open LUN image
-			filesystemCloseLunForWrite();
-			
-			return SCSI_BUSFREE;
+			if(!scsiReselect())
+			{
+				filesystemCloseLunForWrite();
+				scsiQueueSuspendCommand(currentBlock);
+				return SCSI_BUSFREE;
+			}
+			scsiInformationTransferPhase(ITPHASE_DATAOUT);
 		}
 		
 		// Write the requested block to the LUN image
-		if(!filesystemWriteNextSector(scsiSectorBuffer))
+		if(sector == NULL)
 		{
 			// Writing to the LUN image failed... try to recover with a little grace...
 			if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: ERROR: Writing to LUN image failed!\r\n"));
-			commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-			commandDataBlock.message = 0x00;
-			
-			// Set request sense error globals
-			requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-			requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-			requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-			requestSenseData[commandDataBlock.targetLUN].errorCode = 0x04;  // Drive not ready
-			requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+			scsiCommandError(0x00, 0x04);  // Class 00 error code, 04 Drive not ready
 			
 			// The LUN is in an unknown state... Stop the LUN
 			filesystemCloseLunForWrite();
@@ -1341,6 +1810,21 @@ uint8_t scsiCommandWrite6(void)
 			return SCSI_STATUS;
 		}
 		
+		// Get the data from the host (straight into the write-back cache)
+		bytesTransferred = hostadapterTransferOut(sector, SECTOR_SIZE);
+		
+		// Check for a host reset condition
+		if(hostadapterReadResetFlag())
+		{
+			if (debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Write DMA interrupted by host reset at byte #"), bytesTransferred, true);
+			
+			// Close the currently open LUN image (discarding the partial block)
+			filesystemCloseLunForWrite();
+			
+			return SCSI_BUSFREE;
+		}
+		filesystemReleaseWriteSector();
+		
 		// Show debug
 		if(!debugFlag_scsiBlocks)
 		{
@@ -1352,22 +1836,61 @@ uint8_t scsiCommandWrite6(void)
 			if (debugFlag_scsiBlocks)
 			{
 				debugStringInt32_P(PSTR("Hex dump for block #"), currentBlock, true);
-				debugSectorBufferHex(scsiSectorBuffer, 256);
+				debugSectorBufferHex(sector, 256);
 			}
 		}
 	}
-	if (debugFlag_scsiCommands || debugFlag_scsiBlocks) debugString_P(PSTR("\r\n"));
-	
-	// Close the currently open LUN image
-	filesystemCloseLunForWrite();
-	
-	// Indicate successful transfer in status and message
-	commandDataBlock.status = 0x00;  // 0x00 = Good
-	commandDataBlock.message = 0x00;
-	if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Write6 command successful\r\n"));
+	if (debugFlag_scsiCommands || debugFlag_scsiBlocks) debugString_P(PSTR("\r\n"));
+	
+	// Close the currently open LUN image
+	filesystemCloseLunForWrite();
+	
+	// Write caching disabled (or FUA)?  Write the cached blocks to the card before the
+	// status (disconnecting from the bus if allowed)
+	if(!SCSI_WRITE_CACHE || forceUnitAccess)
+	{
+		if(commandDataBlock.disconnectPrivilege && filesystemFlushSectorsPending() >= SCSI_DISCONNECT_SECTORS)
+			scsiDisconnect();
+		
+		// Note: The status phase reconnects to the initiator
+		if(!filesystemFlushWriteCache())
+		{
+			// Write-back failed... return with error status
+			if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: ERROR: Write-back of cached sectors failed!\r\n"));
+			scsiCommandError(0x00, 0x03);  // Class 00 error code, 03 Write fault
+			return SCSI_STATUS;
+		}
+	}
+	
+	// Indicate successful transfer in status and message
+	commandDataBlock.status = 0x00;  // 0x00 = Good
+	commandDataBlock.message = 0x00;
+	if (debugFlag_scsiCommands) debugStringInt8Hex_P(PSTR("SCSI Commands: WRITE command successful, opcode = "), commandDataBlock.data[0], true);
+	
+	// Transition to the successful state
+	return SCSI_STATUS;
+}
+
+// Function to check that a block range is inside the target LUN image
+// Returns false (with the error status set) if the range is invalid
+bool scsiCheckBlockRange(uint32_t logicalBlockAddress, uint32_t numberOfBlocks)
+{
+	uint32_t lunSizeInBlocks = filesystemGetLunSectorCount(commandDataBlock.targetLUN);
+	
+	if(logicalBlockAddress >= lunSizeInBlocks || numberOfBlocks > lunSizeInBlocks - logicalBlockAddress)
+	{
+		// Out of range
+		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: ERROR: Requested LBA is out-of-range for the LUN size\r\n"));
+		scsiCommandError(0x02, 0x21);  // Class 02 error code, 21 Illegal block address
+		
+		// Report the failing block
+		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = true;
+		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = logicalBlockAddress;
+		
+		return false;
+	}
 	
-	// Transition to the successful state
-	return SCSI_STATUS;
+	return true;
 }
 
 // SCSI Command (0x0B) Seek
@@ -1383,30 +1906,7 @@ uint8_t scsiCommandSeek(void)
 		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, true);
 	}
 	
-	// Check to see if the requested LUN is started
-	if(filesystemReadLunStatus(commandDataBlock.targetLUN))
-	{
-		// Indicate successful command in status and message
-		commandDataBlock.status = 0x00;  // 0x00 = Good
-		commandDataBlock.message = 0x00;
-	}
-	else
-	{
-		// Indicate unsuccessful command in status and message
-		if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Unavailable LUN #"), commandDataBlock.targetLUN, true);
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Failed
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x02;  // Unit not ready
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
-		
-		return SCSI_STATUS;
-	}
-	
+	// The command table ensures the LUN is started, so there is nothing more to check
 	return SCSI_STATUS;
 }
 
@@ -1436,23 +1936,7 @@ uint8_t scsiCommandTranslate(void)
 		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, true);
 	}
 	
-	// Make sure the target LUN is started
-	if(!filesystemReadLunStatus(commandDataBlock.targetLUN))
-	{
-		// LUN unavailable... return with error status
-		if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Unavailable LUN #"), commandDataBlock.targetLUN, true);
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x04;  // Drive not ready
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
-		
-		return SCSI_STATUS;
-	}
+	// Note: The command table ensures the LUN is started
 	
 	// Get the logical block address from the CDB
 	logicalBlockAddress = ((uint32_t)(commandDataBlock.data[1] & 0x1F) << 16) |
@@ -1496,15 +1980,7 @@ uint8_t scsiCommandTranslate(void)
 	if(!filesystemReadLunDescriptor(commandDataBlock.targetLUN, scsiSectorBuffer))
 	{
 		// Unable to read drive descriptor! Exit with error status
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x04;  // Drive not ready
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+		scsiCommandError(0x00, 0x04);  // Class 00 error code, 04 Drive not ready
 	
 		debugString_P(PSTR("SCSI Commands: ERROR: Could not read geometry from LUN descriptor\r\n"));
 		
@@ -1533,16 +2009,18 @@ uint8_t scsiCommandTranslate(void)
 	scsiInformationTransferPhase(ITPHASE_DATAIN);
 	
 	// Send the translation data to the host
-	hostadapterWriteByte((uint8_t)((cylinderNumber & 0xFF0000) >> 16)); 		// Cylinder number MSB
-	hostadapterWriteByte((uint8_t)((cylinderNumber & 0xFF00) >> 8)); 		// Cylinder number
-	hostadapterWriteByte((uint8_t)(cylinderNumber & 0xFF)); 					// Cylinder number LSB
+	scsiSectorBuffer[0] = (uint8_t)((cylinderNumber & 0xFF0000) >> 16); 		// Cylinder number MSB
+	scsiSectorBuffer[1] = (uint8_t)((cylinderNumber & 0xFF00) >> 8); 		// Cylinder number
+	scsiSectorBuffer[2] = (uint8_t)(cylinderNumber & 0xFF); 					// Cylinder number LSB
 	
-	hostadapterWriteByte((uint8_t)headNumber); 								// Head number
+	scsiSectorBuffer[3] = (uint8_t)headNumber; 								// Head number
 	
-	hostadapterWriteByte((uint8_t)((bytesFromIndex & 0xFF000000) >> 24)); 	// Bytes from index MSB
-	hostadapterWriteByte((uint8_t)((bytesFromIndex & 0x00FF0000) >> 16)); 	// Bytes from index
-	hostadapterWriteByte((uint8_t)((bytesFromIndex & 0x0000FF00) >> 8)); 	// Bytes from index
-	hostadapterWriteByte((uint8_t)(bytesFromIndex & 0x000000FF)); 			// Bytes from index LSB
+	scsiSectorBuffer[4] = (uint8_t)((bytesFromIndex & 0xFF000000) >> 24); 	// Bytes from index MSB
+	scsiSectorBuffer[5] = (uint8_t)((bytesFromIndex & 0x00FF0000) >> 16); 	// Bytes from index
+	scsiSectorBuffer[6] = (uint8_t)((bytesFromIndex & 0x0000FF00) >> 8); 	// Bytes from index
+	scsiSectorBuffer[7] = (uint8_t)(bytesFromIndex & 0x000000FF); 			// Bytes from index LSB
+	
+	hostadapterTransferIn(scsiSectorBuffer, 8);
 	
 	// Indicate successful command in status and message
 	commandDataBlock.status = 0x00;  // 0x00 = Good
@@ -1568,8 +2046,6 @@ uint8_t scsiCommandTranslate(void)
 // containing the drive geometry information
 uint8_t scsiCommandModeSelect(void)
 {
-	uint8_t byteCounter;
-
 	if (debugFlag_scsiCommands)
 	{
 		debugString_P(PSTR("SCSI Commands: MODESELECT command (0x15) received\r\n"));
@@ -1585,15 +2061,7 @@ uint8_t scsiCommandModeSelect(void)
 		{
 			// LUN descriptor is unavailable and cannot be created... return with error status
 			if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Create descriptor failed LUN #"), commandDataBlock.targetLUN, true);
-			commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-			commandDataBlock.message = 0x00;
-			
-			// Set request sense error globals
-			requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-			requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-			requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-			requestSenseData[commandDataBlock.targetLUN].errorCode = 0x04;  // Drive not ready
-			requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+			scsiCommandError(0x00, 0x04);  // Class 00 error code, 04 Drive not ready
 			
 			return SCSI_STATUS;
 		}
@@ -1606,15 +2074,7 @@ uint8_t scsiCommandModeSelect(void)
 	{
 		if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Bad Argument error\r\n"));
 		// Indicate unsuccessful command in status and message
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x02;  // Class 02 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x24;  // Bad argument
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+		scsiCommandError(0x02, 0x24);  // Class 02 error code, 24 Bad argument
 		
 		return SCSI_STATUS;
 	}
@@ -1623,8 +2083,7 @@ uint8_t scsiCommandModeSelect(void)
 	scsiInformationTransferPhase(ITPHASE_DATAOUT);
 	
 	// Read the 22 byte descriptor from the host
-	for(byteCounter = 0 ; byteCounter < commandDataBlock.data[4] ; byteCounter++)
-	scsiSectorBuffer[byteCounter] = hostadapterReadByte();
+	hostadapterTransferOut(scsiSectorBuffer, commandDataBlock.data[4]);
 	
 	// Output the geometry to debug
 	// TODO!
@@ -1634,15 +2093,7 @@ uint8_t scsiCommandModeSelect(void)
 	{
 		// Write failed! - Indicate unsuccessful command in status and message
 		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Writing LUN descriptor failed!\r\n"));
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Error
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x04;  // Drive not ready
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+		scsiCommandError(0x00, 0x04);  // Class 00 error code, 04 Drive not ready
 		
 		return SCSI_STATUS;
 	}
@@ -1665,8 +2116,6 @@ uint8_t scsiCommandModeSelect(void)
 // legal command.
 uint8_t scsiCommandModeSense(void)
 {
-	uint8_t byteCounter;
-	
 	if (debugFlag_scsiCommands)
 	{
 		debugString_P(PSTR("SCSI Commands: MODESENSE command (0x1A) received\r\n"));
@@ -1682,15 +2131,7 @@ uint8_t scsiCommandModeSense(void)
 	{
 		if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Bad Argument error\r\n"));
 		// Indicate unsuccessful command in status and message
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x02;  // Class 02 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x24;  // Bad argument
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+		scsiCommandError(0x02, 0x24);  // Class 02 error code, 24 Bad argument
 		
 		return SCSI_STATUS;
 	}
@@ -1705,8 +2146,7 @@ uint8_t scsiCommandModeSense(void)
 		
 		// Transfer the DSC contents
 		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Sending LUN descriptor to host\r\n"));
-		for (byteCounter = 0; byteCounter < 22; byteCounter++)
-			hostadapterWriteByte(scsiSectorBuffer[byteCounter]);
+		hostadapterTransferIn(scsiSectorBuffer, commandDataBlock.data[4]);
 	}
 	else
 	{
@@ -1714,15 +2154,7 @@ uint8_t scsiCommandModeSense(void)
 		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Descriptor read error\r\n"));
 		
 		// Indicate unsuccessful command in status and message
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x02;  // Class 02 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x24;  // Bad argument
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+		scsiCommandError(0x02, 0x24);  // Class 02 error code, 24 Bad argument
 		
 		return SCSI_STATUS;
 	}
@@ -1771,15 +2203,7 @@ uint8_t scsiCommandStartStop(void)
 		{
 			// Could not start LUN... return with error status
 			if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Could not start LUN #"), commandDataBlock.targetLUN, true);
-			commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-			commandDataBlock.message = 0x00;
-			
-			// Set request sense error globals
-			requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-			requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-			requestSenseData[commandDataBlock.targetLUN].errorClass = 0x02;  // Class 02 error code
-			requestSenseData[commandDataBlock.targetLUN].errorCode = 0x24;  // Bad argument
-			requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+			scsiCommandError(0x02, 0x24);  // Class 02 error code, 24 Bad argument
 			
 			return SCSI_STATUS;
 		}
@@ -1793,6 +2217,132 @@ uint8_t scsiCommandStartStop(void)
 	return SCSI_STATUS;
 }
 
+// SCSI Command (0x25) Read Capacity
+//
+// SCSI-2 specification notes:
+// The READ CAPACITY command provides a means for the initiator to request
+// information regarding the capacity of the logical unit.
+//
+// Note: The capacity is the true size of the LUN image (not the geometry from
+// the .dsc file).  The partial medium indicator (PMI) is not supported, so the
+// last block of the LUN image is always returned.
+uint8_t scsiCommandReadCapacity(void)
+{
+	uint32_t lastLogicalBlockAddress;
+	uint32_t blockLength = SECTOR_SIZE;
+	uint8_t capacityData[8];
+	
+	if (debugFlag_scsiCommands)
+	{
+		debugString_P(PSTR("SCSI Commands: READCAPACITY command (0x25) received\r\n"));
+		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, true);
+	}
+	
+	// Note: The command table auto-starts the target LUN
+	lastLogicalBlockAddress = filesystemGetLunSectorCount(commandDataBlock.targetLUN) - 1;
+	if(debugFlag_scsiCommands) debugStringInt32_P(PSTR("SCSI Commands: Last LBA = "), lastLogicalBlockAddress, true);
+	
+	// Set up the control signals ready for the data in phase
+	scsiInformationTransferPhase(ITPHASE_DATAIN);
+	
+	// Send the capacity data to the host
+	capacityData[0] = (uint8_t)((lastLogicalBlockAddress & 0xFF000000) >> 24); 		// Last LBA MSB
+	capacityData[1] = (uint8_t)((lastLogicalBlockAddress & 0x00FF0000) >> 16);
+	capacityData[2] = (uint8_t)((lastLogicalBlockAddress & 0x0000FF00) >> 8);
+	capacityData[3] = (uint8_t)(lastLogicalBlockAddress & 0x000000FF); 				// Last LBA LSB
+	
+	capacityData[4] = (uint8_t)((blockLength & 0xFF000000) >> 24); 					// Block length MSB
+	capacityData[5] = (uint8_t)((blockLength & 0x00FF0000) >> 16);
+	capacityData[6] = (uint8_t)((blockLength & 0x0000FF00) >> 8);
+	capacityData[7] = (uint8_t)(blockLength & 0x000000FF); 							// Block length LSB
+	
+	hostadapterTransferIn(capacityData, sizeof(capacityData));
+	
+	return SCSI_STATUS;
+}
+
+// SCSI Command (0x28) Read10
+//
+// As READ(6), but with a 32-bit LBA and a 16-bit number of blocks (a transfer
+// length of 0 transfers no blocks)
+uint8_t scsiCommandRead10(void)
+{
+	uint32_t logicalBlockAddress = 0;
+	uint32_t numberOfBlocks = 0;
+	
+	if (debugFlag_scsiCommands)
+	{
+		debugString_P(PSTR("SCSI Commands: READ10 command (0x28) received\r\n"));
+		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, false);
+	}
+	
+	// Note: The command table auto-starts the target LUN
+	
+	// Get the starting logical block address and the number of blocks from the CDB
+	logicalBlockAddress =
+		((uint32_t)commandDataBlock.data[2] << 24) |
+		((uint32_t)commandDataBlock.data[3] << 16) |
+		((uint32_t)commandDataBlock.data[4] << 8) |
+		((uint32_t)commandDataBlock.data[5]);
+	numberOfBlocks =
+		((uint32_t)commandDataBlock.data[7] << 8) |
+		((uint32_t)commandDataBlock.data[8]);
+	
+	// Show the command debug information
+	if(debugFlag_scsiCommands) debugStringInt32_P(PSTR(", LBA = "), logicalBlockAddress, false);
+	if (debugFlag_scsiCommands) debugStringInt32_P(PSTR(", Blocks = "), numberOfBlocks, true);
+	
+	// Nothing to transfer?
+	if (numberOfBlocks == 0) return SCSI_STATUS;
+	
+	// Check the requested blocks are inside the LUN image
+	if(!scsiCheckBlockRange(logicalBlockAddress, numberOfBlocks)) return SCSI_STATUS;
+	
+	// Transfer the blocks
+	return scsiReadBlocks(logicalBlockAddress, numberOfBlocks);
+}
+
+// SCSI Command (0x2A) Write10
+//
+// As WRITE(6), but with a 32-bit LBA and a 16-bit number of blocks (a transfer
+// length of 0 transfers no blocks)
+uint8_t scsiCommandWrite10(void)
+{
+	uint32_t logicalBlockAddress = 0;
+	uint32_t numberOfBlocks = 0;
+	
+	if (debugFlag_scsiCommands)
+	{
+		debugString_P(PSTR("SCSI Commands: WRITE10 command (0x2A) received\r\n"));
+		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, false);
+	}
+	
+	// Note: The command table auto-starts the target LUN
+	
+	// Get the starting logical block address and the number of blocks from the CDB
+	logicalBlockAddress =
+		((uint32_t)commandDataBlock.data[2] << 24) |
+		((uint32_t)commandDataBlock.data[3] << 16) |
+		((uint32_t)commandDataBlock.data[4] << 8) |
+		((uint32_t)commandDataBlock.data[5]);
+	numberOfBlocks =
+		((uint32_t)commandDataBlock.data[7] << 8) |
+		((uint32_t)commandDataBlock.data[8]);
+	
+	// Show the command debug information
+	if(debugFlag_scsiCommands) debugStringInt32_P(PSTR(", LBA = "), logicalBlockAddress, false);
+	if (debugFlag_scsiCommands) debugStringInt32_P(PSTR(", Blocks = "), numberOfBlocks, true);
+	
+	// Nothing to transfer?
+	if (numberOfBlocks == 0) return SCSI_STATUS;
+	
+	// Check the requested blocks are inside the LUN image
+	if(!scsiCheckBlockRange(logicalBlockAddress, numberOfBlocks)) return SCSI_STATUS;
+	
+	// Transfer the blocks (byte 1 bit 3 is FUA, force unit access)
+	return scsiWriteBlocks(logicalBlockAddress, numberOfBlocks, (commandDataBlock.data[1] & 0x08) != 0);
+}
+
 // SCSI Command (0x2F) Verify
 //
 // Adaptec ACB-4000 Manual notes:
@@ -1820,16 +2370,7 @@ uint8_t scsiCommandVerify(void)
 		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, false);
 	}
 	
-	// Make sure the target LUN is started
-	if(!filesystemReadLunStatus(commandDataBlock.targetLUN))
-	{
-		// LUN unavailable... return with error status
-		if(debugFlag_scsiCommands) debugStringInt16_P(PSTR("\r\nSCSI Commands: Unavailable LUN #"), commandDataBlock.targetLUN, true);
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-		commandDataBlock.message = 0x00;
-		
-		return SCSI_STATUS;
-	}
+	// Note: The command table ensures the LUN is started
 	
 	// Get the logical block address from the CDB (note: this is different from G0 commands
 	// as 4 bytes of LBA are provided)
@@ -1867,15 +2408,7 @@ uint8_t scsiCommandVerify(void)
 		// DSC not OK
 		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: DSC read error\r\n"));
 		// Indicate unsuccessful command in status and message
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-		commandDataBlock.message = 0x00;
-		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = false;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x00;  // Class 00 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x04;  // Drive not ready
-		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = 0x00;
+		scsiCommandError(0x00, 0x04);  // Class 00 error code, 04 Drive not ready
 		
 		return SCSI_STATUS;
 	}
@@ -1887,14 +2420,10 @@ uint8_t scsiCommandVerify(void)
 		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: ERROR: Requested LBA is out-of-range for the LUN size - Verify failed\r\n"));
 		
 		// Set error status
-		commandDataBlock.status = (commandDataBlock.targetLUN << 5) | 0x02;  // 0x02 = Bad
-		commandDataBlock.message = 0x00;
+		scsiCommandError(0x02, 0x21);  // Class 02 error code, 21 Illegal block address
 		
-		// Set request sense error globals
-		requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
+		// Report the failing block
 		requestSenseData[commandDataBlock.targetLUN].validAddressFlag = true;
-		requestSenseData[commandDataBlock.targetLUN].errorClass = 0x02;  // Class 02 error code
-		requestSenseData[commandDataBlock.targetLUN].errorCode = 0x21;  // Illegal block address
 		requestSenseData[commandDataBlock.targetLUN].logicalBlockAddress = logicalBlockAddress;
 		
 		return SCSI_STATUS;
@@ -1911,92 +2440,281 @@ uint8_t scsiCommandVerify(void)
 	return SCSI_STATUS;
 }
 
+// SCSI Command (0x35) Synchronize Cache
+//
+// SCSI-2 specification notes:
+// The SYNCHRONIZE CACHE command ensures that logical blocks in the cache
+// memory, within the specified range, have their most recent data value
+// recorded on the physical medium.
+//
+// Note: The whole write-back cache is written to the card regardless of the
+// requested range.  Write-back failures since the last flush (for example from
+// an idle write-back) are reported here.
+uint8_t scsiCommandSynchronizeCache(void)
+{
+	bool flushSuccess;
+	
+	if (debugFlag_scsiCommands)
+	{
+		debugString_P(PSTR("SCSI Commands: SYNCHRONIZECACHE command (0x35) received\r\n"));
+		debugStringInt16_P(PSTR("SCSI Commands: Target LUN = "), commandDataBlock.targetLUN, true);
+	}
+	
+	// Note: The command table ensures the LUN is started
+	
+	// Write the cached sectors to the card (disconnecting from the bus if allowed)
+	if(commandDataBlock.disconnectPrivilege && filesystemFlushSectorsPending() >= SCSI_DISCONNECT_SECTORS)
+		scsiDisconnect();
+	
+	flushSuccess = filesystemFlushWriteCache();
+	
+	// Note: The status phase reconnects to the initiator
+	
+	if(!flushSuccess)
+	{
+		// Write-back failed... return with error status
+		if(debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: ERROR: Write-back of cached sectors failed!\r\n"));
+		scsiCommandError(0x00, 0x03);  // Class 00 error code, 03 Write fault
+		return SCSI_STATUS;
+	}
+	
+	// Indicate successful command in status and message
+	commandDataBlock.status = 0x00;  // 0x00 = Good
+	commandDataBlock.message = 0x00;
+	
+	return SCSI_STATUS;
+}
+
 // Determine whether we're the selected device or not...
 uint8_t scsiCommandSelect(void)
 {
-	if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Select\r\n"));
+	// The ID mask was latched by the SEL interrupt after the bus settle delay (the
+	// interrupt only latches selections carrying our ID)
+	uint8_t mask = hostadapterReadSelectionMask();
+	
+	if (debugFlag_scsiCommands)
+	{
+		debugString_P(PSTR("SCSI Commands: Select\r\n"));
+		debugStringInt8Hex_P(PSTR("SCSI Commands: Select mask = "), mask, true);
+	}
 	
-	// Delay 1ms
-	Delayms(1);
+	// Reset the nexus (set by the IDENTIFY and queue tag messages)
+	commandDataBlock.identified = false;
+	commandDataBlock.disconnectPrivilege = false;
+	commandDataBlock.tagged = false;
+	commandDataBlock.queueEntry = NULL;
+	
+	// Note the initiator ID (needed for reselection).  Old (SCSI-1 single initiator)
+	// hosts do not place their ID on the bus and can not be reselected.
+	commandDataBlock.initiatorId = 0xFF;
+	mask &= ~(1 << targetId);
+	if (mask != 0 && (mask & (mask - 1)) == 0)
+	{
+		commandDataBlock.initiatorId = 0;
+		while (!(mask & (1 << commandDataBlock.initiatorId))) commandDataBlock.initiatorId++;
+	}
+	scsiApplySyncTransfer();
+	
+	if (debugFlag_scsiCommands) debugString_P(PSTR("SELECTED Me!\r\n"));
+	// We've been selected!
+	// BSY was asserted by the SEL interrupt - it must happen within 200us
+	// (Selection abort time) of seeing our ID + SEL.
+	// (Note: the initiator will be waiting the "Selection time-out delay"
+	// for our BSY response, which is actually a very generous 250ms)
+	hostadapterWriteBusyFlag(true);
+	commandDataBlock.connected = true;
+	latencyStamp(LATENCY_STAMP_SELECTION);
+	TRACE(TRACE_SCSI_SELECTED, commandDataBlock.initiatorId, 0, 0);
 	
-	uint8_t mask = hostadapterReadDatabus();
-	debugStringInt8Hex_P("SELECT MASK: ", mask, true);
-	bool selected = false;
-	if (mask & (1 << targetId))
-		selected = true;
+	uint32_t selTimerBegin = HAL_GetTick();
 	
-	if (selected)
+	while (!hostadapterReadResetFlag()) 
 	{
-		if (debugFlag_scsiCommands) debugString_P(PSTR("SELECTED Me!\r\n"));
-		// We've been selected!
-		// Assert BSY - Selection success!
-		// must happen within 200us (Selection abort time) of seeing our
-		// ID + SEL.
-		// (Note: the initiator will be waiting the "Selection time-out delay"
-		// for our BSY response, which is actually a very generous 250ms)
-		hostadapterWriteBusyFlag(true);
-		
-		uint32_t selTimerBegin = HAL_GetTick();
-		
-		while (!hostadapterReadResetFlag()) 
+		if (!hostadapterReadSelectFlag())			
+			break;
+		else if ((HAL_GetTick() - selTimerBegin) >= 250)
 		{
-			if (!hostadapterReadSelectFlag())			
-				break;
-			else if ((HAL_GetTick() - selTimerBegin) >= 250)
-			{
-				// clear busy
-				hostadapterWriteBusyFlag(false);
-				hostadapterWriteResetFlag(true);
-			}
+			// clear busy
+			hostadapterWriteBusyFlag(false);
+			hostadapterWriteResetFlag(true);
 		}
-	
-		
-		selFlag = false;
-		return SCSI_COMMAND;
 	}
-	else 
+	
+	selFlag = false;
+	
+	// Initiator wants to send a message (IDENTIFY)?
+	if (hostadapterReadAttentionFlag()) return SCSI_MESSAGEOUT;
+	
+	return SCSI_COMMAND;
+}
+
+// Function to build the vendor SD card interface page (INQUIRY page 0xC0)
+static void scsiBuildCardInterfacePage(uint8_t *buffer)
+{
+	uint32_t busMode[3];
+	
+	memset(buffer, 0, CARD_INTERFACE_PAGE_LENGTH);
+	buffer[1] = 0xC0;  // Page code
+	buffer[3] = CARD_INTERFACE_PAGE_LENGTH - 4;  // Page length
+	
+	if (filesystemReadCardBusMode(busMode))
 	{
-		selFlag = false;
-		return SCSI_BUSBUSY;
-		//return SCSI_BUSFREE;
+		buffer[4] = (uint8_t)busMode[0];
+		buffer[5] = (uint8_t)busMode[2];
+		buffer[6] = (uint8_t)(busMode[1] >> 24);
+		buffer[7] = (uint8_t)(busMode[1] >> 16);
+		buffer[8] = (uint8_t)(busMode[1] >> 8);
+		buffer[9] = (uint8_t)busMode[1];
 	}
-	
 }
 
 uint8_t scsiCommandInquiry(void)
 {
-	if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: Inquiry"));
+	const uint8_t *response;
+	uint16_t responseLength;
+	
+	if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: INQUIRY command (0x12) received\r\n"));
 	
 	uint8_t evpd = commandDataBlock.data[1] & 1; // enable vital product data
 	uint8_t pageCode = commandDataBlock.data[2];
-	uint32_t allocationLength = commandDataBlock.data[4];
+	uint16_t allocationLength = commandDataBlock.data[4];
 	
-	// assume scsi 1 emulation
-	allocationLength = 256;
-	
-	if (!evpd) // no vital
+	if (!evpd)
+	{
+		// The page code is only valid for vital product data
+		if (pageCode)
 		{
-			if (pageCode)
-			{
-				// error.
-				requestSenseData[commandDataBlock.targetLUN].errorFlag = true;
-				requestSenseData[commandDataBlock.targetLUN].validAddressFlag = true;
-				requestSenseData[commandDataBlock.targetLUN].errorClass = 0x02;     // Class 02 error code
-				requestSenseData[commandDataBlock.targetLUN].errorCode = 0x21;     // Illegal block address
-			
-				return SCSI_STATUS;
-			}
-			else
-			{
-			
-				memcpy(scsiSectorBuffer, StandardResponse, sizeof(StandardResponse));
-			
-				scsiInformationTransferPhase(ITPHASE_DATAIN);
+			scsiCommandError(0x02, 0x24);  // Class 02 error code, 24 Bad argument
+			return SCSI_STATUS;
+		}
+		
+		// Standard response followed by the identification strings (36 bytes)
+		memcpy(scsiSectorBuffer, StandardResponse, sizeof(StandardResponse));
+		memcpy(scsiSectorBuffer + sizeof(StandardResponse), InquiryIdentification, sizeof(InquiryIdentification) - 1);
+		response = scsiSectorBuffer;
+		responseLength = sizeof(StandardResponse) + sizeof(InquiryIdentification) - 1;
+	}
+	else
+	{
+		switch (pageCode)
+		{
+			case 0x00: response = SupportedVitalPages; responseLength = sizeof(SupportedVitalPages); break;
+			case 0x80: response = UnitSerialNumber; responseLength = sizeof(UnitSerialNumber); break;
+			case 0x81: response = ImpOperatingDefinition; responseLength = sizeof(ImpOperatingDefinition); break;
+			case 0x82: response = AscImpOperatingDefinition; responseLength = sizeof(AscImpOperatingDefinition); break;
 			
-				hostadapterPerformWriteDMA(scsiSectorBuffer);
+			case 0xC0:
+				scsiBuildCardInterfacePage(scsiSectorBuffer);
+				response = scsiSectorBuffer;
+				responseLength = CARD_INTERFACE_PAGE_LENGTH;
+				break;
 			
-			}
+			default:
+				if (debugFlag_scsiCommands) debugStringInt16_P(PSTR("SCSI Commands: Unsupported vital product data page "), pageCode, true);
+				scsiCommandError(0x02, 0x24);  // Class 02 error code, 24 Bad argument
+				return SCSI_STATUS;
+		}
+	}
+	
+	// The reply is truncated to the allocation length
+	if (responseLength > allocationLength) responseLength = allocationLength;
+	
+	scsiInformationTransferPhase(ITPHASE_DATAIN);
+	hostadapterTransferIn(response, responseLength);
+	
+	// Indicate successful command in status and message
+	commandDataBlock.status = 0x00;  // 0x00 = Good
+	commandDataBlock.message = 0x00;
+	
+	return SCSI_STATUS;
+}
+
+// SCSI Command READ LATENCY (vendor specific, group 6)
+// Returns the command latency histograms (see latency.h for the report layout).  CDB
+// bytes 3-4 are the allocation length and byte 1 bit 0 clears the histograms once
+// they have been sent.
+uint8_t scsiCommandReadLatency(void)
+{
+	uint16_t allocationLength = ((uint16_t)commandDataBlock.data[3] << 8) | commandDataBlock.data[4];
+	uint16_t responseLength = LATENCY_REPORT_LENGTH;
+	uint16_t responseOffset = 0;
+	uint16_t blockLength;
+	
+	if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: READ LATENCY command (0xD8) received\r\n"));
+	
+	// The reply is truncated to the allocation length
+	if (responseLength > allocationLength) responseLength = allocationLength;
+	
+	// Send the report a sector buffer at a time
+	scsiInformationTransferPhase(ITPHASE_DATAIN);
+	while (responseOffset < responseLength)
+	{
+		blockLength = responseLength - responseOffset;
+		if (blockLength > SECTOR_SIZE) blockLength = SECTOR_SIZE;
 		
-			return SCSI_STATUS;
+		latencyReadReport(scsiSectorBuffer, responseOffset, blockLength);
+		hostadapterTransferIn(scsiSectorBuffer, blockLength);
+		if(hostadapterReadResetFlag()) return SCSI_BUSFREE;
+		
+		responseOffset += blockLength;
+	}
+	
+	if (commandDataBlock.data[1] & 0x01) latencyClear();
+	
+	// Indicate successful command in status and message
+	commandDataBlock.status = 0x00;  // 0x00 = Good
+	commandDataBlock.message = 0x00;
+	
+	return SCSI_STATUS;
+}
+
+// SCSI Command READ TRACE (vendor specific, group 6)
+// Returns the event trace, oldest event first (see trace.h for the report layout).  CDB
+// bytes 3-4 are the allocation length.  Byte 1 controls the trace once it has been
+// sent: bit 0 clears it, bit 1 starts tracing and bit 2 stops tracing.
+uint8_t scsiCommandReadTrace(void)
+{
+	uint16_t allocationLength = ((uint16_t)commandDataBlock.data[3] << 8) | commandDataBlock.data[4];
+	uint16_t responseLength;
+	uint16_t responseOffset = 0;
+	uint16_t blockLength;
+	bool traceWasEnabled = traceEnabled;
+	
+	if (debugFlag_scsiCommands) debugString_P(PSTR("SCSI Commands: READ TRACE command (0xD9) received\r\n"));
+	
+	// Hold the trace still while it is sent
+	traceEnabled = false;
+	
+	// The reply is truncated to the allocation length
+	responseLength = traceReportLength();
+	if (responseLength > allocationLength) responseLength = allocationLength;
+	
+	// Send the report a sector buffer at a time
+	scsiInformationTransferPhase(ITPHASE_DATAIN);
+	while (responseOffset < responseLength)
+	{
+		blockLength = responseLength - responseOffset;
+		if (blockLength > SECTOR_SIZE) blockLength = SECTOR_SIZE;
+		
+		traceReadReport(scsiSectorBuffer, responseOffset, blockLength);
+		hostadapterTransferIn(scsiSectorBuffer, blockLength);
+		if(hostadapterReadResetFlag())
+		{
+			traceEnabled = traceWasEnabled;
+			return SCSI_BUSFREE;
 		}
-}
\ No newline at end of file
+		
+		responseOffset += blockLength;
+	}
+	
+	if (commandDataBlock.data[1] & 0x01) traceClear();
+	if (commandDataBlock.data[1] & 0x02) traceWasEnabled = true;
+	if (commandDataBlock.data[1] & 0x04) traceWasEnabled = false;
+	traceEnabled = traceWasEnabled;
+	
+	// Indicate successful command in status and message
+	commandDataBlock.status = 0x00;  // 0x00 = Good
+	commandDataBlock.message = 0x00;
+	
+	return SCSI_STATUS;
+}
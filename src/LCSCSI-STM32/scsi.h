@@ -8,24 +8,63 @@
 
 // Extras
 #define SCSI_BUSBUSY	4
-
-
-
-// SCSI emulation command states (Group 0 commands)
-#define SCSI_TESTUNITREADY	10
-#define SCSI_REZEROUNIT		11
-#define SCSI_REQUESTSENSE	12
-#define SCSI_FORMAT			13
-#define SCSI_READ6			14
-#define SCSI_WRITE6			15
-#define SCSI_SEEK			16
-#define SCSI_TRANSLATE		17
-#define SCSI_MODESELECT		18
-#define SCSI_MODESENSE		19
-#define SCSI_STARTSTOP		20
-#define SCSI_VERIFY			21
-#define SCSI_INQUIRY		22
-#define SCSI_SELECT			23
+#define SCSI_SELECT		5
+#define SCSI_MESSAGEOUT	6
+
+// SCSI messages
+#define MESSAGE_COMMAND_COMPLETE	0x00
+#define MESSAGE_EXTENDED			0x01	// Followed by the length, the extended message code and its arguments
+#define MESSAGE_SAVE_DATA_POINTER	0x02
+#define MESSAGE_RESTORE_POINTERS	0x03
+#define MESSAGE_DISCONNECT			0x04
+#define MESSAGE_ABORT				0x06
+#define MESSAGE_MESSAGE_REJECT		0x07
+#define MESSAGE_NOP					0x08
+#define MESSAGE_BUS_DEVICE_RESET	0x0C
+#define MESSAGE_ABORT_TAG			0x0D
+#define MESSAGE_CLEAR_QUEUE			0x0E
+#define MESSAGE_SIMPLE_QUEUE_TAG	0x20	// Queue tag messages are followed by the tag byte
+#define MESSAGE_HEAD_OF_QUEUE_TAG	0x21
+#define MESSAGE_ORDERED_QUEUE_TAG	0x22
+#define MESSAGE_IDENTIFY			0x80	// Bits 0-2 are the LUN
+#define MESSAGE_IDENTIFY_DISCONNECT	0x40	// IDENTIFY: initiator grants the disconnect privilege
+
+// Extended message codes
+#define EXTENDED_SDTR				0x01	// Synchronous data transfer request (period, offset)
+#define EXTENDED_WDTR				0x03	// Wide data transfer request (not supported)
+
+// Disconnect from the bus when a storage operation will transfer at least this many
+// sectors to or from the card (short operations are faster than a reselection)
+#define SCSI_DISCONNECT_SECTORS	4
+
+// Write caching: WRITE returns status once the blocks are in the write-back cache (1)
+// or only after they have been written to the card (0).  WRITE(10) with the FUA bit
+// set always waits for the card.
+#define SCSI_WRITE_CACHE		1
+
+// Number of tagged commands that can be queued for each LUN
+#define SCSI_QUEUE_DEPTH		4
+
+// SCSI command table data phase directions
+#define SCSI_DIRECTION_NONE		0
+#define SCSI_DIRECTION_IN		1	// Target to host
+#define SCSI_DIRECTION_OUT		2	// Host to target
+
+// SCSI command table preamble flags
+#define SCSI_FLAG_STARTED_LUN	0x01	// Target LUN must be started (unit not ready otherwise)
+#define SCSI_FLAG_AUTOSTART_LUN	0x02	// Target LUN is started if it is stopped
+#define SCSI_FLAG_LVDOS			0x04	// Only available in the LV-DOS emulation mode
+#define SCSI_FLAG_QUEUED		0x08	// Block transfer that the command queue may reorder and merge
+#define SCSI_FLAG_NO_MEDIUM		0x10	// Does not access the medium (allowed while commands are queued)
+
+// SCSI command table entry
+struct scsiCommandStruct
+{
+	uint8_t length;				// CDB length in bytes
+	uint8_t direction;			// Data phase direction
+	uint8_t flags;				// Preamble flags
+	uint8_t (*handler)(void);	// Command handler (returns the next SCSI emulation state)
+};
 
 // SCSI Information transfer phases
 #define ITPHASE_DATAOUT		0
@@ -51,6 +90,26 @@ uint8_t scsiEmulationBusFree(void);
 uint8_t scsiEmulationCommand(void);
 uint8_t scsiEmulationStatus(void);
 uint8_t scsiEmulationMessage(void);
+uint8_t scsiEmulationMessageOut(void);
+void scsiReleaseBus(void);
+void scsiDisconnect(void);
+bool scsiReselect(void);
+void scsiSetSyncTransfer(uint8_t period, uint8_t offset);
+void scsiApplySyncTransfer(void);
+uint8_t scsiExecuteCommand(void);
+
+uint8_t scsiQueueCommand(void);
+void scsiQueueSuspendCommand(uint32_t blocksTransferred);
+void scsiQueueSuspendStatus(void);
+uint8_t scsiQueueDispatch(void);
+uint8_t scsiQueueLength(uint8_t lunNumber);
+uint32_t scsiQueueAdjacentBlocks(uint8_t lunNumber, uint32_t logicalBlockAddress);
+void scsiQueueClear(uint8_t lunNumber, uint8_t initiatorId);
+void scsiQueueAbortTag(uint8_t lunNumber, uint8_t initiatorId, uint8_t tag);
+void scsiCommandError(uint8_t errorClass, uint8_t errorCode);
+bool scsiCheckBlockRange(uint32_t logicalBlockAddress, uint32_t numberOfBlocks);
+uint8_t scsiReadBlocks(uint32_t logicalBlockAddress, uint32_t numberOfBlocks);
+uint8_t scsiWriteBlocks(uint32_t logicalBlockAddress, uint32_t numberOfBlocks, bool forceUnitAccess);
 
 uint8_t scsiCommandTestUnitReady(void);
 uint8_t scsiCommandRezeroUnit(void);
@@ -63,11 +122,18 @@ uint8_t scsiCommandTranslate(void);
 uint8_t scsiCommandModeSelect(void);
 uint8_t scsiCommandModeSense(void);
 uint8_t scsiCommandStartStop(void);
+uint8_t scsiCommandReadCapacity(void);
+uint8_t scsiCommandRead10(void);
+uint8_t scsiCommandWrite10(void);
 uint8_t scsiCommandVerify(void);
+uint8_t scsiCommandSynchronizeCache(void);
 
 uint8_t scsiCommandInquiry(void);
 uint8_t scsiCommandSelect(void);
 
+uint8_t scsiCommandReadLatency(void);
+uint8_t scsiCommandReadTrace(void);
+
 
 uint8_t scsiWriteFCode(void);
 uint8_t scsiReadFCode(void);
@@ -218,6 +218,111 @@ DRESULT disk_read (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Start a Background Read or Write of Sector(s)                         */
+/* The SDIO card is read or written with DMA while the caller carries    */
+/* on and the SPI card programs a write while the caller carries on;    */
+/* other drivers transfer at once.  The buffer must not be used until    */
+/* disk_finish() returns.  One background transfer at a time.            */
+/*-----------------------------------------------------------------------*/
+static DRESULT disk_background_result = RES_OK;
+
+DRESULT disk_read_start (
+	BYTE pdrv,		/* Physical drive nmuber (0..) */
+	BYTE *buff,		/* Data buffer to store read data (word aligned) */
+	DWORD sector,	/* Sector address (LBA) */
+	UINT count		/* Number of sectors to read (1..128) */
+)
+{
+	/* Check count */
+	if (!count) {
+		return RES_PARERR;
+	}
+	
+#if FATFS_USE_SDIO == 1
+	if (pdrv == ATA) {
+		return TM_FATFS_SD_SDIO_disk_read_start(buff, sector, count);
+	}
+#elif FATFS_USE_SDIO == 0
+	if (pdrv == ATA) {
+		return TM_FATFS_SD_disk_read_start(buff, sector, count);
+	}
+#endif
+	
+	disk_background_result = disk_read(pdrv, buff, sector, count);
+	return disk_background_result;
+}
+
+DRESULT disk_write_start (
+	BYTE pdrv,			/* Physical drive nmuber (0..) */
+	const BYTE *buff,	/* Data to be written (word aligned) */
+	DWORD sector,		/* Sector address (LBA) */
+	UINT count			/* Number of sectors to write (1..128) */
+)
+{
+	/* Check count */
+	if (!count) {
+		return RES_PARERR;
+	}
+	
+#if FATFS_USE_SDIO == 1
+	if (pdrv == ATA) {
+		return TM_FATFS_SD_SDIO_disk_write_start(buff, sector, count);
+	}
+#elif FATFS_USE_SDIO == 0
+	if (pdrv == ATA) {
+		return TM_FATFS_SD_disk_write_start(buff, sector, count);
+	}
+#endif
+	
+	disk_background_result = disk_write(pdrv, buff, sector, count);
+	return disk_background_result;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Wait for a Background Transfer                                        */
+/*-----------------------------------------------------------------------*/
+DRESULT disk_finish (
+	BYTE pdrv		/* Physical drive nmuber (0..) */
+)
+{
+	DRESULT res;
+	
+#if FATFS_USE_SDIO == 1
+	if (pdrv == ATA) {
+		return TM_FATFS_SD_SDIO_disk_finish();
+	}
+#elif FATFS_USE_SDIO == 0
+	if (pdrv == ATA) {
+		return TM_FATFS_SD_disk_finish();
+	}
+#endif
+	
+	res = disk_background_result;
+	disk_background_result = RES_OK;
+	return res;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Check (without waiting) for a Running Background Transfer             */
+/*-----------------------------------------------------------------------*/
+BYTE disk_busy (
+	BYTE pdrv		/* Physical drive nmuber (0..) */
+)
+{
+#if FATFS_USE_SDIO == 1
+	if (pdrv == ATA) {
+		return TM_FATFS_SD_SDIO_disk_busy();
+	}
+#elif FATFS_USE_SDIO == 0
+	if (pdrv == ATA) {
+		return TM_FATFS_SD_disk_busy();
+	}
+#endif
+	
+	return 0;
+}
+
 /*-----------------------------------------------------------------------*/
 /* Write Sector(s)                                                       */
 /*-----------------------------------------------------------------------*/
@@ -314,3 +419,11 @@ __weak DRESULT TM_FATFS_USBHS_disk_write(const BYTE *buff, DWORD sector, UINT co
 __weak DRESULT TM_FATFS_SDRAM_disk_write(const BYTE *buff, DWORD sector, UINT count) {return (DRESULT)STA_NOINIT;}
 __weak DRESULT TM_FATFS_SPI_FLASH_disk_write(const BYTE *buff, DWORD sector, UINT count) {return (DRESULT)STA_NOINIT;}
 
+__weak DRESULT TM_FATFS_SD_SDIO_disk_read_start(BYTE *buff, DWORD sector, UINT count) {return (DRESULT)STA_NOINIT;}
+__weak DRESULT TM_FATFS_SD_SDIO_disk_write_start(const BYTE *buff, DWORD sector, UINT count) {return (DRESULT)STA_NOINIT;}
+__weak DRESULT TM_FATFS_SD_SDIO_disk_finish(void) {return (DRESULT)STA_NOINIT;}
+__weak uint8_t TM_FATFS_SD_SDIO_disk_busy(void) {return 0;}
+__weak DRESULT TM_FATFS_SD_disk_read_start(BYTE *buff, DWORD sector, UINT count) {return (DRESULT)STA_NOINIT;}
+__weak DRESULT TM_FATFS_SD_disk_write_start(const BYTE *buff, DWORD sector, UINT count) {return (DRESULT)STA_NOINIT;}
+__weak DRESULT TM_FATFS_SD_disk_finish(void) {return (DRESULT)STA_NOINIT;}
+__weak uint8_t TM_FATFS_SD_disk_busy(void) {return 0;}
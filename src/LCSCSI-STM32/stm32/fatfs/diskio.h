@@ -35,6 +35,12 @@ DRESULT disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff);
 
+/* Background transfers (read-ahead and write-back) */
+DRESULT disk_read_start(BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
+DRESULT disk_write_start(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
+DRESULT disk_finish(BYTE pdrv);
+BYTE disk_busy(BYTE pdrv);
+
 /* Driver related functions */
 typedef struct {
 	DSTATUS (*disk_initialize)(void);
@@ -77,12 +83,17 @@ typedef enum {
 #define MMC_GET_CID			12	/* Get CID */
 #define MMC_GET_OCR			13	/* Get OCR */
 #define MMC_GET_SDSTAT		14	/* Get SD status */
+#define MMC_GET_BUSMODE		15	/* Get bus width, clock (kHz) and MMC_BUSMODE_ flags (DWORD[3]) */
 
 /* ATA/CF specific ioctl command */
 #define ATA_GET_REV			20	/* Get F/W revision */
 #define ATA_GET_MODEL		21	/* Get model name */
 #define ATA_GET_SN			22	/* Get serial number */
 
+/* Bus mode flags (MMC_GET_BUSMODE) */
+#define MMC_BUSMODE_HIGHSPEED	0x01	/* CMD6 high-speed timing */
+#define MMC_BUSMODE_FALLBACK	0x02	/* A faster mode failed the start-up probe */
+
 /* MMC card type flags (MMC_GET_TYPE) */
 #define CT_MMC		0x01		/* MMC ver 3 */
 #define CT_SD1		0x02		/* SD ver 1 */
@@ -124,14 +135,22 @@ DRESULT TM_FATFS_SDRAM_disk_ioctl(BYTE cmd, void *buff);
 DRESULT TM_FATFS_SPI_FLASH_disk_ioctl(BYTE cmd, void *buff);
 
 DRESULT TM_FATFS_SD_SDIO_disk_read(BYTE *buff, DWORD sector, UINT count);
+DRESULT TM_FATFS_SD_SDIO_disk_read_start(BYTE *buff, DWORD sector, UINT count);
+DRESULT TM_FATFS_SD_SDIO_disk_finish(void);
+uint8_t TM_FATFS_SD_SDIO_disk_busy(void);
 DRESULT TM_FATFS_SD_disk_read(BYTE *buff, DWORD sector, UINT count);
+DRESULT TM_FATFS_SD_disk_read_start(BYTE *buff, DWORD sector, UINT count);
+DRESULT TM_FATFS_SD_disk_finish(void);
+uint8_t TM_FATFS_SD_disk_busy(void);
 DRESULT TM_FATFS_USBFS_disk_read(BYTE *buff, DWORD sector, UINT count);
 DRESULT TM_FATFS_USBHS_disk_read(BYTE *buff, DWORD sector, UINT count);
 DRESULT TM_FATFS_SDRAM_disk_read(BYTE *buff, DWORD sector, UINT count);
 DRESULT TM_FATFS_SPI_FLASH_disk_read(BYTE *buff, DWORD sector, UINT count);
 
 DRESULT TM_FATFS_SD_SDIO_disk_write(const BYTE *buff, DWORD sector, UINT count);
+DRESULT TM_FATFS_SD_SDIO_disk_write_start(const BYTE *buff, DWORD sector, UINT count);
 DRESULT TM_FATFS_SD_disk_write(const BYTE *buff, DWORD sector, UINT count);
+DRESULT TM_FATFS_SD_disk_write_start(const BYTE *buff, DWORD sector, UINT count);
 DRESULT TM_FATFS_USBFS_disk_write(const BYTE *buff, DWORD sector, UINT count);
 DRESULT TM_FATFS_USBHS_disk_write(const BYTE *buff, DWORD sector, UINT count);
 DRESULT TM_FATFS_SDRAM_disk_write(const BYTE *buff, DWORD sector, UINT count);
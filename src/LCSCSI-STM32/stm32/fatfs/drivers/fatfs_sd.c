@@ -4,6 +4,7 @@
 
 #include "diskio.h"
 #include "fatfs_sd.h"
+#include <string.h>
 
 /* MMC/SD command */
 #define CMD0	(0)			/* GO_IDLE_STATE */
@@ -31,6 +32,30 @@ static volatile DSTATUS TM_FATFS_SD_Stat = STA_NOINIT;	/* Physical drive status
 
 static BYTE TM_FATFS_SD_CardType;			/* Card type flags */
 
+/* SPI clock: 400 kHz while the card initialises, then the fastest step that passes the read test */
+#define SD_INIT_CLOCK			400000
+#define SD_TEST_SECTORS			8			/* Sectors compared by the clock test (from sector 0) */
+#define SD_BUSY_POLL_US			10			/* Interval between card busy polls */
+
+static const uint32_t SD_ClockSteps[] = { 25000000, 12500000, 6000000, 2000000 };
+
+/* Selected clock (see TM_FATFS_SD_disk_ioctl(MMC_GET_BUSMODE)) */
+static DWORD SD_ClockKHz = 0;
+static DWORD SD_BusFlags = 0;
+
+/* Background transfer state (see TM_FATFS_SD_disk_write_start()) */
+static DRESULT SD_BackgroundResult = RES_OK;	/* Sticky until collected by TM_FATFS_SD_disk_finish() */
+static uint8_t SD_ProgramPending = 0;			/* Card may still be programming the last write */
+static uint32_t SD_BusyPollCycles;				/* DWT count at the last busy poll */
+
+#if FATFS_DMA
+/* 0xFF clocked out by the DMA while a block is received */
+static BYTE SD_DummyBlock[SD_BLOCK_SIZE];
+#endif
+
+/* Clock test sector (word aligned for the CRC unit) */
+static uint32_t SD_TestBuffer[SD_BLOCK_SIZE / 4];
+
 /**************************************************************/
 /*                  SDCARD WP AND DETECT                      */
 /**************************************************************/
@@ -61,12 +86,16 @@ static void init_spi (void) {
 	/* Init delay functions */
 	TM_DELAY_Init();
 	
-	/* Init SPI */
+	/* Init SPI (the clock is lowered to SD_INIT_CLOCK before the card is woken) */
 	TM_SPI_Init(FATFS_SPI, FATFS_SPI_PINSPACK);
 #if FATFS_DMA
 	TM_SPI_DMA_Init(FATFS_SPI);
+	memset(SD_DummyBlock, 0xFF, sizeof(SD_DummyBlock));
 #endif
 	
+	/* Hardware CRC unit for the clock test */
+	TM_CRC_Init();
+	
 	/* Set CS high */
 	FATFS_CS_HIGH;
 	
@@ -74,6 +103,39 @@ static void init_spi (void) {
 	Delayms(10);
 }
 
+/* Set the SPI clock to the fastest step at or below frequency, returns the clock in kHz */
+static DWORD set_spi_clock (
+	uint32_t frequency	/* Maximum clock [Hz] */
+)
+{
+	uint16_t prescaler = TM_SPI_GetPrescalerFromMaxFrequency(FATFS_SPI, frequency);
+	uint32_t inputClock = HAL_RCC_GetPCLK1Freq();
+	
+	/* SPI1, SPI4, SPI5 and SPI6 are clocked from APB2 (as in TM_SPI_GetPrescalerFromMaxFrequency()) */
+	if (0
+#ifdef SPI1
+		|| FATFS_SPI == SPI1
+#endif
+#ifdef SPI4
+		|| FATFS_SPI == SPI4
+#endif
+#ifdef SPI5
+		|| FATFS_SPI == SPI5
+#endif
+#ifdef SPI6
+		|| FATFS_SPI == SPI6
+#endif
+	) {
+		inputClock = HAL_RCC_GetPCLK2Freq();
+	}
+	
+	/* Change the baud rate bits while the SPI is idle */
+	while (FATFS_SPI->SR & SPI_SR_BSY);
+	FATFS_SPI->CR1 = (FATFS_SPI->CR1 & ~SPI_CR1_BR) | prescaler;
+	
+	return inputClock / (2UL << (prescaler >> 3)) / 1000;
+}
+
 /* Receive multiple byte */
 static void rcvr_spi_multi (
 	BYTE *buff,		/* Pointer to data buffer */
@@ -81,14 +143,15 @@ static void rcvr_spi_multi (
 )
 {
 	/* Read multiple bytes, send 0xFF as dummy */
+	/* (TM_SPI_DMA_Receive() would clock out an undefined dummy word, the card needs DI held high) */
 #if FATFS_DMA
 	do {
-		TM_SPI_DMA_Receive(FATFS_SPI, buff, btr > 0xFFFF ? 0xFFFF : btr);
+		TM_SPI_DMA_Transmit(FATFS_SPI, SD_DummyBlock, buff, btr > SD_BLOCK_SIZE ? SD_BLOCK_SIZE : btr);
 		while (TM_SPI_DMA_Transmitting(FATFS_SPI));
 		
-		if (btr > 0xFFFF) {
-			btr -= 0xFFFF;
-			buff += 0xFFFF;
+		if (btr > SD_BLOCK_SIZE) {
+			btr -= SD_BLOCK_SIZE;
+			buff += SD_BLOCK_SIZE;
 		} else {
 			btr = 0;
 		}
@@ -137,9 +200,12 @@ static int wait_ready (	/* 1:Ready, 0:Timeout */
 	/* Set down counter */
 	TM_DELAY_SetTime2(wt);
 	
-	do {
-		d = TM_SPI_Send(FATFS_SPI, 0xFF);
-	} while (d != 0xFF && TM_DELAY_Time2());	/* Wait for card goes ready or timeout */
+	/* Poll every SD_BUSY_POLL_US rather than clocking the card continuously */
+	/* Note: This still blocks the caller; only the background write-back */
+	/* (TM_FATFS_SD_disk_busy()) returns to the SCSI side between polls */
+	while ((d = TM_SPI_Send(FATFS_SPI, 0xFF)) != 0xFF && TM_DELAY_Time2()) {
+		Delay(SD_BUSY_POLL_US);
+	}
 	
 	return (d == 0xFF) ? 1 : 0;
 }
@@ -265,6 +331,61 @@ static BYTE send_cmd (		/* Return value: R1 resp (bit7==1:Failed to send) */
 	return res;							/* Return received response */
 }
 
+/*-----------------------------------------------------------------------*/
+/* Step the SPI clock up                                                 */
+/* The test sectors are read at the initialisation clock and then at     */
+/* each step from the fastest down; the first step whose reads match the */
+/* reference CRC (hardware CRC unit) twice in a row is kept.             */
+/*-----------------------------------------------------------------------*/
+static int read_test_crc (	/* 1:OK, 0:Read error */
+	uint32_t *crc		/* CRC-32 of the test sectors */
+)
+{
+	DWORD sector;
+	
+	for (sector = 0; sector < SD_TEST_SECTORS; sector++) {
+		if (TM_FATFS_SD_disk_read((BYTE *)SD_TestBuffer, sector, 1) != RES_OK) {
+			return 0;
+		}
+		*crc = TM_CRC_Calculate32(SD_TestBuffer, SD_BLOCK_SIZE / 4, sector == 0);
+	}
+	
+	return 1;
+}
+
+static void select_clock (void) {
+	uint32_t reference, crc;
+	BYTE step, pass;
+	DWORD clockKHz;
+	
+	/* Reference read at the initialisation clock */
+	if (!read_test_crc(&reference)) {
+		return;
+	}
+	
+	for (step = 0; step < sizeof(SD_ClockSteps) / sizeof(SD_ClockSteps[0]); step++) {
+		clockKHz = set_spi_clock(SD_ClockSteps[step]);
+		
+		for (pass = 0; pass < 2; pass++) {
+			if (!read_test_crc(&crc) || crc != reference) {
+				break;
+			}
+		}
+		
+		if (pass == 2) {
+			SD_ClockKHz = clockKHz;
+			if (step) {
+				SD_BusFlags |= MMC_BUSMODE_FALLBACK;
+			}
+			return;
+		}
+	}
+	
+	/* No step passed, stay at the initialisation clock */
+	SD_ClockKHz = set_spi_clock(SD_INIT_CLOCK);
+	SD_BusFlags |= MMC_BUSMODE_FALLBACK;
+}
+
 void TM_FATFS_InitPins(void) {
 	/* CS pin */
 	TM_GPIO_Init(FATFS_CS_PORT, FATFS_CS_PIN, TM_GPIO_Mode_OUT, TM_GPIO_OType_PP, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Low);
@@ -291,6 +412,12 @@ DSTATUS TM_FATFS_SD_disk_initialize (void) {
 		return STA_NODISK;
 	}
 	
+	/* Wake the card at 400 kHz */
+	SD_ClockKHz = set_spi_clock(SD_INIT_CLOCK);
+	SD_BusFlags = 0;
+	SD_BackgroundResult = RES_OK;
+	SD_ProgramPending = 0;
+	
 	for (n = 10; n; n--) {
 		TM_SPI_Send(FATFS_SPI, 0xFF);
 	}
@@ -327,6 +454,7 @@ DSTATUS TM_FATFS_SD_disk_initialize (void) {
 
 	if (ty) {			/* OK */
 		TM_FATFS_SD_Stat &= ~STA_NOINIT;	/* Clear STA_NOINIT flag */
+		select_clock();						/* Step the clock up */
 	} else {			/* Failed */
 		TM_FATFS_SD_Stat = STA_NOINIT;
 	}
@@ -446,6 +574,80 @@ DRESULT TM_FATFS_SD_disk_write (
 }
 #endif
 
+/*-----------------------------------------------------------------------*/
+/* Background Transfers                                                  */
+/* A write returns once the card has accepted the data; the card         */
+/* programs it while the caller carries on and TM_FATFS_SD_disk_busy()   */
+/* polls it every SD_BUSY_POLL_US.  Reads transfer at once.  A failed   */
+/* start is returned directly (nothing is left to finish); errors found  */
+/* while the card programs are kept for TM_FATFS_SD_disk_finish().       */
+/*-----------------------------------------------------------------------*/
+DRESULT TM_FATFS_SD_disk_read_start (
+	BYTE *buff,		/* Data buffer to store read data */
+	DWORD sector,	/* Sector address (LBA) */
+	UINT count		/* Number of sectors to read (1..128) */
+)
+{
+	return TM_FATFS_SD_disk_read(buff, sector, count);
+}
+
+#if _USE_WRITE
+DRESULT TM_FATFS_SD_disk_write_start (
+	const BYTE *buff,	/* Data to be written */
+	DWORD sector,		/* Sector address (LBA) */
+	UINT count			/* Number of sectors to write (1..128) */
+)
+{
+	DRESULT res = TM_FATFS_SD_disk_write(buff, sector, count);
+	
+	if (res == RES_OK) {
+		SD_ProgramPending = 1;
+		SD_BusyPollCycles = DWT->CYCCNT;
+	}
+	return res;
+}
+#endif
+
+DRESULT TM_FATFS_SD_disk_finish (void) {
+	DRESULT res;
+	
+	/* Wait for the card to finish programming */
+	if (SD_ProgramPending) {
+		SD_ProgramPending = 0;
+		if (select()) {
+			deselect();
+		} else {
+			SD_BackgroundResult = RES_ERROR;
+		}
+	}
+	
+	res = SD_BackgroundResult;
+	SD_BackgroundResult = RES_OK;
+	return res;
+}
+
+uint8_t TM_FATFS_SD_disk_busy (void) {
+	if (!SD_ProgramPending) {
+		return 0;
+	}
+	
+	/* Leave the bus idle between polls */
+	if ((DWT->CYCCNT - SD_BusyPollCycles) < SD_BUSY_POLL_US * (SystemCoreClock / 1000000)) {
+		return 1;
+	}
+	SD_BusyPollCycles = DWT->CYCCNT;
+	
+	/* The card holds DO low while it is programming */
+	FATFS_CS_LOW;
+	TM_SPI_Send(FATFS_SPI, 0xFF);	/* Dummy clock (force DO enabled) */
+	if (TM_SPI_Send(FATFS_SPI, 0xFF) == 0xFF) {
+		SD_ProgramPending = 0;
+	}
+	deselect();
+	
+	return SD_ProgramPending;
+}
+
 /*-----------------------------------------------------------------------*/
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
@@ -527,6 +729,13 @@ DRESULT TM_FATFS_SD_disk_ioctl (
 				res = RES_OK;	/* FatFs does not check result of this command */
 			break;
 
+		case MMC_GET_BUSMODE :		/* Get bus width, clock [kHz] and flags (DWORD[3]) */
+			((DWORD *)buff)[0] = 1;
+			((DWORD *)buff)[1] = SD_ClockKHz;
+			((DWORD *)buff)[2] = SD_BusFlags;
+			res = RES_OK;
+			break;
+
 		default:
 			res = RES_PARERR;
 	}
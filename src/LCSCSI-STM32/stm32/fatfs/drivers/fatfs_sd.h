@@ -16,6 +16,7 @@
 #include "tm_stm32_fatfs.h"
 #include "tm_stm32_spi.h"
 #include "tm_stm32_delay.h"
+#include "tm_stm32_crc.h"
 
 /* DMA for STM32F4xx and STM32F7xx */
 #if defined(STM32F4xx) || defined(STM32F7xx)
@@ -17,6 +17,7 @@
  * |----------------------------------------------------------------------
  */
 #include "fatfs_sd_sdio.h"
+#include <string.h>
 
 uint8_t SDCARD_IsDetected(void);
 
@@ -24,6 +25,53 @@ uint8_t SDCARD_IsDetected(void);
 static volatile DSTATUS Stat = STA_NOINIT;
 static SD_HandleTypeDef uSdHandle;
 
+/* Background (DMA) read/write state */
+#define SD_XFER_IDLE     0
+#define SD_XFER_BUSY     1
+#define SD_XFER_DONE     2
+#define SD_XFER_ERROR    3
+static volatile uint8_t SD_XferState = SD_XFER_IDLE;
+static DRESULT SD_XferResult = RES_OK;
+static void SD_XferWait(void);
+
+/* Bus modes tried by the start-up probe, fastest first (SDIOCLK is 48 MHz) */
+#define SD_SDIOCLK_KHZ          48000
+#define SD_PROBE_READS          4
+typedef struct {
+    uint32_t BusWide;       /* 1-bit or 4-bit data bus */
+    uint32_t ClockBypass;   /* Bypass the divider (SDIO_CK = SDIOCLK) */
+    uint32_t ClockDiv;      /* SDIO_CK = SDIOCLK / (ClockDiv + 2) */
+    uint8_t HighSpeed;      /* Needs the CMD6 high-speed switch */
+    uint8_t Width;          /* Data lines used */
+    uint32_t ClockKHz;      /* Resulting SDIO_CK */
+} SD_BusModeTypeDef;
+
+#if defined(SDIO)
+static const SD_BusModeTypeDef SD_BusModes[] = {
+    { SDIO_BUS_WIDE_4B, SDIO_CLOCK_BYPASS_ENABLE,  0, 1, 4, SD_SDIOCLK_KHZ },
+    { SDIO_BUS_WIDE_4B, SDIO_CLOCK_BYPASS_DISABLE, 0, 0, 4, SD_SDIOCLK_KHZ / 2 },
+    { SDIO_BUS_WIDE_1B, SDIO_CLOCK_BYPASS_ENABLE,  0, 1, 1, SD_SDIOCLK_KHZ },
+    { SDIO_BUS_WIDE_1B, SDIO_CLOCK_BYPASS_DISABLE, 0, 0, 1, SD_SDIOCLK_KHZ / 2 },
+    { SDIO_BUS_WIDE_1B, SDIO_CLOCK_BYPASS_DISABLE, 2, 0, 1, SD_SDIOCLK_KHZ / 4 },
+};
+#else
+static const SD_BusModeTypeDef SD_BusModes[] = {
+    { SDMMC_BUS_WIDE_4B, SDMMC_CLOCK_BYPASS_DISABLE, 0, 0, 4, SD_SDIOCLK_KHZ / 2 },
+    { SDMMC_BUS_WIDE_1B, SDMMC_CLOCK_BYPASS_DISABLE, 0, 0, 1, SD_SDIOCLK_KHZ / 2 },
+    { SDMMC_BUS_WIDE_1B, SDMMC_CLOCK_BYPASS_DISABLE, 2, 0, 1, SD_SDIOCLK_KHZ / 4 },
+};
+#endif
+#define SD_BUS_MODES            (sizeof(SD_BusModes) / sizeof(SD_BusModes[0]))
+
+/* Negotiated bus mode (see TM_FATFS_SD_SDIO_disk_ioctl(MMC_GET_BUSMODE)) */
+static DWORD SD_BusWidth = 0;
+static DWORD SD_ClockKHz = 0;
+static DWORD SD_BusFlags = 0;
+
+/* Reference and probe sectors (word aligned for the DMA) */
+static uint32_t SD_ProbeReference[SD_BLOCK_SIZE / 4];
+static uint32_t SD_ProbeBuffer[SD_BLOCK_SIZE / 4];
+
 /**
   * @}
   */ 
@@ -39,6 +87,230 @@ static SD_HandleTypeDef uSdHandle;
   * @{
   */
 
+/**
+  * @brief  Waits (bounded) for the card to return to the transfer state.
+  * @retval SD status
+  */
+static uint8_t SD_WaitTransferState(void) {
+    uint32_t start = HAL_GetTick();
+    
+    while (HAL_SD_GetCardState(&uSdHandle) != HAL_SD_CARD_TRANSFER) {
+        if ((HAL_GetTick() - start) >= 100) {
+            return MSD_ERROR;
+        }
+    }
+    return MSD_OK;
+}
+
+/**
+  * @brief  Switches the card to high-speed timing with CMD6 (SD 1.10 and later).
+  *         Must be called at a clock of 25 MHz or less.
+  * @retval SD status (MSD_ERROR if the card does not support high speed)
+  */
+static uint8_t SD_SwitchHighSpeed(void) {
+#if defined(SDIO)
+    SDIO_DataInitTypeDef config;
+    uint32_t status[16];
+    uint32_t count = 0;
+    uint32_t start = HAL_GetTick();
+    uint32_t errors;
+    
+    /* Card command class 10 (switch) is required */
+    if ((uSdHandle.SdCard.Class & 0x400) == 0) {
+        return MSD_ERROR;
+    }
+    
+    /* Read the 64 byte switch status returned by CMD6 */
+    if (SDMMC_CmdBlockLength(uSdHandle.Instance, 64) != HAL_SD_ERROR_NONE) {
+        return MSD_ERROR;
+    }
+    config.DataTimeOut   = SDMMC_DATATIMEOUT;
+    config.DataLength    = 64;
+    config.DataBlockSize = SDIO_DATABLOCK_SIZE_64B;
+    config.TransferDir   = SDIO_TRANSFER_DIR_TO_SDIO;
+    config.TransferMode  = SDIO_TRANSFER_MODE_BLOCK;
+    config.DPSM          = SDIO_DPSM_ENABLE;
+    SDIO_ConfigData(uSdHandle.Instance, &config);
+    
+    /* Mode 1 (switch), function group 1 = 1 (high speed), other groups unchanged */
+    if (SDMMC_CmdSwitch(uSdHandle.Instance, 0x80FFFFF1) != HAL_SD_ERROR_NONE) {
+        SDMMC_CmdBlockLength(uSdHandle.Instance, SD_BLOCK_SIZE);
+        return MSD_ERROR;
+    }
+    
+    while (!__HAL_SD_GET_FLAG(&uSdHandle, SDIO_FLAG_RXOVERR | SDIO_FLAG_DCRCFAIL | SDIO_FLAG_DTIMEOUT | SDIO_FLAG_DATAEND)) {
+        if (__HAL_SD_GET_FLAG(&uSdHandle, SDIO_FLAG_RXDAVL) && count < 16) {
+            status[count++] = SDIO_ReadFIFO(uSdHandle.Instance);
+        }
+        if ((HAL_GetTick() - start) >= 100) {
+            break;
+        }
+    }
+    while (__HAL_SD_GET_FLAG(&uSdHandle, SDIO_FLAG_RXDAVL) && count < 16) {
+        status[count++] = SDIO_ReadFIFO(uSdHandle.Instance);
+    }
+    errors = __HAL_SD_GET_FLAG(&uSdHandle, SDIO_FLAG_RXOVERR | SDIO_FLAG_DCRCFAIL | SDIO_FLAG_DTIMEOUT);
+    __HAL_SD_CLEAR_FLAG(&uSdHandle, SDIO_STATIC_FLAGS);
+    
+    if (SDMMC_CmdBlockLength(uSdHandle.Instance, SD_BLOCK_SIZE) != HAL_SD_ERROR_NONE || errors || count != 16) {
+        return MSD_ERROR;
+    }
+    
+    /* Function group 1 result is bits 379:376 (low nibble of status byte 16) */
+    if ((status[4] & 0x0F) != 0x01) {
+        return MSD_ERROR;
+    }
+    
+    /* The new timing applies 8 clocks after the switch status */
+    HAL_Delay(1);
+    return MSD_OK;
+#else
+    return MSD_ERROR;
+#endif
+}
+
+/**
+  * @brief  Configures the bus width and clock of a bus mode.
+  * @retval SD status
+  */
+static uint8_t SD_ConfigBusMode(const SD_BusModeTypeDef *mode) {
+    uSdHandle.Init.ClockBypass = mode->ClockBypass;
+    uSdHandle.Init.ClockDiv    = mode->ClockDiv;
+    
+    /* Sends ACMD6 and applies the new SDIO clock settings */
+    if (HAL_SD_ConfigWideBusOperation(&uSdHandle, mode->BusWide) != HAL_OK) {
+        return MSD_ERROR;
+    }
+    return MSD_OK;
+}
+
+/**
+  * @brief  Reads sector 0 with polled and DMA transfers and compares it with the reference.
+  * @retval SD status
+  */
+static uint8_t SD_ProbeRead(void) {
+    uint32_t read;
+    
+    for (read = 0; read < SD_PROBE_READS; read++) {
+        memset(SD_ProbeBuffer, 0, sizeof(SD_ProbeBuffer));
+        if (read & 1) {
+            if (TM_FATFS_SD_SDIO_disk_read_start((BYTE *)SD_ProbeBuffer, 0, 1) != RES_OK ||
+                TM_FATFS_SD_SDIO_disk_finish() != RES_OK) {
+                return MSD_ERROR;
+            }
+        } else if (HAL_SD_ReadBlocks(&uSdHandle, (uint8_t *)SD_ProbeBuffer, 0, 1, 100) != HAL_OK) {
+            return MSD_ERROR;
+        }
+        if (SD_WaitTransferState() != MSD_OK || memcmp(SD_ProbeBuffer, SD_ProbeReference, sizeof(SD_ProbeBuffer)) != 0) {
+            return MSD_ERROR;
+        }
+    }
+    return MSD_OK;
+}
+
+/**
+  * @brief  Start-up probe: selects the fastest bus mode that reads sector 0
+  *         without CRC errors or timeouts, falling back to narrower and slower
+  *         modes.  The reference copy of sector 0 is read in the slowest mode.
+  * @retval SD status
+  */
+static uint8_t SD_ProbeBusModes(void) {
+    uint32_t index;
+    uint8_t highSpeed = 0;
+    const SD_BusModeTypeDef *mode;
+    
+    SD_BusWidth = 0;
+    SD_ClockKHz = 0;
+    SD_BusFlags = 0;
+    
+    /* Reference read in the slowest mode */
+    mode = &SD_BusModes[SD_BUS_MODES - 1];
+    if (SD_ConfigBusMode(mode) != MSD_OK ||
+        HAL_SD_ReadBlocks(&uSdHandle, (uint8_t *)SD_ProbeReference, 0, 1, 1000) != HAL_OK ||
+        SD_WaitTransferState() != MSD_OK) {
+        return MSD_ERROR;
+    }
+    
+    for (index = 0; index < SD_BUS_MODES; index++) {
+        mode = &SD_BusModes[index];
+        
+#if FATFS_SDIO_4BIT == 0
+        /* Only DAT0 is connected */
+        if (mode->Width != 1) {
+            continue;
+        }
+#endif
+        
+        /* Switch the card to high-speed timing first (once, at a normal clock) */
+        if (mode->HighSpeed && !highSpeed) {
+            if (SD_ConfigBusMode(&SD_BusModes[SD_BUS_MODES - 1]) != MSD_OK || SD_SwitchHighSpeed() != MSD_OK) {
+                SD_BusFlags |= MMC_BUSMODE_FALLBACK;
+                continue;
+            }
+            highSpeed = 1;
+        }
+        
+        if (SD_ConfigBusMode(mode) == MSD_OK && SD_ProbeRead() == MSD_OK) {
+            SD_BusWidth = mode->Width;
+            SD_ClockKHz = mode->ClockKHz;
+            if (mode->HighSpeed) {
+                SD_BusFlags |= MMC_BUSMODE_HIGHSPEED;
+            }
+            return MSD_OK;
+        }
+        
+        /* CRC error or timeout - try the next mode */
+        SD_BusFlags |= MMC_BUSMODE_FALLBACK;
+        SD_WaitTransferState();
+    }
+    
+    return MSD_ERROR;
+}
+
+/**
+  * @brief  Sends ACMD23 (SET_WR_BLK_ERASE_COUNT) so the card can pre-erase the
+  *         blocks of the following multi-block write (CMD25).  The count is
+  *         only a hint: a card that rejects it is still written normally.
+  * @param  NumOfBlocks: Number of blocks about to be written
+  * @retval SD status
+  */
+static uint8_t SD_SetWriteBlockEraseCount(uint32_t NumOfBlocks) {
+#if defined(SDIO)
+    SDIO_CmdInitTypeDef command;
+    uint32_t start = HAL_GetTick();
+    uint32_t errors;
+    
+    /* CMD55 (APP_CMD) with the card's relative address */
+    if (SDMMC_CmdAppCommand(uSdHandle.Instance, uSdHandle.SdCard.RelCardAdd << 16) != HAL_SD_ERROR_NONE) {
+        return MSD_ERROR;
+    }
+    
+    command.Argument         = NumOfBlocks & 0x007FFFFF;
+    command.CmdIndex         = 23;
+    command.Response         = SDIO_RESPONSE_SHORT;
+    command.WaitForInterrupt = SDIO_WAIT_NO;
+    command.CPSM             = SDIO_CPSM_ENABLE;
+    SDIO_SendCommand(uSdHandle.Instance, &command);
+    
+    /* Wait for the R1 response */
+    while (!__HAL_SD_GET_FLAG(&uSdHandle, SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CMDREND | SDIO_FLAG_CTIMEOUT)) {
+        if ((HAL_GetTick() - start) >= 100) {
+            return MSD_ERROR;
+        }
+    }
+    errors = __HAL_SD_GET_FLAG(&uSdHandle, SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CTIMEOUT);
+    __HAL_SD_CLEAR_FLAG(&uSdHandle, SDIO_STATIC_FLAGS);
+    
+    if (errors || SDIO_GetCommandResponse(uSdHandle.Instance) != 23 ||
+        (SDIO_GetResponse(uSdHandle.Instance, SDIO_RESP1) & SDMMC_OCR_ERRORBITS) != 0) {
+        return MSD_ERROR;
+    }
+    return MSD_OK;
+#else
+    return MSD_ERROR;
+#endif
+}
+
 /**
   * @brief  Initializes the SD card device.
   * @retval SD status
@@ -83,26 +355,9 @@ uint8_t BSP_SD_Init(void)
 		SD_state = MSD_ERROR;
 	}
 
-	/* Configure SD Bus width */
+	/* Pick the fastest bus mode that reads the card reliably */
 	if (SD_state == MSD_OK) {
-		/* Enable wide operation */
-#if defined(SDIO_BUS_WIDE_4B)
-#if FATFS_SDIO_4BIT == 1
-		if (HAL_SD_ConfigWideBusOperation(&uSdHandle, SDIO_BUS_WIDE_4B) != HAL_OK) {
-#else
-		if (HAL_SD_ConfigWideBusOperation(&uSdHandle, SDIO_BUS_WIDE_1B) != HAL_OK) {	
-#endif
-#else
-#if FATFS_SDIO_4BIT == 1
-		if (HAL_SD_ConfigWideBusOperation(&uSdHandle, SDMMC_BUS_WIDE_4B) != HAL_OK) {
-#else
-		if (HAL_SD_ConfigWideBusOperation(&uSdHandle, SDMMC_BUS_WIDE_1B) != HAL_OK) {	
-#endif
-#endif
-			SD_state = MSD_ERROR;
-		} else {
-			SD_state = MSD_OK;
-		}
+		SD_state = SD_ProbeBusModes();
 	}
 
 	return  SD_state;
@@ -161,6 +416,10 @@ uint8_t BSP_SD_ReadBlocks(uint32_t *pData, uint64_t sector, uint32_t NumOfBlocks
   * @retval SD status
   */
 uint8_t BSP_SD_WriteBlocks(uint32_t *pData, uint64_t sector, uint32_t NumOfBlocks, uint32_t Timeout) {
+    /* Multi-block writes (CMD25) are preceded by the pre-erase count */
+    if (NumOfBlocks > 1) {
+        SD_SetWriteBlockEraseCount(NumOfBlocks);
+    }
     if (HAL_SD_WriteBlocks(&uSdHandle, (uint8_t *)pData, sector, NumOfBlocks, Timeout) != HAL_OK) {
         return MSD_ERROR;
     } else {
@@ -454,6 +713,7 @@ DRESULT TM_FATFS_SD_SDIO_disk_ioctl(BYTE cmd, void *buff) {
 	if (Stat & STA_NOINIT) {
 		return RES_NOTRDY;
 	}
+	SD_XferWait();
   
 	switch (cmd) {
 		/* Make sure that no pending write process */
@@ -479,6 +739,14 @@ DRESULT TM_FATFS_SD_SDIO_disk_ioctl(BYTE cmd, void *buff) {
 			*(DWORD*)buff = CardInfo.LogBlockSize;
 			break;
 
+		/* Get the bus mode negotiated by the start-up probe (DWORD[3]) */
+		case MMC_GET_BUSMODE :
+			((DWORD *)buff)[0] = SD_BusWidth;
+			((DWORD *)buff)[1] = SD_ClockKHz;
+			((DWORD *)buff)[2] = SD_BusFlags;
+			res = RES_OK;
+			break;
+
 		default:
 			res = RES_PARERR;
 	}
@@ -486,8 +754,112 @@ DRESULT TM_FATFS_SD_SDIO_disk_ioctl(BYTE cmd, void *buff) {
 	return res;
 }
 
+/**
+  * @brief  SD DMA transfer complete and error callbacks (from HAL_SD_IRQHandler).
+  */
+void HAL_SD_RxCpltCallback(SD_HandleTypeDef *hsd) {
+    SD_XferState = SD_XFER_DONE;
+}
+
+void HAL_SD_TxCpltCallback(SD_HandleTypeDef *hsd) {
+    SD_XferState = SD_XFER_DONE;
+}
+
+void HAL_SD_ErrorCallback(SD_HandleTypeDef *hsd) {
+    if (SD_XferState == SD_XFER_BUSY) {
+        SD_XferState = SD_XFER_ERROR;
+    }
+}
+
+/**
+  * @brief  Waits for a background transfer (and the card programming after a
+  *         write) to finish and keeps its result.  Every other card access
+  *         waits here first, so the card is never addressed while a
+  *         background transfer is running.  A failure is kept until it is
+  *         collected by TM_FATFS_SD_SDIO_disk_finish().
+  */
+static void SD_XferWait(void) {
+    uint32_t start = HAL_GetTick();
+    uint32_t timeout = 100000;
+    
+    if (SD_XferState == SD_XFER_IDLE) {
+        return;
+    }
+    
+    while (SD_XferState == SD_XFER_BUSY) {
+        if ((HAL_GetTick() - start) >= 1000) {
+            HAL_SD_Abort(&uSdHandle);
+            SD_XferState = SD_XFER_ERROR;
+        }
+    }
+    
+    if (SD_XferState != SD_XFER_DONE) {
+        SD_XferResult = RES_ERROR;
+    }
+    while (BSP_SD_GetStatus() != MSD_OK) {
+        if (timeout-- == 0) {
+            SD_XferResult = RES_ERROR;
+            break;
+        }
+    }
+    SD_XferState = SD_XFER_IDLE;
+}
+
+/* Start reading sectors into buff with DMA (buff must be word aligned) */
+DRESULT TM_FATFS_SD_SDIO_disk_read_start(BYTE *buff, DWORD sector, UINT count) {
+    SD_XferWait();
+    
+    SD_XferState = SD_XFER_BUSY;
+    if (HAL_SD_ReadBlocks_DMA(&uSdHandle, (uint8_t *)buff, sector, count) != HAL_OK) {
+        SD_XferState = SD_XFER_IDLE;
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+/* Start writing sectors from buff with DMA (buff must be word aligned) */
+DRESULT TM_FATFS_SD_SDIO_disk_write_start(const BYTE *buff, DWORD sector, UINT count) {
+    SD_XferWait();
+    
+    /* Multi-block writes (CMD25) are preceded by the pre-erase count */
+    if (count > 1) {
+        SD_SetWriteBlockEraseCount(count);
+    }
+    
+    SD_XferState = SD_XFER_BUSY;
+    if (HAL_SD_WriteBlocks_DMA(&uSdHandle, (uint8_t *)buff, sector, count) != HAL_OK) {
+        SD_XferState = SD_XFER_IDLE;
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+/* Wait for the transfer started by TM_FATFS_SD_SDIO_disk_read_start() or
+   TM_FATFS_SD_SDIO_disk_write_start() */
+DRESULT TM_FATFS_SD_SDIO_disk_finish(void) {
+    DRESULT res;
+    
+    SD_XferWait();
+    res = SD_XferResult;
+    SD_XferResult = RES_OK;
+    return res;
+}
+
+/* Check (without waiting) if a background transfer or the card programming
+   after it is still running */
+uint8_t TM_FATFS_SD_SDIO_disk_busy(void) {
+    if (SD_XferState == SD_XFER_BUSY) {
+        return 1;
+    }
+    if (SD_XferState != SD_XFER_IDLE && BSP_SD_GetStatus() != MSD_OK) {
+        return 1;
+    }
+    return 0;
+}
+
 DRESULT TM_FATFS_SD_SDIO_disk_read(BYTE *buff, DWORD sector, UINT count) {
     uint32_t timeout = 100000;
+    SD_XferWait();
 	if (BSP_SD_ReadBlocks((uint32_t *)buff, sector, count, 1000) != MSD_OK) {
 		return RES_ERROR;
 	}
@@ -501,6 +873,7 @@ DRESULT TM_FATFS_SD_SDIO_disk_read(BYTE *buff, DWORD sector, UINT count) {
 
 DRESULT TM_FATFS_SD_SDIO_disk_write(const BYTE *buff, DWORD sector, UINT count) {
     uint32_t timeout = 100000;
+    SD_XferWait();
 	if (BSP_SD_WriteBlocks((uint32_t *)buff, sector, count, 1000) != MSD_OK) {
 		return RES_ERROR;
 	}
@@ -36,6 +36,8 @@
 #include "stm32f4xx_it.h"
 
 /* USER CODE BEGIN 0 */
+#include <stdbool.h>
+#include "debug.h"
 
 /* USER CODE END 0 */
 
@@ -45,6 +47,47 @@
 /*            Cortex-M4 Processor Interruption and Exception Handlers         */ 
 /******************************************************************************/
 
+/**
+* @brief This function handles Hard fault interrupt.
+*/
+void HardFault_Handler(void)
+{
+  /* USER CODE BEGIN HardFault_IRQn 0 */
+  // Send the buffered debug output before stopping
+  debugFault("\r\nHard fault\r\n");
+  /* USER CODE END HardFault_IRQn 0 */
+}
+
+/**
+* @brief This function handles Memory management fault.
+*/
+void MemManage_Handler(void)
+{
+  /* USER CODE BEGIN MemoryManagement_IRQn 0 */
+  debugFault("\r\nMemory management fault\r\n");
+  /* USER CODE END MemoryManagement_IRQn 0 */
+}
+
+/**
+* @brief This function handles Pre-fetch fault, memory access fault.
+*/
+void BusFault_Handler(void)
+{
+  /* USER CODE BEGIN BusFault_IRQn 0 */
+  debugFault("\r\nBus fault\r\n");
+  /* USER CODE END BusFault_IRQn 0 */
+}
+
+/**
+* @brief This function handles Undefined instruction or illegal state.
+*/
+void UsageFault_Handler(void)
+{
+  /* USER CODE BEGIN UsageFault_IRQn 0 */
+  debugFault("\r\nUsage fault\r\n");
+  /* USER CODE END UsageFault_IRQn 0 */
+}
+
 /**
 * @brief This function handles System tick timer.
 */
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "trace.h"
+
+// Trace ring entry
+struct traceEntryStruct
+{
+	uint16_t event;
+	uint16_t sequence;
+	uint32_t cycles;
+	uint32_t argument[3];
+};
+
+// Tracing is on by default in debug builds (READ TRACE can start and stop it)
+#ifdef DEBUG
+	volatile bool traceEnabled = true;
+#else
+	volatile bool traceEnabled = false;
+#endif
+
+static struct traceEntryStruct traceRing[TRACE_ENTRIES];
+static uint32_t traceCount;		// Events recorded since the trace was cleared
+
+// Clear the trace
+void traceClear(void)
+{
+	traceCount = 0;
+}
+
+// Record an event
+// Note: Events can be recorded from interrupts, so the slot is claimed and filled with
+// interrupts masked (a few cycles)
+void traceRecord(uint16_t event, uint32_t argument0, uint32_t argument1, uint32_t argument2)
+{
+	struct traceEntryStruct *entry;
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	entry = &traceRing[traceCount & (TRACE_ENTRIES - 1)];
+	entry->event = event;
+	entry->sequence = (uint16_t)traceCount;
+	entry->cycles = DWT->CYCCNT;
+	entry->argument[0] = argument0;
+	entry->argument[1] = argument1;
+	entry->argument[2] = argument2;
+	traceCount++;
+	__set_PRIMASK(primask);
+}
+
+// Return the length of the trace report (only the entries in use are sent)
+uint16_t traceReportLength(void)
+{
+	uint32_t entries = (traceCount < TRACE_ENTRIES) ? traceCount : TRACE_ENTRIES;
+
+	return TRACE_REPORT_HEADER + entries * TRACE_ENTRY_SIZE;
+}
+
+// Return a byte of a big-endian 32-bit value
+static inline uint8_t traceValueByte(uint32_t value, uint8_t byteNumber)
+{
+	return (uint8_t)(value >> (24 - byteNumber * 8));
+}
+
+// Return a byte of the trace report
+static uint8_t traceReportByte(uint16_t offset)
+{
+	uint32_t entries = (traceCount < TRACE_ENTRIES) ? traceCount : TRACE_ENTRIES;
+	const struct traceEntryStruct *entry;
+	uint16_t field;
+
+	if (offset >= TRACE_REPORT_HEADER)
+	{
+		offset -= TRACE_REPORT_HEADER;
+		entry = &traceRing[(traceCount - entries + offset / TRACE_ENTRY_SIZE) & (TRACE_ENTRIES - 1)];
+		field = offset % TRACE_ENTRY_SIZE;
+
+		if (field < 2) return (uint8_t)(entry->event >> (8 - field * 8));
+		if (field < 4) return (uint8_t)(entry->sequence >> (8 - (field - 2) * 8));
+		if (field < 8) return traceValueByte(entry->cycles, field - 4);
+		return traceValueByte(entry->argument[(field - 8) / 4], (field - 8) % 4);
+	}
+
+	switch (offset)
+	{
+		case 0: return TRACE_REPORT_FORMAT;
+		case 1: return TRACE_ENTRY_SIZE;
+		case 2: return (uint8_t)(entries >> 8);
+		case 3: return (uint8_t)entries;
+		case 4: case 5: case 6: case 7: return traceValueByte(SystemCoreClock, offset - 4);
+		case 8: case 9: case 10: case 11: return traceValueByte(traceCount, offset - 8);
+	}
+
+	return 0;
+}
+
+// Copy part of the trace report to a buffer
+// Note: Stop tracing while the report is read, or the entries move under the reader
+void traceReadReport(uint8_t *buffer, uint16_t offset, uint16_t length)
+{
+	uint16_t reportLength = traceReportLength();
+	uint16_t byteCounter;
+
+	for (byteCounter = 0; byteCounter < length; byteCounter++)
+	{
+		buffer[byteCounter] = (offset + byteCounter < reportLength) ? traceReportByte(offset + byteCounter) : 0;
+	}
+}
@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "stm32f4xx.h"
+
+#pragma once
+// Binary event trace
+//
+// Events are recorded into a RAM ring (the oldest are overwritten) as a 16-bit event ID,
+// the DWT cycle count and up to 3 arguments.  Nothing is formatted on the target: the
+// ring is read with the READ TRACE vendor command and decoded on the host
+// (LCSCSI-Host/tracedecode.c turns a capture into a log or a Chrome/Perfetto timeline).
+
+#define TRACE_ENTRIES				256		// Must be a power of 2
+
+// Events (the high byte is the source).  Keep tracedecode.c in step with this list.
+// SCSI emulation (nexus = opcode | LUN << 8 | tag << 16 | tagged << 24)
+#define TRACE_SCSI_SELECTED			0x0100	// Initiator ID (0xFF = unknown)
+#define TRACE_SCSI_COMMAND			0x0101	// Nexus, CDB bytes 1-4, CDB bytes 5-8
+#define TRACE_SCSI_PHASE			0x0102	// Information transfer phase (ITPHASE_xxx)
+#define TRACE_SCSI_STATUS			0x0103	// Status byte
+#define TRACE_SCSI_COMPLETE			0x0104	// Nexus, status byte
+#define TRACE_SCSI_BUS_FREE			0x0105	// Nexus
+#define TRACE_SCSI_QUEUED			0x0106	// Nexus, commands queued
+#define TRACE_SCSI_DISPATCH			0x0107	// Nexus
+#define TRACE_SCSI_RESELECTED		0x0108	// Initiator ID
+#define TRACE_SCSI_RESET			0x0109
+
+// File system (SD card)
+#define TRACE_SD_READ_START			0x0200	// Card sector, sectors, 1 = background
+#define TRACE_SD_READ_DONE			0x0201	// Result (0 = OK)
+#define TRACE_SD_WRITE_START		0x0202	// Card sector (or LUN sector for DAT files), sectors, 1 = background
+#define TRACE_SD_WRITE_DONE			0x0203	// Result (0 = OK)
+
+// Host adapter
+#define TRACE_HOST_SELECTION		0x0300	// Databus ID mask (from the SEL interrupt)
+#define TRACE_HOST_TRANSFER_IN		0x0301	// Bytes, synchronous offset
+#define TRACE_HOST_TRANSFER_OUT		0x0302	// Bytes, synchronous offset
+#define TRACE_HOST_TRANSFER_DONE	0x0303	// Bytes transferred
+#define TRACE_HOST_RESET			0x0304
+
+// Report returned by the READ TRACE vendor command (all values big-endian)
+//   0      Report format (TRACE_REPORT_FORMAT)
+//   1      Entry size (TRACE_ENTRY_SIZE)
+//   2-3    Entries in the report
+//   4-7    Cycle counter clock (Hz)
+//   8-11   Events recorded since the trace was cleared (older ones were overwritten)
+//   12-15  Reserved
+//   16-    Entries, oldest first:
+//            0-1    Event ID
+//            2-3    Sequence number (low 16 bits of the event count)
+//            4-7    Cycle count
+//            8-19   Arguments 0-2
+#define TRACE_REPORT_FORMAT			1
+#define TRACE_REPORT_HEADER			16
+#define TRACE_ENTRY_SIZE			20
+#define TRACE_REPORT_LENGTH			(TRACE_REPORT_HEADER + TRACE_ENTRIES * TRACE_ENTRY_SIZE)
+
+extern volatile bool traceEnabled;
+
+// Record an event (only the test is inline, so a disabled trace costs a load and branch)
+#define TRACE(event, argument0, argument1, argument2) \
+	do { if (traceEnabled) traceRecord((event), (argument0), (argument1), (argument2)); } while (0)
+
+void traceClear(void);
+void traceRecord(uint16_t event, uint32_t argument0, uint32_t argument1, uint32_t argument2);
+uint16_t traceReportLength(void);
+void traceReadReport(uint8_t *buffer, uint16_t offset, uint16_t length);